@@ -0,0 +1,334 @@
+/**
+ * @file bench_macro.cpp
+ * @brief Сквозные бенчмарки на шаблонах стресс-теста и точка входа bin/bench
+ *
+ * Для каждого шаблона из test/source/stress-test-templates нагрузка генерируется
+ * программой bin/stressgen в нескольких масштабах (количество повторений групп
+ * умножается на коэффициент) и выполняется пулом потоков заданного размера.
+ * Шаблоны выполняются по порядку над одной коллекцией, как в test/stress,
+ * но замеряется только выполнение текущего шаблона.
+ *
+ * Дополнительные параметры (помимо параметров Google Benchmark):
+ *
+ * * --macro_scales=0.01,0.1 - коэффициенты масштабирования шаблонов;
+ * * --macro_threads=1,2,4   - размеры пула потоков;
+ * * --macro_arena=heap,thp  - источники памяти посетителей: heap - обычная куча,
+ *   thp, hugetlb и plain - tp::Arena с соответствующим режимом больших страниц.
+ *
+ * Кроме количества команд и их частоты выводятся счётчики страничных
+ * прерываний (minor_faults, major_faults) за замер и размер резидентной
+ * памяти процесса (rss_mb) после него.
+ *
+ * Результаты в машиночитаемом виде: --benchmark_format=json
+ * или --benchmark_out=<файл> --benchmark_out_format=json.
+ *
+ */
+
+#include "hw/l2_ApplicationLayer.h"
+#include "tp/Arena.h"
+#include "tp/ThreadPool.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory_resource>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace
+{
+
+const std::string TEMPLATES_DIR  = std::string(LAB_SOURCE_DIR) + "/test/source/stress-test-templates";
+const std::string STRESSGEN_PATH = std::string(LAB_SOURCE_DIR) + "/bin/stressgen";
+
+class NullOutput : public IOutput
+{
+public:
+    virtual void Output(std::string ) const override {}
+};
+
+using Workload = std::vector<std::string>;
+
+std::string scaleTemplate(const std::string & text, double scale)
+{
+    std::istringstream is(text);
+    std::string        result;
+
+    for(std::string line; std::getline(is,line); ) {
+        if (line.size() > 1 && line[0] == '#'
+         && std::all_of(line.begin()+1, line.end(), [](char c){ return c >= '0' && c <= '9'; })) {
+            long long repetitions = std::max(1LL, static_cast<long long>(std::stoll(line.substr(1)) * scale));
+            result += '#';
+            result += std::to_string(repetitions);
+            result += '\n';
+            continue;
+        }
+        result += line;
+        result += '\n';
+    }
+
+    return result;
+}
+
+Workload generateWorkload(const std::filesystem::path & template_file, double scale)
+{
+    std::ifstream      ifs(template_file);
+    std::ostringstream text;
+    text << ifs.rdbuf();
+
+    char tmp_name[] = "/tmp/lab-bench-XXXXXX";
+    int  fd         = mkstemp(tmp_name);
+    if (fd < 0)
+        return {};
+
+    std::string scaled = scaleTemplate(text.str(), scale);
+    bool        written = write(fd, scaled.data(), scaled.size()) == static_cast<ssize_t>(scaled.size());
+    close(fd);
+
+    Workload workload;
+
+    if (written) {
+        std::string command = STRESSGEN_PATH + " < " + tmp_name;
+        FILE *      pipe    = popen(command.c_str(), "r");
+
+        if (pipe != nullptr) {
+            std::string line;
+            for(int c; (c = std::fgetc(pipe)) != EOF; )
+                if (c != '\n')
+                    line += static_cast<char>(c);
+                else if (line.empty())
+                    break;                  // bin/lab тоже останавливается на пустой строке
+                else {
+                    workload.push_back(line);
+                    line.clear();
+                }
+
+            while(std::fgetc(pipe) != EOF)
+                ;
+            pclose(pipe);
+        }
+    }
+
+    unlink(tmp_name);
+    return workload;
+}
+
+const Workload & cachedWorkload(const std::filesystem::path & template_file, double scale)
+{
+    static std::map<std::pair<std::string,double>,Workload> cache;
+
+    auto key = std::make_pair(template_file.string(), scale);
+    auto it  = cache.find(key);
+    if (it == cache.end())
+        it = cache.emplace(key, generateWorkload(template_file, scale)).first;
+
+    return it->second;
+}
+
+void runWorkload(ItemCollector & col, const Workload & workload, int number_of_threads)
+{
+    static const NullOutput out;
+
+    tp::ThreadPool pool(number_of_threads);
+    pool.start();
+
+    for(const std::string & line : workload)
+        pool.submit(new Application(col, line, out, &pool));
+}
+
+/// Источник памяти посетителей по имени параметра --macro_arena, heap - без арены
+std::optional<tp::Arena::HugePages> arenaMode(const std::string & name)
+{
+    if (name == "thp")     return tp::Arena::HugePages::Transparent;
+    if (name == "hugetlb") return tp::Arena::HugePages::Explicit;
+    if (name == "plain")   return tp::Arena::HugePages::None;
+    return std::nullopt;
+}
+
+/**
+ * @brief Арена посетителей на время замера
+ *
+ * @details Заменяет источник памяти доменных объектов и восстанавливает прежний
+ * при разрушении, поэтому должна создаваться до коллекции.
+ *
+ */
+class ScopedDomainArena
+{
+    std::unique_ptr<tp::Arena>                            _arena;
+    std::unique_ptr<std::pmr::synchronized_pool_resource> _pool;
+    std::pmr::memory_resource *                           _previous = domainResource();
+
+public:
+    explicit ScopedDomainArena(const std::string & name)
+    {
+        std::optional<tp::Arena::HugePages> mode = arenaMode(name);
+        if (!mode.has_value())
+            return;
+
+        _arena = std::make_unique<tp::Arena>(*mode);
+        _pool  = std::make_unique<std::pmr::synchronized_pool_resource>(std::pmr::pool_options {0, size_t(1) << 16}, _arena.get());
+        setDomainResource(_pool.get());
+    }
+
+    ScopedDomainArena(const ScopedDomainArena &) = delete;
+    ScopedDomainArena & operator=(const ScopedDomainArena &) = delete;
+
+    ~ScopedDomainArena() { setDomainResource(_previous); }
+};
+
+struct MemoryCounters
+{
+    long   minor_faults = 0;
+    long   major_faults = 0;
+    double rss_mb       = 0;
+
+    static MemoryCounters current()
+    {
+        MemoryCounters counters;
+
+        rusage usage {};
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            counters.minor_faults = usage.ru_minflt;
+            counters.major_faults = usage.ru_majflt;
+        }
+
+        // Второе поле /proc/self/statm - резидентные страницы
+        std::ifstream statm("/proc/self/statm");
+        long          size = 0, resident = 0;
+        if (statm >> size >> resident)
+            counters.rss_mb = double(resident) * double(sysconf(_SC_PAGESIZE)) / (1 << 20);
+
+        return counters;
+    }
+};
+
+void macroBenchmark(benchmark::State & state, std::vector<std::filesystem::path> templates, double scale, int number_of_threads,
+                    std::string arena)
+{
+    ScopedDomainArena domain_arena(arena);
+
+    // Предыдущие шаблоны готовят коллекцию и в замер не входят
+    ItemCollector col;
+    for(size_t i=0; i+1 < templates.size(); ++i)
+        runWorkload(col, cachedWorkload(templates[i], scale), number_of_threads);
+
+    const Workload & workload = cachedWorkload(templates.back(), scale);
+    if (workload.empty()) {
+        state.SkipWithError(("Не удалось сгенерировать нагрузку с помощью " + STRESSGEN_PATH).c_str());
+        return;
+    }
+
+    MemoryCounters before = MemoryCounters::current();
+
+    for(auto _ : state)
+        runWorkload(col, workload, number_of_threads);
+
+    MemoryCounters after = MemoryCounters::current();
+
+    state.counters["commands"]     = workload.size();
+    state.counters["ops_per_sec"]  = benchmark::Counter(state.iterations() * workload.size(), benchmark::Counter::kIsRate);
+    state.counters["minor_faults"] = after.minor_faults - before.minor_faults;
+    state.counters["major_faults"] = after.major_faults - before.major_faults;
+    state.counters["rss_mb"]       = after.rss_mb;
+}
+
+std::vector<std::string> splitList(const std::string & str)
+{
+    std::vector<std::string> res;
+    std::istringstream       is(str);
+    for(std::string item; std::getline(is, item, ','); )
+        if (!item.empty())
+            res.push_back(item);
+    return res;
+}
+
+void registerMacroBenchmarks(const std::vector<double> & scales, const std::vector<int> & thread_counts,
+                             const std::vector<std::string> & arenas)
+{
+    std::vector<std::filesystem::path> templates;
+
+    std::error_code ec;
+    for(const auto & entry : std::filesystem::directory_iterator(TEMPLATES_DIR, ec))
+        if (entry.path().extension() == ".test")
+            templates.push_back(entry.path());
+
+    std::sort(templates.begin(), templates.end());
+
+    for(const std::string & arena : arenas)
+        for(double scale : scales)
+            for(int threads : thread_counts)
+                for(size_t i=0; i < templates.size(); ++i) {
+                    std::ostringstream name;
+                    name << "Macro/" << templates[i].filename().string() << "/scale:" << scale << "/threads:" << threads;
+                    if (arena != "heap")
+                        name << "/arena:" << arena;
+
+                    std::vector<std::filesystem::path> sequence(templates.begin(), templates.begin() + i + 1);
+
+                    benchmark::RegisterBenchmark(name.str().c_str(), macroBenchmark, sequence, scale, threads, arena)
+                        ->Iterations(1)
+                        ->Unit(benchmark::kMillisecond)
+                        ->UseRealTime();
+                }
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+    std::vector<double>      scales        { 0.01, 0.1 };
+    std::vector<int>         thread_counts { 1, 2, 4 };
+    std::vector<std::string> arenas        { "heap" };
+
+    int hardware = std::thread::hardware_concurrency();
+    if (hardware > 4)
+        thread_counts.push_back(hardware);
+
+    // Собственные параметры разбираем и убираем до передачи остальных в Google Benchmark
+    int rest = 1;
+    for(int i=1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--macro_scales=", 0) == 0) {
+            scales.clear();
+            for(const std::string & s : splitList(arg.substr(arg.find('=')+1)))
+                scales.push_back(std::stod(s));
+        }
+        else if (arg.rfind("--macro_threads=", 0) == 0) {
+            thread_counts.clear();
+            for(const std::string & s : splitList(arg.substr(arg.find('=')+1)))
+                thread_counts.push_back(std::stoi(s));
+        }
+        else if (arg.rfind("--macro_arena=", 0) == 0) {
+            arenas.clear();
+            for(const std::string & s : splitList(arg.substr(arg.find('=')+1)))
+                if (s == "heap" || arenaMode(s).has_value())
+                    arenas.push_back(s);
+                else {
+                    std::cerr << "Недопустимый источник памяти '" << s << "'" << std::endl;
+                    return 1;
+                }
+        }
+        else
+            argv[rest++] = argv[i];
+    }
+    argc = rest;
+
+    registerMacroBenchmarks(scales, thread_counts, arenas);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
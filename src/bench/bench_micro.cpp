@@ -0,0 +1,283 @@
+/**
+ * @file bench_micro.cpp
+ * @brief Микро-бенчмарки пула потоков, коллекции и доменных объектов
+ *
+ */
+
+#include "hw/l2_ApplicationLayer.h"
+#include "tp/ThreadPool.h"
+
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+
+namespace
+{
+
+class NoopTask : public tp::Task_interface
+{
+public:
+    virtual void work() override {}
+};
+
+const size_t POOL_BATCH_SIZE = 10000;
+
+/// Коллекция из size посетителей по 5 визитов, привязанная к временному файлу данных
+void fillCollection(ItemCollector & col, size_t size, const std::string & file_name)
+{
+    std::filesystem::remove(file_name);
+    col.loadCollection(file_name);
+
+    for(size_t i=0; i < size; ++i) {
+        std::vector<Visit> visits;
+        for(int v=0; v < 5; ++v)
+            visits.push_back(Visit(2000 + int(i % 20), 1 + v, 1 + int(i % 28)));
+        col.addItem(Person("Иван_Иванов", visits));
+    }
+}
+
+std::string benchDataFile()
+{
+    return (std::filesystem::temp_directory_path() / "bench_micro.data").string();
+}
+
+}
+
+static void BM_ThreadsafeQueue_PushPop(benchmark::State & state)
+{
+    tp::ThreadsafeQueue<int> queue;
+    int                      value = 0;
+
+    for(auto _ : state) {
+        queue.push(value);
+        queue.try_pop(value);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ThreadsafeQueue_PushPop);
+
+static void BM_ThreadsafeQueue_ProducerConsumer(benchmark::State & state)
+{
+    const int count = 100000;
+
+    for(auto _ : state) {
+        tp::ThreadsafeQueue<int> queue;
+
+        std::thread consumer([&queue]{
+            int value = 0;
+            for(int i=0; i < count; ++i)
+                queue.wait_and_pop(value);
+        });
+
+        for(int i=0; i < count; ++i)
+            queue.push(i);
+
+        consumer.join();
+    }
+
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_ThreadsafeQueue_ProducerConsumer)->UseRealTime();
+
+static void BM_ThreadPool_Submit(benchmark::State & state)
+{
+    for(auto _ : state) {
+        tp::ThreadPool pool(state.range(0));
+        pool.start();
+
+        for(size_t i=0; i < POOL_BATCH_SIZE; ++i)
+            pool.submit(new NoopTask);
+
+        // Деструктор пула дожидается выполнения всех задач
+    }
+
+    state.SetItemsProcessed(state.iterations() * POOL_BATCH_SIZE);
+}
+BENCHMARK(BM_ThreadPool_Submit)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+static void BM_Collector_AddItem(benchmark::State & state)
+{
+    ItemCollector col;
+
+    for(auto _ : state)
+        col.addItem(Person("Иван_Иванов"));
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Collector_AddItem);
+
+static void BM_Collector_GetItem(benchmark::State & state)
+{
+    ItemCollector col;
+    const size_t  size = state.range(0);
+
+    for(size_t i=0; i < size; ++i)
+        col.addItem(Person("Иван_Иванов"));
+
+    size_t index = 0;
+    for(auto _ : state) {
+        auto item = col.getItem(index % size + 1);
+        benchmark::DoNotOptimize(item.get());
+        index ++;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Collector_GetItem)->Arg(1000)->Arg(100000);
+
+static void BM_Snapshot_Find(benchmark::State & state)
+{
+    ItemCollector col;
+    const size_t  size = state.range(0);
+
+    for(size_t i=0; i < size; ++i)
+        col.addItem(Person("Иван_Иванов"));
+
+    std::shared_ptr<const CollectionSnapshot> snapshot = col.snapshot();
+
+    size_t index = 0;
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(snapshot->find(index % size + 1));
+        index ++;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Snapshot_Find)->Arg(1000)->Arg(100000);
+
+static void BM_CollectorAdapter_GetItem(benchmark::State & state)
+{
+    ItemCollector                   col;
+    CollectorAdapter<ItemCollector> adapter(col);
+    const ACollector &              collector = adapter;
+    const size_t                    size = state.range(0);
+
+    for(size_t i=0; i < size; ++i)
+        col.addItem(Person("Иван_Иванов"));
+
+    size_t index = 0;
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(collector.getItem(index % size + 1));
+        index ++;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CollectorAdapter_GetItem)->Arg(1000);
+
+static void BM_Collector_Save(benchmark::State & state)
+{
+    ItemCollector     col;
+    const std::string file_name = benchDataFile();
+
+    fillCollection(col, state.range(0), file_name);
+
+    for(auto _ : state)
+        col.saveCollection();
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * std::filesystem::file_size(file_name));
+    std::filesystem::remove(file_name);
+}
+BENCHMARK(BM_Collector_Save)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_Collector_Load(benchmark::State & state)
+{
+    const std::string file_name = benchDataFile();
+    {
+        ItemCollector col;
+        fillCollection(col, state.range(0), file_name);
+        col.saveCollection();
+    }
+
+    for(auto _ : state) {
+        ItemCollector col;
+        col.loadCollection(file_name);
+        benchmark::DoNotOptimize(col.getSize());
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * std::filesystem::file_size(file_name));
+    std::filesystem::remove(file_name);
+}
+BENCHMARK(BM_Collector_Load)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_Application_Split(benchmark::State & state)
+{
+    const std::string command = "av 12345 2020 12 04";
+
+    for(auto _ : state)
+        benchmark::DoNotOptimize(Application::split(command));
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Application_Split);
+
+static void BM_Person_AddVisit(benchmark::State & state)
+{
+    Person p("Иван_Иванов");
+
+    for(auto _ : state)
+        p.addVisit(Visit(2020,12,4));
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Person_AddVisit);
+
+static void BM_Person_AddVisits(benchmark::State & state)
+{
+    Person                   p("Иван_Иванов");
+    const std::vector<Visit> visits(state.range(0), Visit(2020,12,4));
+
+    for(auto _ : state)
+        p.addVisits(visits);
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Person_AddVisits)->Arg(16)->Arg(256);
+
+static void BM_Person_GetVisits(benchmark::State & state)
+{
+    Person p("Иван_Иванов");
+
+    for(int64_t i=0; i < state.range(0); ++i)
+        p.addVisit(Visit(2020,12,4));
+
+    for(auto _ : state)
+        benchmark::DoNotOptimize(p.getVisits());
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Person_GetVisits)->Arg(10)->Arg(1000);
+
+static void BM_Person_ForEachVisit(benchmark::State & state)
+{
+    Person p("Иван_Иванов");
+
+    for(int64_t i=0; i < state.range(0); ++i)
+        p.addVisit(Visit(2020,12,4));
+
+    for(auto _ : state) {
+        int days = 0;
+        p.forEachVisit([&](const Visit & v) { days += v.getDay(); });
+        benchmark::DoNotOptimize(days);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Person_ForEachVisit)->Arg(10)->Arg(1000);
+
+static void BM_Person_WithVisits(benchmark::State & state)
+{
+    Person p("Иван_Иванов");
+
+    for(int64_t i=0; i < state.range(0); ++i)
+        p.addVisit(Visit(2020,12,4));
+
+    for(auto _ : state)
+        benchmark::DoNotOptimize(p.withVisits([](std::span<const Visit> visits) { return visits.size(); }));
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Person_WithVisits)->Arg(10)->Arg(1000);
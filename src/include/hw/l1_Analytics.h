@@ -0,0 +1,32 @@
+#ifndef HW_L1_ANALYTICS_H
+#define HW_L1_ANALYTICS_H
+
+#include "hw/l2_ApplicationLayer.h"
+
+#include <istream>
+#include <string>
+
+/**
+ * Режим аналитики: команды count, view, report, visited, visits_between и last_visit
+ * выполняются над коллекцией, которую процесс-писатель публикует в сегменте
+ * разделяемой памяти:
+ *
+ *     bin/lab --shm=lab --server=lab.sock --save-interval=10   # писатель
+ *     bin/lab --attach=lab < report.txt                        # аналитика
+ *
+ * Писатель публикует коллекцию после загрузки и при каждом сохранении
+ * (см. ItemCollector::publish). Процесс аналитики не загружает и не сохраняет
+ * файл данных и не блокирует писателя: каждая команда читает последнюю
+ * опубликованную версию прямо из сегмента (см. SharedSegment::read).
+ * Команды, изменяющие коллекцию, в этом режиме недоступны.
+ */
+
+/**
+ * @brief Выполнение текстового пакета команд над опубликованной коллекцией
+ *
+ * @return int Код завершения программы.
+ *
+ */
+int runAnalytics(const std::string & segment_name, std::istream & input, const IOutput & out);
+
+#endif // HW_L1_ANALYTICS_H
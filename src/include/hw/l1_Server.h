@@ -0,0 +1,47 @@
+#ifndef HW_L1_SERVER_H
+#define HW_L1_SERVER_H
+
+#include "hw/l2_ApplicationLayer.h"
+
+#include <string>
+
+/**
+ * Режим сервера: коллекция и пул потоков остаются в памяти между пакетами команд.
+ *
+ * Сервер принимает соединения на локальном (Unix domain) сокете. Клиент передаёт
+ * пакет команд в текстовом виде и закрывает передачу (или передаёт пустую строку),
+ * после выполнения всех команд пакета сервер отправляет вывод, завершённый строкой
+ * "Выполнение команд завершено", и закрывает соединение:
+ *
+ *     bin/lab --connect=lab.sock < batch.txt
+ *     socat - UNIX-CONNECT:lab.sock < batch.txt
+ *
+ * Коллекция сохраняется командой save, периодически (save_interval секунд,
+ * если значение больше нуля) и при завершении по SIGINT/SIGTERM.
+ */
+
+struct ServerOptions
+{
+    std::string socket_path;
+    int         number_of_threads = -1;
+    int         save_interval     = 0;
+};
+
+/**
+ * @brief Цикл обработки соединений, возвращает управление после SIGINT/SIGTERM
+ *
+ * @return int Код завершения программы.
+ *
+ */
+int runServer(ItemCollector & col, const ServerOptions & options);
+
+/**
+ * @brief Передача пакета команд из стандартного ввода серверу и вывод ответа
+ *
+ * @return int Код завершения программы: не ноль, если сервер недоступен или закрыл
+ * соединение, не выполнив пакет.
+ *
+ */
+int runClient(const std::string & socket_path);
+
+#endif // HW_L1_SERVER_H
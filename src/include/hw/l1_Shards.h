@@ -0,0 +1,54 @@
+#ifndef HW_L1_SHARDS_H
+#define HW_L1_SHARDS_H
+
+#include "hw/l2_ApplicationLayer.h"
+
+#include <istream>
+#include <string>
+
+/**
+ * Режим сегментов: коллекция делится по индексам посетителей между несколькими
+ * процессами (см. IndexShard), каждый со своими мьютексами, распределителем
+ * памяти и файлом данных <файл данных>.<номер сегмента>:
+ *
+ *     bin/lab --shards=4 < batch.txt
+ *
+ * Процесс-маршрутизатор запускает процессы сегментов и обменивается с ними
+ * сообщениями через пары Unix-сокетов. Команды с индексом посетителя передаются
+ * сегменту этого посетителя, индексы новых посетителей назначает маршрутизатор.
+ * Команды count, view, report, visited, save, compact и import передаются всем
+ * сегментам, их ответы объединяются. Команды передаются сегментам без ожидания
+ * ответов, каждый сегмент выполняет их по порядку, а вывод маршрутизатора
+ * следует порядку команд пакета.
+ *
+ * Количество сегментов нужно сохранять между запусками: от него зависит,
+ * какому файлу принадлежит посетитель.
+ */
+
+struct ShardOptions
+{
+    size_t      number_of_shards  = 1;
+    std::string data_file_name;
+    int         number_of_threads = -1;     ///< размер пула потоков каждого сегмента
+    bool        compact_on_save   = false;
+    bool        statistics        = false;
+    size_t      memory_budget     = 0;      ///< бюджет памяти посетителей на все сегменты, 0 - без ограничения
+    std::string page_file_name;             ///< файл страниц сегмента - <имя>.<номер сегмента>
+    VisitOrder  visit_order       = VisitOrder::Insertion;
+};
+
+/**
+ * @brief Выполнение пакета команд в режиме сегментов
+ *
+ * @param input Пакет команд: текстовый или двоичный (см. hw/l4_BinaryWorkload.h).
+ * Сегменты сохраняют коллекцию по окончании пакета.
+ *
+ * @return int Код завершения программы.
+ *
+ */
+int runShards(std::string_view input, const ShardOptions & options, const IOutput & out);
+
+/// Текстовый пакет команд из потока, читается по мере выполнения
+int runShards(std::istream & input, const ShardOptions & options, const IOutput & out);
+
+#endif // HW_L1_SHARDS_H
@@ -2,10 +2,17 @@
 #define HW_L2_APPLICATION_LAYER_H
 
 #include "hw/l3_DomainLayer.h"
+#include "hw/l4_BinaryWorkload.h"
 #include "tp/Task_interface.h"
 
+#include <functional>
 #include <string>
 
+namespace tp { class ThreadPool; }
+
+/// Наибольшее количество строк вывода команд view, report, visited и visits_between по умолчанию
+const int OUTPUT_LIMIT = 1000;
+
 class IOutput
 {
 public:
@@ -14,27 +21,159 @@ public:
     virtual void Output(std::string s) const = 0;
 };
 
-class Application : public tp::Task_interface
+/**
+ * @brief Задача пакета команд, которую можно выполнить и сопрограммой (--async)
+ *
+ */
+class CommandTask : public tp::Task_interface
+{
+public:
+    /// Выполнение сопрограммой; по умолчанию - так же, как work
+    virtual tp::Task<void> workAsync();
+};
+
+/**
+ * @brief Разобранная команда: код и аргументы
+ *
+ */
+struct Command
+{
+    Opcode      opcode = Opcode::Invalid;
+    uint8_t     argc   = 0;
+    int64_t     args[MAX_COMMAND_ARGS] {};
+    std::string alias;
+};
+
+class Application : public CommandTask
 {
     ItemCollector & _col;
-    std::string     _command;
+    std::string     _text;
+    Command         _command;
     const IOutput & _out;
+    tp::ThreadPool * _pool;
+    bool             _malformed = false;   ///< двоичная запись с недопустимым количеством аргументов
 
-    std::vector<std::string> split(const std::string & str);
+    /// Разбор текстовой команды; false, если команду выполнять не нужно (сообщение уже выведено)
+    bool prepare();
+
+    void execute();
+
+    tp::Task<void> executeAsync();
+
+    template<typename T, typename Map, typename Reduce>
+    T scan(size_t size, Map map, Reduce reduce) const;
+
+    /// Последовательный просмотр частями по SCAN_GRAIN с передачей потока между частями
+    template<typename T, typename Map, typename Reduce>
+    tp::Task<T> scanAsync(size_t size, Map map, Reduce reduce) const;
 
 public:
+    static std::vector<std::string> split(const std::string & str);
+
+    /**
+     * @brief Разбор текстовой команды
+     *
+     * @return false Строка пуста, команда недопустима или её аргументы не являются
+     * числами (сообщение об ошибке передано в out).
+     *
+     */
+    static bool parse(const std::string & text, Command & command, const IOutput & out);
+
+    /// Строки вывода команды view для одного посетителя
+    static std::string formatPerson(size_t index, const PersonView & person, size_t visits_limit);
+
+    /// Строки вывода команды view для посетителя, заданного псевдонимом и визитами
+    static std::string formatPerson(size_t index, std::string_view alias, std::span<const Visit> visits, size_t visits_limit);
+
+    /// Строки вывода команды visits_between: даты визитов (не больше OUTPUT_LIMIT) и их количество
+    static QueryResult formatVisitsBetween(std::span<const Visit> visits);
+
+    /// Строка вывода команды last_visit
+    static std::string formatLastVisit(const std::optional<Visit> & last);
+
     Application() = delete;
     Application(const Application &) = delete;
 
     Application & operator=(const Application &) = delete;
 
-    Application(ItemCollector & col, const std::string & command, const IOutput & out)
+    /**
+     * @brief Команда пакета
+     *
+     * @param pool Пул потоков, в котором выполняются команды пакета. Если задан,
+     * команды view и report просматривают коллекцию параллельно его потоками.
+     *
+     */
+    Application(ItemCollector & col, const std::string & command, const IOutput & out, tp::ThreadPool * pool = nullptr)
         : _col(col)
-        , _command(command)
+        , _text(command)
         , _out(out)
+        , _pool(pool)
     {}
 
+    /// Команда из двоичного пакета: текстовый разбор не выполняется
+    Application(ItemCollector & col, const WorkloadRecord & record, const IOutput & out, tp::ThreadPool * pool = nullptr);
+
     virtual void work() override;
+
+    /**
+     * @brief Выполнение команды сопрограммой
+     *
+     * @details Команды count, add, add_visit, remove, update, view и report
+     * ожидают блокировку коллекции, не занимая поток пула, а view и report
+     * уступают поток после каждой части просмотра снимка. Остальные команды
+     * выполняются так же, как work. Объект должен жить до завершения сопрограммы.
+     *
+     */
+    virtual tp::Task<void> workAsync() override;
+};
+
+/**
+ * @brief Объединение подряд идущих команд add_visit по посетителям
+ *
+ * @details Входной этап передаёт команды пакета методу add. Подряд идущие
+ * команды add_visit (не больше window) накапливаются. Перед любой другой
+ * командой, при заполнении окна и при вызове flush накопленные визиты
+ * группируются по посетителям и передаются на выполнение задачами, которые
+ * добавляют визиты группы одним вызовом ItemCollector::addVisits. Визиты
+ * одного посетителя добавляются в порядке команд, а визиты разных посетителей
+ * не зависят друг от друга, поэтому состояние коллекции то же, что при
+ * выполнении команд по одной.
+ *
+ */
+class VisitCoalescer
+{
+public:
+    /// Передача задачи на выполнение, например tp::ThreadPool::submit или сопрограммой (CommandTask::workAsync)
+    using Submit = std::function<void(CommandTask *)>;
+
+    static constexpr size_t DEFAULT_WINDOW = 1024;
+
+private:
+    ItemCollector &     _col;
+    const IOutput &     _out;
+    tp::ThreadPool *    _pool;
+    Submit              _submit;
+    size_t              _window;
+    std::vector<size_t> _indices;
+    std::vector<Visit>  _visits;
+
+public:
+    VisitCoalescer(ItemCollector & col, const IOutput & out, tp::ThreadPool * pool, Submit submit,
+                   size_t window = DEFAULT_WINDOW);
+
+    VisitCoalescer(const VisitCoalescer &) = delete;
+    VisitCoalescer & operator=(const VisitCoalescer &) = delete;
+
+    ~VisitCoalescer() { flush(); }
+
+    /// Команда текстового пакета
+    void add(const std::string & line);
+
+    /// Команда двоичного пакета
+    void add(const WorkloadRecord & record);
+
+    /// Передача накопленных визитов на выполнение
+    void flush();
 };
 
 #endif // HW_L2_APPLICATION_LAYER_H
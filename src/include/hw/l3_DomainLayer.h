@@ -1,10 +1,23 @@
 #ifndef HW_L3_DOMAIN_LAYER_H
 #define HW_L3_DOMAIN_LAYER_H
 
-#include "hw/l4_InfrastructureLayer.h"
+#include "hw/l4_Collector.h"
+#include "hw/l4_SharedSegment.h"
+#include "tp/Bitmap.h"
+#include "tp/PageFile.h"
 
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <string_view>
 #include <vector>
 
+namespace tp { class ThreadPool; }
+
 const size_t MAX_NAME_LENGTH    = 50;
 const size_t MIN_YEAR_OF_BIRTH  = 1900;
 const size_t MAX_YEAR_OF_BIRTH  = 2019;
@@ -22,13 +35,182 @@ public:
     int getYear() const { return _year; }
     int getMonth() const { return _month; }
     int getDay() const { return _day; }
+
+    /// Сравнение по году, месяцу и дню, т.е. по дате
+    auto operator <=> (const Visit &) const = default;
+};
+
+/**
+ * @brief Источник памяти доменных объектов
+ *
+ * @details Из него выделяются псевдонимы и блоки визитов посетителей вместе
+ * со счётчиками ссылок, в том числе при загрузке коллекции и выполнении
+ * команд add и add_visit. По умолчанию - std::pmr::new_delete_resource().
+ * Заменяется до создания первого посетителя (например, на tp::Arena,
+ * см. bin/lab --arena) и должен жить дольше всех посетителей и снимков.
+ *
+ */
+std::pmr::memory_resource * domainResource();
+
+void setDomainResource(std::pmr::memory_resource * resource);
+
+/**
+ * @brief Блок визитов посетителя
+ *
+ * @details Блок только дополняется в пределах зарезервированной ёмкости, поэтому
+ * уже записанные элементы не перемещаются и могут читаться из снимка коллекции
+ * без блокировки. При заполнении блока создаётся новый, старый остаётся жить,
+ * пока на него ссылаются снимки. Новый блок берёт память из того же источника.
+ *
+ */
+using VisitBlock = std::pmr::vector<Visit>;
+
+/**
+ * @brief Порядок хранения визитов посетителя
+ *
+ * @details При Insertion визиты хранятся в порядке добавления. При Sorted
+ * и SortedUnique начало блока визитов упорядочено по дате, а визиты, добавленные
+ * не по порядку, накапливаются в конце блока и, когда их становится больше
+ * порядка корня из количества визитов, сливаются с упорядоченной частью
+ * в новом блоке. Запросы по датам (Person::visitsBetween, Person::lastVisit)
+ * находят визиты упорядоченной части двоичным поиском. При SortedUnique
+ * повторный визит с той же датой не добавляется.
+ *
+ */
+enum class VisitOrder { Insertion, Sorted, SortedUnique };
+
+/**
+ * @brief Хранилище посетителей, вытесненных из памяти (см. ItemCollector::setMemoryBudget)
+ *
+ * @details Вытесненный посетитель хранится записью файла страниц в формате
+ * файла данных, в памяти остаётся только его ячейка в коллекции. Хранилище
+ * учитывает память, занятую псевдонимами и визитами посетителей в памяти,
+ * а также частями снимков коллекции (оценку).
+ *
+ */
+class SpillStore : public std::enable_shared_from_this<SpillStore>
+{
+    tp::PageFile        _file;
+    size_t              _budget;
+    std::atomic<size_t> _resident {0};
+
+public:
+    SpillStore(const std::string & file_name, size_t budget)
+        : _file(file_name)
+        , _budget(budget)
+    {}
+
+    bool valid() const { return _file.valid(); }
+
+    tp::PageFile &       file()       { return _file; }
+    const tp::PageFile & file() const { return _file; }
+
+    size_t budget()   const { return _budget; }
+    size_t resident() const { return _resident.load(std::memory_order_relaxed); }
+
+    void charge(size_t bytes)  { _resident.fetch_add(bytes, std::memory_order_relaxed); }
+    void release(size_t bytes) { _resident.fetch_sub(bytes, std::memory_order_relaxed); }
+};
+
+/**
+ * @brief Запись вытесненного посетителя в файле страниц
+ *
+ * @details Разделяется посетителем и его копиями (Person::Frozen), зафиксированными,
+ * пока он был вытеснен, и освобождается вместе с последней ссылкой на неё,
+ * поэтому снимок коллекции читает запись без блокировки коллекции и после
+ * изменения посетителя. Запись продлевает жизнь хранилища.
+ *
+ */
+class SpilledRecord
+{
+    std::shared_ptr<SpillStore> _spill;
+    tp::PageFile::Ref           _ref;
+    size_t                      _alias_length;
+    size_t                      _visit_count;
+
+public:
+    SpilledRecord(std::shared_ptr<SpillStore> spill, tp::PageFile::Ref ref, size_t alias_length, size_t visit_count)
+        : _spill(std::move(spill))
+        , _ref(ref)
+        , _alias_length(alias_length)
+        , _visit_count(visit_count)
+    {}
+
+    ~SpilledRecord() { _spill->file().free(_ref); }
+
+    SpilledRecord(const SpilledRecord &) = delete;
+    SpilledRecord & operator=(const SpilledRecord &) = delete;
+
+    size_t aliasLength() const { return _alias_length; }
+    size_t visitCount()  const { return _visit_count; }
+
+    /// Чтение записи без копирования, см. tp::PageFile::withRecord
+    template<typename F>
+    auto withRecord(F && action) const { return _spill->file().withRecord(_ref, std::forward<F>(action)); }
 };
 
-class Person : public ICollectable
+/**
+ * @brief Посетитель
+ *
+ * @details Хранится в коллекции по значению. Псевдоним и блок визитов
+ * разделяются с зафиксированными копиями (Frozen), поэтому снимки коллекции
+ * и сохранение не зависят от времени жизни самого посетителя.
+ *
+ * Посетитель, подключённый к хранилищу (attach), может быть вытеснен в файл
+ * страниц (evict). Чтение вытесненного посетителя (withVisits и т.п.) разбирает
+ * его запись, не возвращая его в память, а зафиксированная копия (freeze)
+ * только разделяет запись (см. SpilledRecord). Изменение возвращает посетителя
+ * в память, а его запись освобождается, когда её не используют копии. Визиты
+ * вытесненного посетителя читаются в том же порядке, что до вытеснения.
+ *
+ */
+class Person
 {
-    std::string        _alias;
-    std::vector<Visit> _visits;
-    mutable std::mutex _visits_mutex;
+public:
+    /// Неупорядоченных визитов в конце блока, после которых они сливаются с упорядоченными, не меньше
+    static constexpr size_t MIN_UNSORTED_VISITS = 32;
+
+private:
+    std::shared_ptr<const std::string>   _alias;                  ///< nullptr - посетитель вытеснен
+    std::shared_ptr<VisitBlock>          _visits;
+    mutable std::mutex                   _visits_mutex;
+    SpillStore *                         _spill      = nullptr;
+    std::shared_ptr<const SpilledRecord> _page;                   ///< действительная копия в файле страниц
+    bool                                 _referenced = false;
+    VisitOrder                           _order      = VisitOrder::Insertion;
+    size_t                               _sorted     = 0;         ///< упорядоченное начало блока визитов, кроме VisitOrder::Insertion
+
+    static const tp::LockSite & lockSite();
+
+    /// Упорядочение блока визитов по _order, заменяет блок, если он не упорядочен
+    void sortLocked();
+
+    /// Новый блок визитов ёмкостью не меньше capacity: упорядоченная часть, слитая с концом блока
+    void mergeLocked(size_t capacity);
+
+    /// Замена заполненного блока новым, в котором поместятся needed визитов
+    void reserveLocked(size_t needed);
+
+    /// Добавление визита в упорядоченный блок
+    void insertSortedLocked(const Visit & visit);
+
+    /// Оценка памяти псевдонима и визитов, только под блокировкой посетителя в памяти
+    size_t residentBytesLocked() const;
+
+    /// Запись файла страниц: визиты сохраняют порядок посетителя
+    static void   writePage(ByteWriter & out, std::string_view alias, std::span<const Visit> visits);
+
+    /// Копия посетителя из записи файла страниц
+    static Person readPage(const SpilledRecord & page);
+
+    /// Копия посетителя из файла страниц, только под блокировкой вытесненного посетителя
+    Person readPageLocked() const { return readPage(*_page); }
+
+    bool   loadLocked();
+
+    /// Подготовка к изменению: посетитель возвращается в память, его запись освобождается
+    size_t beginChangeLocked();
+    void   endChangeLocked(size_t resident_before);
 
 protected:
     bool invariant() const;
@@ -39,25 +221,594 @@ public:
 
     Person & operator = (const Person & p) = delete;
 
-    Person(const std::string & alias);
-    Person(const std::string & alias, std::vector<Visit> visits);
+    Person(const std::string & alias, std::pmr::memory_resource * resource = domainResource());
+    Person(const std::string & alias, std::span<const Visit> visits, std::pmr::memory_resource * resource = domainResource());
+
+    /// Посетитель с готовым блоком визитов, память берётся из источника блока
+    Person(const std::string & alias, VisitBlock visits);
+
+    /// Перемещение в коллекцию, перемещаемый посетитель не должен быть доступен другим потокам
+    Person(Person && p) noexcept;
+
+    ~Person();
+
+    /**
+     * @brief Неизменяемое состояние посетителя
+     *
+     * @details Блок визитов только дополняется, поэтому копия разделяет его
+     * с посетителем вместе с количеством записанных визитов. Копия вытесненного
+     * посетителя разделяет его запись в файле страниц и разбирает её только
+     * при обращении к данным (withData), уже без блокировки коллекции.
+     *
+     */
+    struct Frozen
+    {
+        std::shared_ptr<const std::string>   alias;     ///< nullptr - посетитель вытеснен, данные в page
+        std::shared_ptr<const VisitBlock>    visits;
+        size_t                               visit_count;
+        std::shared_ptr<const SpilledRecord> page;
 
-    const std::string & getAlias() const;
+        size_t aliasLength() const { return alias != nullptr ? alias->size() : page->aliasLength(); }
 
-    void setVisits(std::vector<Visit> visits);
+        /**
+         * @brief Доступ к псевдониму и визитам
+         *
+         * @details action(std::string_view, std::span<const Visit>) вызывается
+         * с данными копии, для вытесненного посетителя - с разобранной записью
+         * (визиты в порядке посетителя, см. writePage), его результат возвращается.
+         *
+         */
+        template<typename F>
+        auto withData(F && action) const
+        {
+            if (alias != nullptr)
+                return action(std::string_view(*alias), std::span<const Visit>(visits->data(), visit_count));
+
+            Person copy = readPage(*page);
+            return action(std::string_view(*copy._alias), std::span<const Visit>(*copy._visits));
+        }
+    };
+
+    std::string getAlias() const;
+
+    /// Замена псевдонима, визиты не изменяются
+    void setAlias(const std::string & alias);
+
+    void setVisits(std::span<const Visit> visits);
     void addVisit(const Visit & visit);
+
+    /// Добавление визитов под одной блокировкой с однократным резервированием памяти
+    void addVisits(std::span<const Visit> visits);
+
     std::vector<Visit> getVisits() const;
 
-    virtual bool   write(std::ostream& os) override;
+    size_t visitCount() const;
+
+    /**
+     * @brief Обход визитов без копирования
+     *
+     * @details action(const Visit &) вызывается под блокировкой посетителя,
+     * поэтому не должно изменять этого посетителя.
+     *
+     */
+    template<typename F>
+    void forEachVisit(F && action) const
+    {
+        withVisits([&](std::span<const Visit> visits) {
+            for(const Visit & v : visits)
+                action(v);
+        });
+    }
+
+    /**
+     * @brief Доступ ко всем визитам без копирования
+     *
+     * @details action(std::span<const Visit>) вызывается под блокировкой
+     * посетителя, его результат возвращается.
+     *
+     */
+    template<typename F>
+    auto withVisits(F && action) const
+    {
+        tp::MeasuredLock locker(_visits_mutex, lockSite());
+        if (_alias != nullptr)
+            return action(std::span<const Visit>(*_visits));
+
+        Person copy = readPageLocked();
+        return action(std::span<const Visit>(*copy._visits));
+    }
+
+    /// Текущий блок визитов и количество записанных в нём элементов
+    std::pair<std::shared_ptr<const VisitBlock>,size_t> visitBlock() const;
+
+    Frozen freeze() const;
+
+    /**
+     * @brief Смена порядка хранения визитов, см. VisitOrder
+     *
+     * @details Визиты упорядочиваются (при SortedUnique - и без повторов) в новом блоке.
+     *
+     */
+    void setVisitOrder(VisitOrder order);
+
+    /// Визиты с датами в диапазоне [from, to] по возрастанию даты
+    std::vector<Visit> visitsBetween(const Visit & from, const Visit & to) const;
+
+    /// Визит с наибольшей датой, std::nullopt - визитов нет
+    std::optional<Visit> lastVisit() const;
+
+    /**
+     * @brief Визиты из visits с датами в диапазоне [from, to] по возрастанию даты
+     *
+     * @details Первые sorted визитов упорядочены по дате и просматриваются
+     * двоичным поиском, остальные - подряд.
+     *
+     */
+    static std::vector<Visit> selectBetween(std::span<const Visit> visits, size_t sorted, const Visit & from, const Visit & to);
+
+    /// Визит с наибольшей датой из visits, первые sorted визитов упорядочены по дате
+    static std::optional<Visit> selectLast(std::span<const Visit> visits, size_t sorted);
+
+    /**
+     * @brief Подключение к хранилищу вытесненных посетителей
+     *
+     * @details Память посетителя учитывается хранилищем, после чего он может быть вытеснен.
+     *
+     */
+    void attach(SpillStore * spill);
+
+    /// Отключение от хранилища перед его разрушением, вытесненный посетитель теряет данные
+    void detach();
+
+    /// Посетитель в памяти, а не только в файле страниц
+    bool resident() const;
+
+    /// Возвращение в память; true - посетитель был вытеснен
+    bool load();
+
+    /// Вытеснение в файл страниц; false - посетитель не подключён к хранилищу или файл заполнен
+    bool evict();
+
+    /// Признак обращения (load или изменения) с прошлой проверки, сбрасывается; см. ItemCollector::evictLocked
+    bool clearReferenced();
+
+    /// Запись зафиксированного посетителя, см. Collectable
+    static bool write(ByteWriter & out, const Frozen & frozen);
+
+    /// Запись посетителя в формате DATA_FORMAT_CURRENT
+    static bool writeRecord(ByteWriter & out, std::string_view alias, std::span<const Visit> visits);
+
+    /// Чтение посетителя, при повреждённых данных - std::nullopt
+    static std::optional<Person> read(ByteReader & in, DataFormat format, std::pmr::memory_resource * resource = domainResource());
+};
+
+
+/**
+ * @brief Посетитель в снимке коллекции
+ *
+ */
+class PersonView
+{
+    size_t         _index;
+    Person::Frozen _person;
+
+public:
+    PersonView(size_t index, Person::Frozen person)
+        : _index(index)
+        , _person(std::move(person))
+    {}
+
+    size_t index()       const { return _index; }
+    size_t visitCount()  const { return _person.visit_count; }
+    size_t aliasLength() const { return _person.aliasLength(); }
+
+    /// Доступ к псевдониму и визитам, вытесненный посетитель читается из файла страниц; см. Person::Frozen::withData
+    template<typename F>
+    auto withData(F && action) const { return _person.withData(std::forward<F>(action)); }
+
+    /// Копия псевдонима, см. withData
+    std::string alias() const
+    {
+        return withData([](std::string_view alias, std::span<const Visit>) { return std::string(alias); });
+    }
+};
+
+/// Строки вывода команды, см. CollectionSnapshot::cachedResult
+using QueryResult = std::vector<std::string>;
+
+/// Часть снимка: неудалённые посетители одного сляба коллекции в порядке индексов
+using SnapshotChunk = std::vector<PersonView>;
+
+/**
+ * @brief Неизменяемая версия коллекции
+ *
+ * @details Содержит неудалённых посетителей в порядке индексов. Снимок состоит
+ * из неизменяемых частей по слябам коллекции (см. Collector::SLAB_SIZE): под
+ * блокировкой коллекции заново строятся только части слябов, изменённых после
+ * прошлого снимка, остальные разделяются с ним. Затем снимок читается без
+ * блокировок, пока писатели продолжают изменять коллекцию.
+ *
+ * Снимок хранит результаты запросов к нему (например, вывод view и report)
+ * по ключу, составленному из команды и аргументов. Снимок заменяется новым
+ * при любом изменении коллекции (см. Collector::touch), поэтому результаты
+ * действительны, пока он возвращается ItemCollector::snapshot.
+ *
+ */
+class CollectionSnapshot
+{
+public:
+    static constexpr size_t MAX_CACHED_RESULTS = 64;
+    static constexpr size_t MAX_CACHED_BYTES   = size_t(64) << 20;
+
+    /// Последовательный обход посетителей снимка по частям
+    class Iterator
+    {
+        const CollectionSnapshot * _snapshot;
+        size_t                     _chunk;
+        size_t                     _pos;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = PersonView;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const PersonView *;
+        using reference         = const PersonView &;
+
+        Iterator(const CollectionSnapshot * snapshot, size_t chunk, size_t pos)
+            : _snapshot(snapshot), _chunk(chunk), _pos(pos)
+        {}
+
+        reference operator * () const { return (*_snapshot->_chunks[_chunk])[_pos]; }
+        pointer   operator -> () const { return &**this; }
+
+        Iterator & operator ++ ()
+        {
+            if (++_pos == _snapshot->_chunks[_chunk]->size()) {
+                _chunk ++;
+                _pos = 0;
+            }
+            return *this;
+        }
+
+        Iterator operator ++ (int) { Iterator it = *this; ++*this; return it; }
+
+        bool operator == (const Iterator &) const = default;
+    };
+
+private:
+    uint64_t                                          _generation;
+    size_t                                            _collection_size;
+    size_t                                            _max_index;
+    std::vector<std::shared_ptr<const SnapshotChunk>> _chunks;     ///< только непустые части
+    std::vector<size_t>                               _offsets;    ///< номер первого посетителя части
+    size_t                                            _size = 0;
+
+    mutable std::mutex                                               _results_mutex;
+    mutable std::map<std::string,std::shared_ptr<const QueryResult>> _results;
+    mutable size_t                                                   _results_bytes = 0;
+
+public:
+    CollectionSnapshot(uint64_t generation, size_t collection_size, size_t max_index,
+                       const std::vector<std::shared_ptr<const SnapshotChunk>> & chunks);
+
+    uint64_t generation()     const { return _generation; }
+    size_t   size()           const { return _size; }
+    size_t   collectionSize() const { return _collection_size; }     ///< включая удалённых посетителей
+    size_t   maxIndex()       const { return _max_index; }           ///< на момент снимка
+
+    /// Посетитель с номером i, часть находится двоичным поиском
+    const PersonView & operator [] (size_t i) const;
+
+    /**
+     * @brief Посетитель с индексом index
+     *
+     * @details Возвращается посетитель самого снимка, без копирования и счётчиков
+     * ссылок, поэтому указатель действителен, пока существует снимок.
+     *
+     * @return nullptr Посетителя с таким индексом не было в коллекции или он был удалён.
+     *
+     */
+    const PersonView * find(size_t index) const;
+
+    Iterator begin() const { return Iterator(this, 0, 0); }
+    Iterator end()   const { return Iterator(this, _chunks.size(), 0); }
+
+    /// Сохранённый результат запроса или nullptr
+    std::shared_ptr<const QueryResult> cachedResult(const std::string & key) const;
+
+    /**
+     * @brief Сохранение результата запроса
+     *
+     * @details Результаты сверх MAX_CACHED_RESULTS и MAX_CACHED_BYTES не сохраняются.
+     *
+     */
+    void cacheResult(const std::string & key, std::shared_ptr<const QueryResult> result) const;
 };
 
+/**
+ * @brief Результат пакетного импорта посетителей
+ *
+ */
+struct ImportResult
+{
+    bool   opened     = false;  ///< файл импорта открыт
+    bool   valid      = false;  ///< содержимое файла разобрано без ошибок
+    size_t error_line = 0;      ///< строка CSV с ошибкой (с 1)
+    size_t first      = 0;      ///< индекс первого добавленного посетителя
+    size_t count      = 0;      ///< количество добавленных посетителей
+};
+
+/**
+ * @brief Сегмент пространства индексов
+ *
+ * @details Пространство индексов делится между count сегментами (процессами,
+ * см. hw/l1_Shards.h): глобальный индекс g принадлежит сегменту (g-1) % count
+ * и хранится в его коллекции под локальным индексом (g-1) / count + 1.
+ * Сегмент по умолчанию - вся коллекция, глобальные индексы совпадают с локальными.
+ *
+ */
+struct IndexShard
+{
+    size_t count = 1;
+    size_t shard = 0;
+
+    size_t shardOf(size_t global) const { return (global - 1) % count; }
+    size_t toLocal(size_t global) const { return (global - 1) / count + 1; }
+    size_t toGlobal(size_t local) const { return (local - 1) * count + shard + 1; }
+};
+
+/**
+ * @brief Посетитель коллекции, опубликованной в разделяемой памяти
+ *
+ * @details Псевдоним и визиты ссылаются на данные сегмента.
+ *
+ */
+struct SharedPerson
+{
+    size_t                 index;
+    std::string_view       alias;
+    std::span<const Visit> visits;
+};
+
+/**
+ * @brief Коллекция, опубликованная в сегменте разделяемой памяти (см. ItemCollector::publish)
+ *
+ * @details Область версии содержит заголовок (размер коллекции, максимальный
+ * индекс, номер версии коллекции, количество неудалённых посетителей),
+ * записи посетителей в порядке индексов и данные записей: визиты
+ * и псевдонимы. Записи ссылаются на данные смещениями от начала области.
+ * Смещения проверяются при чтении, поскольку область может быть прочитана
+ * во время записи (см. SharedSegment::read).
+ *
+ */
+class SharedCollectionView
+{
+    std::string_view _area;
+    size_t           _size       = 0;
+    size_t           _max_index  = 0;
+    uint64_t         _generation = 0;
+    size_t           _count      = 0;
+    bool             _valid      = false;
+
+public:
+    explicit SharedCollectionView(std::string_view area);
+
+    bool     valid()      const { return _valid; }
+    size_t   size()       const { return _size; }       ///< размер коллекции, включая удалённых посетителей
+    size_t   maxIndex()   const { return _max_index; }
+    uint64_t generation() const { return _generation; }
+    size_t   count()      const { return _count; }      ///< количество неудалённых посетителей
+
+    /// Посетитель с номером i (по возрастанию индексов), при повреждённых данных - std::nullopt
+    std::optional<SharedPerson> person(size_t i) const;
+};
 
-class ItemCollector: public ACollector
+class ItemCollector: public Collector<Person,ItemCollector>
 {
+    friend class Collector<Person,ItemCollector>;
+
+    mutable std::shared_ptr<const CollectionSnapshot> _snapshot;
+
+    /// Части последнего снимка по слябам и версии слябов, по которым они построены
+    mutable std::vector<std::shared_ptr<const SnapshotChunk>> _chunks;
+    mutable std::vector<uint64_t>                             _chunk_generations;
+
+    /// Вытеснение посетителей, nullptr - все посетители в памяти
+    std::shared_ptr<SpillStore> _spill;
+    std::deque<size_t>          _clock;     ///< индексы посетителей в памяти в порядке обхода CLOCK
+
+    /// Индекс дат визитов: дата -> индексы неудалённых посетителей, под блокировкой коллекции
+    std::map<Visit,tp::Bitmap> _visit_index;
+    bool                       _index_visits = true;
+
+    VisitOrder                 _visit_order = VisitOrder::Insertion;
+
+    SharedSegment *            _shared = nullptr;
+
+    /// Коллекция без индекса дат визитов, например, временная при импорте
+    explicit ItemCollector(bool index_visits) : _index_visits(index_visits) {}
+
+    void indexVisitsLocked(size_t index, std::span<const Visit> visits, bool add);
+
+    bool addVisitsLocked(size_t index, std::span<const Visit> visits);
+
+    std::shared_ptr<const CollectionSnapshot> snapshotLocked() const;
+
+    /// Посетитель (в том числе удалённый), возвращённый в память, или nullptr
+    Person * loadLocked(size_t index);
+
+    /// Часть снимка, память которой учитывается хранилищем вытесненных посетителей
+    std::shared_ptr<const SnapshotChunk> shareChunkLocked(std::unique_ptr<SnapshotChunk> chunk) const;
+
+    /**
+     * @brief Вытеснение посетителей, пока их память превышает бюджет
+     *
+     * @details Обход по алгоритму CLOCK: посетитель, к которому обращались
+     * с прошлого обхода, получает вторую попытку. Вытесняется с запасом,
+     * до 7/8 бюджета, чтобы обход выполнялся не при каждом изменении.
+     *
+     */
+    void evictLocked();
+
+    /// Посетители файла импорта без добавления в коллекцию, см. importFile
+    static std::vector<Person> readImport(const std::string & file_name, tp::ThreadPool * pool, ImportResult & result);
+
+protected:
+    void itemStoredLocked(size_t index, Person & person);
+    void itemAddedLocked(size_t index, const Person & person);
+    void itemRemovedLocked(size_t index, const Person & person);
+
 public:
-    virtual std::shared_ptr<ICollectable> read(std::istream& is) override;
+    ItemCollector() = default;
+    ~ItemCollector();
+
+    /**
+     * @brief Ограничение памяти посетителей
+     *
+     * @details Когда псевдонимы и визиты посетителей в памяти вместе с частями
+     * снимков коллекции занимают больше budget байт, давно не использовавшиеся
+     * посетители вытесняются в файл страниц page_file_name (см. tp::PageFile)
+     * и возвращаются в память при изменении. Снимки и сохранение ссылаются
+     * на записи вытесненных посетителей и не разбирают их под блокировкой
+     * коллекции. Задаётся один раз, обычно до загрузки коллекции,
+     * чтобы загрузка не требовала памяти на всю коллекцию.
+     *
+     * @return false Ограничение уже задано или файл страниц не создан.
+     *
+     */
+    bool setMemoryBudget(const std::string & page_file_name, size_t budget);
+
+    /// Хранилище вытесненных посетителей, nullptr - без ограничения памяти
+    const SpillStore * spillStore() const { return _spill.get(); }
+
+    /**
+     * @brief Порядок хранения визитов посетителей, см. VisitOrder
+     *
+     * @details Применяется к посетителям коллекции и ко всем добавленным
+     * или загруженным позже, поэтому обычно задаётся до загрузки коллекции.
+     *
+     */
+    void setVisitOrder(VisitOrder order);
+
+    /**
+     * @brief Добавление визита под блокировкой коллекции
+     *
+     * @details Изменение упорядочено относительно снимков коллекции и учитывается
+     * в индексе дат визитов.
+     *
+     * @return false Посетителя с таким индексом нет.
+     *
+     */
+    bool addVisit(size_t index, const Visit & visit);
+
+    /// Добавление нескольких визитов одного посетителя, см. addVisit и Person::addVisits
+    bool addVisits(size_t index, std::span<const Visit> visits);
+
+    /// Вариант addVisits для сопрограмм, см. Collector::withLockAsync
+    tp::Task<bool> addVisitsAsync(size_t index, std::vector<Visit> visits);
+
+    /// Замена визитов посетителя под блокировкой коллекции, см. addVisit
+    bool setVisits(size_t index, std::vector<Visit> visits);
+
+    /**
+     * @brief Замена псевдонима посетителя (команда update)
+     *
+     * @details Визиты посетителя и индекс дат визитов не изменяются.
+     *
+     * @return false Посетителя с таким индексом нет.
+     *
+     */
+    bool setAlias(size_t index, const std::string & alias);
+
+    /// Вариант setAlias для сопрограмм, см. Collector::withLockAsync
+    tp::Task<bool> setAliasAsync(size_t index, std::string alias);
+
+    /**
+     * @brief Посетители, у которых есть визит с датой в диапазоне [from, to]
+     *
+     * @details Используется индекс дат визитов, поэтому время выполнения
+     * пропорционально количеству найденных посетителей и дат в диапазоне,
+     * а не размеру коллекции.
+     *
+     * @return Индексы и псевдонимы посетителей по возрастанию индексов.
+     *
+     */
+    std::vector<std::pair<size_t,std::string>> visited(const Visit & from, const Visit & to) const;
+
+    /**
+     * @brief Визиты посетителя с датами в диапазоне [from, to] по возрастанию даты
+     *
+     * @details При упорядоченном хранении визитов (см. setVisitOrder) диапазон
+     * находится двоичным поиском, иначе визиты просматриваются подряд.
+     * Вытесненный посетитель читается без возвращения в память.
+     *
+     * @return std::nullopt Посетителя с таким индексом нет или он удалён.
+     *
+     */
+    std::optional<std::vector<Visit>> visitsBetween(size_t index, const Visit & from, const Visit & to) const;
+
+    /**
+     * @brief Визит посетителя с наибольшей датой, см. visitsBetween
+     *
+     * @return false Посетителя с таким индексом нет или он удалён.
+     *
+     */
+    bool lastVisit(size_t index, std::optional<Visit> & last) const;
+
+    /**
+     * @brief Пакетный импорт посетителей из файла
+     *
+     * @details Файл - либо файл данных (см. DataFormat, неудалённые посетители
+     * получают новые индексы), либо CSV: в каждой строке псевдоним и визиты
+     * тройками "год,месяц,день", например "Иван_Иванов,2020,12,4,2021,1,15".
+     * CSV разбирается частями параллельно потоками pool (если задан),
+     * посетители создаются без блокировки коллекции, затем для них одним
+     * вызовом резервируются индексы и все они добавляются одним пакетом.
+     * При ошибке в файле коллекция не изменяется.
+     *
+     */
+    ImportResult importFile(const std::string & file_name, tp::ThreadPool * pool = nullptr);
+
+    /**
+     * @brief Импорт в сегмент коллекции
+     *
+     * @details Посетители файла получают глобальные индексы first, first+1, ...,
+     * добавляются только принадлежащие сегменту shard. В результате first и count
+     * относятся ко всему файлу, поэтому у всех сегментов они одинаковы.
+     *
+     */
+    ImportResult importFile(const std::string & file_name, tp::ThreadPool * pool, const IndexShard & shard, size_t first);
+
+    /**
+     * @brief Согласованный снимок коллекции
+     *
+     * @details Пока коллекция не меняется, возвращается один и тот же снимок.
+     *
+     */
+    std::shared_ptr<const CollectionSnapshot> snapshot() const;
+
+    /// Вариант snapshot для сопрограмм
+    tp::Task<std::shared_ptr<const CollectionSnapshot>> snapshotAsync() const;
+
+    /**
+     * @brief Публикация снимка коллекции в сегменте разделяемой памяти
+     *
+     * @details Процессы аналитики (bin/lab --attach) читают опубликованную
+     * версию без копирования, см. SharedCollectionView.
+     *
+     */
+    bool publish(SharedSegment & segment) const;
+
+    /// Сегмент, в котором коллекция публикуется при каждом сохранении, nullptr - без публикации
+    void setSharedSegment(SharedSegment * segment) { _shared = segment; }
 
-    Person & getPerson(size_t index);
+    /**
+     * @brief Сохранение коллекции в файл данных и публикация в сегменте (если задан)
+     *
+     * @return false Ошибка сохранения или публикации.
+     *
+     */
+    bool saveCollection();
 };
 
 #endif // HW_L3_DOMAIN_LAYER_H
@@ -0,0 +1,295 @@
+#ifndef HW_L4_BINARY_WORKLOAD_H
+#define HW_L4_BINARY_WORKLOAD_H
+
+/**
+ * Компактный двоичный формат пакета команд.
+ *
+ * Файл начинается с 8-байтовой сигнатуры BINARY_WORKLOAD_MAGIC, далее следуют записи:
+ *
+ *   opcode:u8  argc:u8  argv:varint(zigzag)[argc]  [alias: len:varint bytes[len]]
+ *
+ * Псевдоним есть только у команд add и update, у команды import на его месте - имя файла. Строки, которые нельзя
+ * однозначно закодировать (неизвестная команда, неверное количество или
+ * формат аргументов), передаются записью Opcode::Text: len:varint bytes[len].
+ * Пустая текстовая запись, как и пустая строка в текстовом пакете,
+ * завершает пакет.
+ *
+ * Заголовок не зависит от остальных слоёв и используется также в stressgen.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class Opcode : uint8_t
+{
+    Invalid  = 0,
+    Count    = 1,
+    Add      = 2,
+    AddVisit = 3,
+    Remove   = 4,
+    Update   = 5,
+    View     = 6,
+    Report   = 7,
+    Save     = 8,
+    Compact  = 9,
+    Visited  = 10,
+    Import   = 11,
+    VisitsBetween = 12,
+    LastVisit     = 13,
+    Text     = 0xFF,
+};
+
+const size_t MAX_COMMAND_ARGS = 7;
+
+inline const char BINARY_WORKLOAD_MAGIC[8] = {'\x89','L','A','B','W','L','\x01','\n'};
+
+struct OpcodeInfo
+{
+    Opcode           opcode;
+    std::string_view short_name;
+    std::string_view long_name;
+    size_t           min_args;      ///< без учёта имени команды
+    size_t           max_args;
+    bool             has_alias;     ///< последний аргумент - псевдоним
+    bool             signed_args;   ///< аргументы после первого могут быть отрицательными
+};
+
+inline const std::vector<OpcodeInfo> & opcodeTable()
+{
+    static const std::vector<OpcodeInfo> table {
+        {Opcode::Count,    "c",  "count",     0, 0, false, false},
+        {Opcode::Add,      "a",  "add",       1, 1, true,  false},
+        {Opcode::AddVisit, "av", "add_visit", 4, 4, false, true },
+        {Opcode::Remove,   "r",  "remove",    1, 1, false, false},
+        {Opcode::Update,   "u",  "update",    2, 2, true,  false},
+        {Opcode::View,     "v",  "view",      0, 2, false, false},
+        {Opcode::Report,   "rp", "report",    0, 1, false, false},
+        {Opcode::Save,     "s",  "save",      0, 0, false, false},
+        {Opcode::Compact,  "cp", "compact",   0, 0, false, false},
+        {Opcode::Visited,  "vd", "visited",   3, 6, false, true },
+        {Opcode::Import,   "im", "import",    1, 1, true,  false},
+        {Opcode::VisitsBetween, "vb", "visits_between", 4, 7, false, true },
+        {Opcode::LastVisit,     "lv", "last_visit",     1, 1, false, false},
+    };
+    return table;
+}
+
+inline const OpcodeInfo * findOpcode(std::string_view name)
+{
+    for(const OpcodeInfo & info : opcodeTable())
+        if (info.short_name == name || info.long_name == name)
+            return &info;
+    return nullptr;
+}
+
+inline const OpcodeInfo * findOpcode(Opcode opcode)
+{
+    for(const OpcodeInfo & info : opcodeTable())
+        if (info.opcode == opcode)
+            return &info;
+    return nullptr;
+}
+
+/// Количество числовых аргументов записи (без псевдонима) допустимо для команды
+inline bool isValidRecordArgc(const OpcodeInfo & info, size_t argc)
+{
+    size_t alias = info.has_alias ? 1 : 0;
+    return argc <= MAX_COMMAND_ARGS && argc + alias >= info.min_args && argc + alias <= info.max_args;
+}
+
+inline bool isBinaryWorkload(const char * data, size_t size)
+{
+    return size >= sizeof(BINARY_WORKLOAD_MAGIC)
+        && std::memcmp(data, BINARY_WORKLOAD_MAGIC, sizeof(BINARY_WORKLOAD_MAGIC)) == 0;
+}
+
+inline void writeVarint(std::string & out, uint64_t value)
+{
+    while(value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+inline bool readVarint(const char *& pos, const char * end, uint64_t & value)
+{
+    value = 0;
+    for(unsigned shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+inline uint64_t zigzagEncode(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+inline int64_t  zigzagDecode(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+/**
+ * @brief Команда пакета, декодированная из двоичной записи
+ *
+ */
+struct WorkloadRecord
+{
+    Opcode           opcode = Opcode::Invalid;
+    uint8_t          argc   = 0;
+    int64_t          args[MAX_COMMAND_ARGS] {};
+    std::string_view text;      ///< псевдоним или текст команды для Opcode::Text
+};
+
+/**
+ * @brief Кодирование текстовой строки команды в двоичную запись
+ *
+ * @details Числовые аргументы кодируются, только если они записаны десятичными
+ * цифрами и помещаются в соответствующий тип, т.е. разбор текстовой команды
+ * дал бы то же значение. Иначе строка передаётся как Opcode::Text.
+ *
+ */
+inline void encodeWorkloadLine(std::string_view line, std::string & out)
+{
+    std::vector<std::string_view> tokens;
+    for(size_t pos = 0; pos < line.size(); ) {
+        size_t start = line.find_first_not_of(' ', pos);
+        if (start == std::string_view::npos)
+            break;
+        size_t end = line.find(' ', start);
+        if (end == std::string_view::npos)
+            end = line.size();
+        tokens.push_back(line.substr(start, end - start));
+        pos = end;
+    }
+
+    auto encodeText = [&]() {
+        out += static_cast<char>(Opcode::Text);
+        writeVarint(out, line.size());
+        out.append(line);
+    };
+
+    const OpcodeInfo * info = tokens.empty() ? nullptr : findOpcode(tokens[0]);
+    if (info == nullptr || tokens.size() - 1 < info->min_args || tokens.size() - 1 > info->max_args) {
+        encodeText();
+        return;
+    }
+
+    size_t  numbers = tokens.size() - 1 - (info->has_alias ? 1 : 0);
+    int64_t values[MAX_COMMAND_ARGS] {};
+
+    for(size_t i=0; i < numbers; ++i) {
+        std::string_view token    = tokens[i+1];
+        bool             negative = info->signed_args && i > 0 && !token.empty() && token[0] == '-';
+        if (negative)
+            token.remove_prefix(1);
+
+        // Индексы разбираются как size_t, дата - как int
+        size_t max_digits = (info->signed_args && i > 0) ? 9 : 18;
+        if (token.empty() || token.size() > max_digits || token.find_first_not_of("0123456789") != std::string_view::npos) {
+            encodeText();
+            return;
+        }
+
+        int64_t value = 0;
+        for(char c : token)
+            value = value * 10 + (c - '0');
+        values[i] = negative ? -value : value;
+    }
+
+    out += static_cast<char>(info->opcode);
+    out += static_cast<char>(numbers);
+    for(size_t i=0; i < numbers; ++i)
+        writeVarint(out, zigzagEncode(values[i]));
+
+    if (info->has_alias) {
+        writeVarint(out, tokens.back().size());
+        out.append(tokens.back());
+    }
+}
+
+/**
+ * @brief Последовательное чтение записей двоичного пакета
+ *
+ * @details Данные не копируются: строковые поля записей ссылаются на исходный буфер,
+ * поэтому буфер (например, отображённый в память файл) должен жить дольше записей.
+ *
+ */
+class BinaryWorkloadReader
+{
+    const char * _pos;
+    const char * _end;
+    bool         _error = false;
+
+public:
+    BinaryWorkloadReader(const char * data, size_t size)
+        : _pos(data + sizeof(BINARY_WORKLOAD_MAGIC))
+        , _end(data + size)
+    {
+        if (!isBinaryWorkload(data, size)) {
+            _pos   = _end;
+            _error = true;
+        }
+    }
+
+    bool error() const { return _error; }
+
+    /**
+     * @brief Чтение очередной записи
+     *
+     * @return false Данные закончились, встретилась пустая текстовая запись или запись повреждена
+     * (в том числе количество аргументов не соответствует команде).
+     *
+     */
+    bool next(WorkloadRecord & record)
+    {
+        if (_pos >= _end)
+            return false;
+
+        record.opcode = static_cast<Opcode>(*_pos++);
+        record.argc   = 0;
+        record.text   = {};
+
+        bool has_text = record.opcode == Opcode::Text;
+
+        if (!has_text) {
+            const OpcodeInfo * info = findOpcode(record.opcode);
+            if (info == nullptr || _pos >= _end)
+                return fail();
+
+            record.argc = static_cast<uint8_t>(*_pos++);
+            if (!isValidRecordArgc(*info, record.argc))
+                return fail();
+
+            for(size_t i=0; i < record.argc; ++i) {
+                uint64_t value;
+                if (!readVarint(_pos, _end, value))
+                    return fail();
+                record.args[i] = zigzagDecode(value);
+            }
+
+            has_text = info->has_alias;
+        }
+
+        if (has_text) {
+            uint64_t length;
+            if (!readVarint(_pos, _end, length) || length > static_cast<uint64_t>(_end - _pos))
+                return fail();
+            record.text = std::string_view(_pos, length);
+            _pos += length;
+        }
+
+        return record.opcode != Opcode::Text || !record.text.empty();
+    }
+
+private:
+    bool fail()
+    {
+        _pos   = _end;
+        _error = true;
+        return false;
+    }
+};
+
+#endif // HW_L4_BINARY_WORKLOAD_H
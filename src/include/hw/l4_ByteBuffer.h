@@ -0,0 +1,178 @@
+#ifndef HW_L4_BYTE_BUFFER_H
+#define HW_L4_BYTE_BUFFER_H
+
+/**
+ * Переносимое двоичное представление данных.
+ *
+ * Целые фиксированной ширины записываются в порядке little-endian независимо
+ * от платформы, переменной ширины - в формате varint (как в hw/l4_BinaryWorkload.h).
+ * Значения кодируются в буфер в памяти и декодируются из буфера в памяти,
+ * поэтому ввод-вывод выполняется крупными блоками, а не по одному значению.
+ */
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+class ByteWriter
+{
+    std::string _buffer;
+
+public:
+    std::string &       buffer()       { return _buffer; }
+    const std::string & buffer() const { return _buffer; }
+
+    template<typename T>
+    void putFixed(T value)
+    {
+        static_assert(std::is_integral_v<T>);
+
+        char bytes[sizeof(T)];
+        if constexpr (std::endian::native == std::endian::little)
+            std::memcpy(bytes, &value, sizeof(T));
+        else
+            for(size_t i=0; i < sizeof(T); ++i)
+                bytes[i] = static_cast<char>(static_cast<std::make_unsigned_t<T>>(value) >> (8 * i));
+        _buffer.append(bytes, sizeof(T));
+    }
+
+    void putVarint(uint64_t value)
+    {
+        while(value >= 0x80) {
+            _buffer += static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        _buffer += static_cast<char>(value);
+    }
+
+    void putBytes(std::string_view bytes) { _buffer.append(bytes); }
+
+    void putString(std::string_view s)
+    {
+        putVarint(s.size());
+        putBytes(s);
+    }
+
+    /**
+     * @brief Массив целых фиксированной ширины
+     *
+     * @details На little-endian платформе копируется одним блоком.
+     *
+     */
+    template<typename T>
+    void putArray(std::span<const T> values)
+    {
+        static_assert(std::is_integral_v<T>);
+
+        if constexpr (std::endian::native == std::endian::little)
+            _buffer.append(reinterpret_cast<const char *>(values.data()), values.size_bytes());
+        else
+            for(T v : values)
+                putFixed(v);
+    }
+};
+
+class ByteReader
+{
+    const char * _pos;
+    const char * _end;
+    bool         _error = false;
+
+    bool need(size_t size)
+    {
+        if (static_cast<size_t>(_end - _pos) >= size)
+            return true;
+        _pos   = _end;
+        _error = true;
+        return false;
+    }
+
+public:
+    ByteReader(const char * data, size_t size)
+        : _pos(data)
+        , _end(data + size)
+    {}
+
+    /// Данные закончились раньше времени или значение повреждено
+    bool   error()     const { return _error; }
+    size_t remaining() const { return _end - _pos; }
+
+    void fail() { _pos = _end; _error = true; }
+
+    template<typename T>
+    T getFixed()
+    {
+        static_assert(std::is_integral_v<T>);
+
+        std::make_unsigned_t<T> value = 0;
+        if (!need(sizeof(T)))
+            return 0;
+
+        if constexpr (std::endian::native == std::endian::little)
+            std::memcpy(&value, _pos, sizeof(T));
+        else
+            for(size_t i=0; i < sizeof(T); ++i)
+                value |= static_cast<std::make_unsigned_t<T>>(static_cast<uint8_t>(_pos[i])) << (8 * i);
+        _pos += sizeof(T);
+        return static_cast<T>(value);
+    }
+
+    uint64_t getVarint()
+    {
+        uint64_t value = 0;
+        for(unsigned shift = 0; _pos < _end && shift < 64; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*_pos++);
+            value |= uint64_t(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+        fail();
+        return 0;
+    }
+
+    std::string_view getBytes(size_t size)
+    {
+        if (!need(size))
+            return {};
+        std::string_view bytes(_pos, size);
+        _pos += size;
+        return bytes;
+    }
+
+    std::string_view getString(size_t max_length)
+    {
+        uint64_t length = getVarint();
+        if (length > max_length) {
+            fail();
+            return {};
+        }
+        return getBytes(length);
+    }
+
+    /// Массив целых фиксированной ширины, на little-endian платформе копируется одним блоком
+    template<typename T>
+    bool getArray(T * values, size_t count)
+    {
+        static_assert(std::is_integral_v<T>);
+
+        if (count > remaining() / sizeof(T)) {
+            fail();
+            return false;
+        }
+
+        if constexpr (std::endian::native == std::endian::little) {
+            std::memcpy(values, _pos, count * sizeof(T));
+            _pos += count * sizeof(T);
+        }
+        else
+            for(size_t i=0; i < count; ++i)
+                values[i] = getFixed<T>();
+        return true;
+    }
+};
+
+#endif // HW_L4_BYTE_BUFFER_H
@@ -0,0 +1,647 @@
+#ifndef HW_L4_COLLECTOR_H
+#define HW_L4_COLLECTOR_H
+
+/**
+ * Коллекция элементов одного типа T, известного во время компиляции.
+ *
+ * Элементы хранятся по значению в слябах по SLAB_SIZE элементов, адрес элемента
+ * вычисляется по его индексу без поиска и не меняется до уплотнения. Запись
+ * и чтение элементов (T::write, T::read) и уведомления наследника об изменениях
+ * (CRTP) разрешаются при компиляции, без виртуальных вызовов. Доступ к элементу
+ * (getItem) выдаётся на время блокировки коллекции, без копирования элемента
+ * и счётчиков ссылок. Для кода, которому тип элементов неизвестен при компиляции,
+ * коллекция реализует интерфейс ACollector через CollectorAdapter.
+ * Формат файла данных описан в hw/l4_InfrastructureLayer.h (DataFormat).
+ */
+
+#include "hw/l4_InfrastructureLayer.h"
+#include "tp/AsyncMutex.h"
+#include "tp/Coroutine.h"
+
+#include <array>
+#include <concepts>
+#include <optional>
+
+/**
+ * @brief Требования к элементу Collector<T>
+ *
+ * @details T::Frozen - неизменяемое состояние элемента, которое фиксируется
+ * под блокировкой коллекции (freeze должен быть быстрым) и записывается в файл
+ * без блокировки. T::read возвращает std::nullopt при повреждённых данных.
+ *
+ */
+template<typename T>
+concept Collectable = std::move_constructible<T>
+    && requires(const T & item, const typename T::Frozen & frozen, ByteWriter & out, ByteReader & in, DataFormat format)
+{
+    { item.freeze() }         -> std::convertible_to<typename T::Frozen>;
+    { T::write(out, frozen) } -> std::same_as<bool>;
+    { T::read(in, format) }   -> std::same_as<std::optional<T>>;
+};
+
+/**
+ * @brief Коллекция элементов T с индексами
+ *
+ * @details Индексы выдаются по возрастанию начиная с 1 и повторно не выдаются,
+ * в том числе после уплотнения. Удалённый элемент хранится с признаком
+ * удаления до уплотнения.
+ *
+ * Derived - наследник (CRTP), который может определить уведомления
+ * itemAddedLocked(index, const T &) и itemRemovedLocked(index, const T &),
+ * вызываемые под блокировкой коллекции при появлении и исчезновении
+ * неудалённого элемента (в том числе при замене и загрузке), а также
+ * itemStoredLocked(index, T &) - при размещении в коллекции любого элемента,
+ * в том числе удалённого.
+ *
+ * Ссылки на элементы действительны только под блокировкой коллекции (см. getItem):
+ * элемент разрушается при замене (updateItem) и уплотнении. Данные, которые
+ * должны читаться без блокировки коллекции, элемент разделяет через T::Frozen,
+ * изменения выполняются под блокировкой (withLock).
+ *
+ */
+template<Collectable T, typename Derived>
+class Collector
+{
+public:
+    using Item = T;
+
+    static constexpr size_t SLAB_SIZE = 1024;
+
+    class ItemRef;
+
+private:
+    struct Slot
+    {
+        std::optional<T> item;
+        bool             removed = false;
+    };
+
+    using Slab = std::array<Slot,SLAB_SIZE>;
+
+    /// Элемент, зафиксированный для сохранения
+    struct SavedItem
+    {
+        size_t              index;
+        bool                removed;
+        typename T::Frozen  frozen;
+    };
+
+    std::string                       _file_name;
+    std::vector<std::unique_ptr<Slab>> _slabs;     ///< сляб i хранит индексы [i*SLAB_SIZE, (i+1)*SLAB_SIZE)
+    size_t                            _size = 0;
+    mutable tp::AsyncMutex            _mutex;
+    std::mutex                        _save_mutex;
+    size_t                            _max_index = 0;
+    uint64_t                          _generation = 0;
+    std::vector<uint64_t>             _slab_generations;    ///< версия коллекции при последнем изменении сляба
+    bool                              _compact_on_save = false;
+
+    static const tp::LockSite & lockSite()
+    {
+        static const tp::LockSite site("lock.collector");
+        return site;
+    }
+
+    Derived & derived() { return static_cast<Derived &>(*this); }
+
+    /// Обход занятых ячеек (в том числе с удалёнными элементами) в порядке индексов
+    template<typename F>
+    void forEachSlotLocked(F && action) const
+    {
+        for(size_t s=0; s < _slabs.size(); ++s)
+            if (_slabs[s] != nullptr)
+                for(size_t i=0; i < SLAB_SIZE; ++i) {
+                    Slot & slot = (*_slabs[s])[i];
+                    if (slot.item.has_value())
+                        action(s * SLAB_SIZE + i, slot);
+                }
+    }
+
+    Slot * slotLocked(size_t index) const
+    {
+        size_t slab = index / SLAB_SIZE;
+        if (slab >= _slabs.size() || _slabs[slab] == nullptr)
+            return nullptr;
+
+        Slot & slot = (*_slabs[slab])[index % SLAB_SIZE];
+        return slot.item.has_value() ? &slot : nullptr;
+    }
+
+    void emplaceLocked(size_t index, T && item, bool removed)
+    {
+        size_t slab = index / SLAB_SIZE;
+        if (slab >= _slabs.size())
+            _slabs.resize(slab + 1);
+        if (_slabs[slab] == nullptr)
+            _slabs[slab] = std::make_unique<Slab>();
+
+        Slot & slot = (*_slabs[slab])[index % SLAB_SIZE];
+        if (slot.item.has_value()) {
+            if (!slot.removed)
+                derived().itemRemovedLocked(index, *slot.item);
+        }
+        else
+            _size ++;
+
+        slot.item.emplace(std::move(item));
+        slot.removed = removed;
+        derived().itemStoredLocked(index, *slot.item);
+        if (!removed)
+            derived().itemAddedLocked(index, *slot.item);
+    }
+
+    size_t addItemLocked(T && item, bool removed)
+    {
+        _max_index ++;
+        emplaceLocked(_max_index, std::move(item), removed);
+        touch(_max_index);
+        return _max_index;
+    }
+
+    bool removeItemLocked(size_t index)
+    {
+        Slot * slot = slotLocked(index);
+        if (slot == nullptr)
+            return false;
+        if (!slot->removed)
+            derived().itemRemovedLocked(index, *slot->item);
+        slot->removed = true;
+        touch(index);
+        return true;
+    }
+
+    bool updateItemLocked(size_t index, T && item)
+    {
+        Slot * slot = slotLocked(index);
+        if (slot == nullptr)
+            return false;
+        emplaceLocked(index, std::move(item), slot->removed);
+        touch(index);
+        return true;
+    }
+
+protected:
+    /// Уведомления по умолчанию, наследник заменяет их своими (см. описание класса)
+    void itemStoredLocked(size_t /*index*/, T & /*item*/) {}
+    void itemAddedLocked(size_t /*index*/, const T & /*item*/) {}
+    void itemRemovedLocked(size_t /*index*/, const T & /*item*/) {}
+
+    /**
+     * @brief Выполнение действия под блокировкой коллекции
+     *
+     * @details Позволяет наследникам изменять элементы и строить снимки
+     * коллекции атомарно относительно addItem/removeItem/updateItem.
+     * Если действие изменяет элементы, оно должно вызвать touch().
+     *
+     */
+    template<typename F>
+    auto withLock(F && action) const
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return action();
+    }
+
+    /**
+     * @brief Выполнение действия под блокировкой коллекции, захваченной сопрограммой
+     *
+     * @details Пока блокировка занята, сопрограмма не занимает поток (см. tp::AsyncMutex).
+     * action копируется в сопрограмму и вызывается без ожидания внутри.
+     *
+     */
+    template<typename F>
+    auto withLockAsync(F action) const -> tp::Task<decltype(action())>
+    {
+        tp::AsyncMutex::Guard guard = co_await _mutex.lockAsync();
+        co_return action();
+    }
+
+    /// Обход неудалённых элементов в порядке индексов, только внутри withLock
+    template<typename F>
+    void forEachLocked(F && action) const
+    {
+        forEachSlotLocked([&](size_t index, const Slot & slot) {
+            if (!slot.removed)
+                action(index, *slot.item);
+        });
+    }
+
+    /// Обход с возможностью изменять (в том числе перемещать) элементы, только внутри withLock
+    template<typename F>
+    void forEachLocked(F && action)
+    {
+        forEachSlotLocked([&](size_t index, Slot & slot) {
+            if (!slot.removed)
+                action(index, *slot.item);
+        });
+    }
+
+    /// Поиск элемента (в том числе удалённого), только внутри withLock
+    const T * findLocked(size_t index) const
+    {
+        const Slot * slot = slotLocked(index);
+        return slot == nullptr ? nullptr : &*slot->item;
+    }
+
+    T * findLocked(size_t index)
+    {
+        Slot * slot = slotLocked(index);
+        return slot == nullptr ? nullptr : &*slot->item;
+    }
+
+    /// Признак удаления элемента (отсутствующий считается удалённым), только внутри withLock
+    bool removedLocked(size_t index) const
+    {
+        Slot * slot = slotLocked(index);
+        return slot == nullptr || slot->removed;
+    }
+
+    /// Отметка об изменении всех элементов коллекции, только внутри withLock
+    void touch()
+    {
+        _generation ++;
+        _slab_generations.assign(_slabs.size(), _generation);
+    }
+
+    /// Отметка об изменении элемента с индексом index, только внутри withLock
+    void touch(size_t index)
+    {
+        size_t slab = index / SLAB_SIZE;
+        if (slab >= _slab_generations.size())
+            _slab_generations.resize(slab + 1, 0);
+
+        _generation ++;
+        _slab_generations[slab] = _generation;
+    }
+
+    /// Номер версии коллекции, только внутри withLock
+    uint64_t generationLocked() const { return _generation; }
+
+    /// Количество слябов (в том числе пустых), только внутри withLock
+    size_t slabCountLocked() const { return _slabs.size(); }
+
+    /**
+     * @brief Номер версии коллекции при последнем изменении сляба, только внутри withLock
+     *
+     * @details Пока номер не меняется, не меняются и элементы сляба, поэтому
+     * зависящие от них данные (например, части снимка) можно использовать повторно.
+     *
+     */
+    uint64_t slabGenerationLocked(size_t slab) const
+    {
+        return slab < _slab_generations.size() ? _slab_generations[slab] : 0;
+    }
+
+    /// Обход неудалённых элементов сляба slab в порядке индексов, только внутри withLock
+    template<typename F>
+    void forEachInSlabLocked(size_t slab, F && action) const
+    {
+        if (slab >= _slabs.size() || _slabs[slab] == nullptr)
+            return;
+
+        for(size_t i=0; i < SLAB_SIZE; ++i) {
+            const Slot & slot = (*_slabs[slab])[i];
+            if (slot.item.has_value() && !slot.removed)
+                action(slab * SLAB_SIZE + i, *slot.item);
+        }
+    }
+
+    /// Размер коллекции (с удалёнными элементами), только внутри withLock
+    size_t sizeLocked() const { return _size; }
+
+    /// Максимальный выданный индекс, только внутри withLock
+    size_t maxIndexLocked() const { return _max_index; }
+
+    /// Удаление из памяти элементов, отмеченных как удалённые, только внутри withLock
+    size_t compactLocked()
+    {
+        size_t removed = 0;
+        for(size_t s=0; s < _slabs.size(); ++s) {
+            std::unique_ptr<Slab> & slab = _slabs[s];
+            if (slab == nullptr)
+                continue;
+
+            bool   empty          = true;
+            size_t removed_before = removed;
+            for(Slot & slot : *slab) {
+                if (slot.item.has_value() && slot.removed) {
+                    slot.item.reset();
+                    slot.removed = false;
+                    removed ++;
+                }
+                empty = empty && !slot.item.has_value();
+            }
+
+            if (empty)
+                slab.reset();
+            if (removed > removed_before)
+                touch(s * SLAB_SIZE);
+        }
+
+        _size -= removed;
+        return removed;
+    }
+
+public:
+    Collector() = default;
+
+    Collector(const Collector &) = delete;
+    Collector & operator=(const Collector &) = delete;
+
+    size_t getSize() const
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return _size;
+    }
+
+    /**
+     * @brief Доступ к элементу (в том числе удалённому) на время блокировки коллекции
+     *
+     * @details Ссылка держит блокировку коллекции, пока существует, поэтому
+     * элемент не заменяется, не уплотняется и не вытесняется. Элемент не
+     * копируется, счётчики ссылок не меняются. Ссылку нельзя копировать
+     * и перемещать; пока она существует, другие методы коллекции в том же
+     * потоке не вызываются (блокировка не рекурсивная).
+     *
+     * @return Пустая ссылка, если элемента с таким индексом нет.
+     *
+     */
+    ItemRef getItem(size_t index) const
+    {
+        return ItemRef(*this, index);
+    }
+
+    bool isRemoved(size_t index) const
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return removedLocked(index);
+    }
+
+    size_t addItem(T item, bool removed=false)
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return addItemLocked(std::move(item), removed);
+    }
+
+    /**
+     * @brief Резервирование индексов для пакетного добавления
+     *
+     * @details Индексы first ... first+count-1 больше не выдаются addItem,
+     * элементы с ними добавляются publishItems. Неиспользованные индексы
+     * остаются пропусками, как индексы удалённых элементов после уплотнения.
+     *
+     * @return size_t Первый зарезервированный индекс first.
+     *
+     */
+    size_t reserveIndices(size_t count)
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        size_t first = _max_index + 1;
+        _max_index += count;
+        return first;
+    }
+
+    /**
+     * @brief Пакетное добавление элементов с индексами first, first+1, ...
+     *
+     * @details Все элементы добавляются под одной блокировкой, поэтому снимки
+     * содержат либо все элементы пакета, либо ни одного.
+     *
+     * Индексы могут быть не зарезервированы reserveIndices (например, если
+     * их назначает маршрутизатор сегментов): максимальный выданный индекс
+     * увеличивается до последнего индекса пакета.
+     *
+     */
+    void publishItems(size_t first, std::vector<T> items)
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        for(size_t i=0; i < items.size(); ++i)
+            emplaceLocked(first + i, std::move(items[i]), false);
+        if (!items.empty())
+            _max_index = std::max(_max_index, first + items.size() - 1);
+
+        // Отмечается каждый сляб пакета
+        for(size_t index=first; index < first + items.size(); index += SLAB_SIZE - index % SLAB_SIZE)
+            touch(index);
+    }
+
+    bool removeItem(size_t index)
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return removeItemLocked(index);
+    }
+
+    /// Замена элемента на месте, признак удаления сохраняется
+    bool updateItem(size_t index, T item)
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return updateItemLocked(index, std::move(item));
+    }
+
+    /// Варианты getSize, addItem, removeItem и updateItem для сопрограмм, см. withLockAsync
+    tp::Task<size_t> getSizeAsync() const
+    {
+        return withLockAsync([this] { return _size; });
+    }
+
+    tp::Task<size_t> addItemAsync(T item)
+    {
+        return withLockAsync([this, item = std::move(item)]() mutable { return addItemLocked(std::move(item), false); });
+    }
+
+    tp::Task<bool> removeItemAsync(size_t index)
+    {
+        return withLockAsync([this, index] { return removeItemLocked(index); });
+    }
+
+    tp::Task<bool> updateItemAsync(size_t index, T item)
+    {
+        return withLockAsync([this, index, item = std::move(item)]() mutable { return updateItemLocked(index, std::move(item)); });
+    }
+
+    bool loadCollection(const std::string file_name)
+    {
+        _file_name = file_name;
+
+        DataFileReader file (file_name);
+        if (!file.valid())
+            return false;
+
+        tp::MeasuredLock locker(_mutex, lockSite());
+
+        bool ok = readDataItems(file, _max_index, [&](size_t index, bool removed, ByteReader & in) {
+            std::optional<T> item = T::read(in, file.format());
+            if (!item.has_value())
+                return false;
+
+            emplaceLocked(index, std::move(*item), removed);
+            return true;
+        });
+
+        touch();
+        return ok;
+    }
+
+    /**
+     * @brief Сохранение коллекции
+     *
+     * @details Под блокировкой коллекции фиксируется T::Frozen каждого элемента,
+     * запись выполняется без блокировки, поэтому команды продолжают выполняться,
+     * в том числе когда сохранение запущено в отдельном потоке. Сохранения
+     * выполняются по очереди, чтобы более старое содержимое не заменило более
+     * новое. Файл записывается во временный файл, который после fsync
+     * переименовывается в файл данных (см. DataFileWriter).
+     *
+     */
+    bool saveCollection()
+    {
+        static const size_t capture_series = tp::Statistics::instance().registerSeries("collector.save_capture");
+        static const size_t write_series   = tp::Statistics::instance().registerSeries("collector.save_write");
+
+        std::lock_guard save_locker(_save_mutex);
+
+        std::vector<SavedItem> items;
+        size_t                 max_index;
+        {
+            tp::ScopedLatency latency(capture_series);
+            tp::MeasuredLock  locker(_mutex, lockSite());
+
+            if (_compact_on_save)
+                compactLocked();
+
+            items.reserve(_size);
+            forEachSlotLocked([&](size_t index, const Slot & slot) {
+                items.push_back({index, slot.removed, slot.item->freeze()});
+            });
+            max_index = _max_index;
+        }
+
+        tp::ScopedLatency latency(write_series);
+
+        DataFileWriter file (_file_name, max_index, items.size());
+        for(const SavedItem & saved : items) {
+            T::write(file.beginItem(saved.index, saved.removed), saved.frozen);
+            file.endItem();
+        }
+        return file.commit();
+    }
+
+    /**
+     * @brief Уплотнение коллекции
+     *
+     * @details Элементы, отмеченные как удалённые, удаляются из памяти и не
+     * попадают в файл данных при следующем сохранении. Индексы остальных
+     * элементов не меняются, индексы удалённых повторно не выдаются.
+     *
+     * @return size_t Количество удалённых элементов.
+     *
+     */
+    size_t compact()
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return compactLocked();
+    }
+
+    /// Автоматическое уплотнение перед каждым сохранением
+    void setCompactOnSave(bool compact_on_save) { _compact_on_save = compact_on_save; }
+
+    /**
+     * @brief Номер версии коллекции
+     *
+     * @details Увеличивается при каждом изменении коллекции, поэтому совпадение
+     * номеров означает, что коллекция с тех пор не менялась.
+     *
+     */
+    uint64_t generation() const
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return _generation;
+    }
+
+    /// Максимальный выданный индекс
+    size_t maxIndex() const
+    {
+        tp::MeasuredLock locker(_mutex, lockSite());
+        return _max_index;
+    }
+
+    const std::string & data_file_name() const { return _file_name; }
+};
+
+/// Ссылка на элемент коллекции, см. Collector::getItem
+template<Collectable T, typename Derived>
+class Collector<T,Derived>::ItemRef
+{
+    friend class Collector;
+
+    tp::MeasuredLock<tp::AsyncMutex> _locker;
+    const T *                        _item;
+
+    ItemRef(const Collector & collector, size_t index)
+        : _locker(collector._mutex, lockSite())
+        , _item(collector.findLocked(index))
+    {}
+
+public:
+    ItemRef(const ItemRef &) = delete;
+    ItemRef & operator=(const ItemRef &) = delete;
+
+    explicit operator bool () const { return _item != nullptr; }
+
+    const T & operator *  () const { return *_item; }
+    const T * operator -> () const { return _item; }
+    const T * get()          const { return _item; }
+};
+
+/**
+ * @brief Реализация ACollector поверх коллекции C (наследника Collector<T, Derived>)
+ *
+ * @details Ссылается на коллекцию, не владея ею, и вызывает методы самой C,
+ * в том числе заменённые наследником (например, saveCollection). Виртуальные
+ * вызовы и счётчик ссылок элемента (getItem возвращает зафиксированное
+ * состояние во владении shared_ptr) есть только у вызовов через ACollector.
+ *
+ */
+template<typename C>
+class CollectorAdapter final : public ACollector
+{
+    using Item = typename C::Item;
+
+    /// Зафиксированное состояние элемента, записываемое через ICollectable
+    class FrozenItem : public ICollectable
+    {
+        typename Item::Frozen _frozen;
+
+    public:
+        explicit FrozenItem(typename Item::Frozen frozen) : _frozen(std::move(frozen)) {}
+
+        virtual bool write(ByteWriter & out) override { return Item::write(out, _frozen); }
+    };
+
+    C & _collector;
+
+public:
+    explicit CollectorAdapter(C & collector) : _collector(collector) {}
+
+    virtual size_t getSize() const override { return _collector.getSize(); }
+
+    virtual std::shared_ptr<ICollectable> getItem(size_t index) const override
+    {
+        auto item = _collector.getItem(index);
+        if (!item)
+            return nullptr;
+        return std::make_shared<FrozenItem>(item->freeze());
+    }
+
+    virtual bool isRemoved(size_t index) const override { return _collector.isRemoved(index); }
+    virtual bool removeItem(size_t index) override { return _collector.removeItem(index); }
+
+    virtual bool loadCollection(const std::string file_name) override { return _collector.loadCollection(file_name); }
+    virtual bool saveCollection() override { return _collector.saveCollection(); }
+
+    virtual size_t   compact() override { return _collector.compact(); }
+    virtual uint64_t generation() const override { return _collector.generation(); }
+
+    virtual const std::string & data_file_name() const override { return _collector.data_file_name(); }
+};
+
+#endif // HW_L4_COLLECTOR_H
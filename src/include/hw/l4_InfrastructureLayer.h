@@ -1,128 +1,243 @@
 #ifndef HW_L4_INFRASTRUCTURE_LAYER_H
 #define HW_L4_INFRASTRUCTURE_LAYER_H
 
+#include <algorithm>
 #include <string>
-#include <map>
 #include <cassert>
 #include <memory>
 #include <mutex>
-
-#include <fstream>
-
-template<typename T>
-T readNumber(std::istream& is)
+#include <vector>
+
+#include "hw/l4_ByteBuffer.h"
+#include "tp/Statistics.h"
+
+/**
+ * @brief Версия формата файла данных
+ *
+ * @details Файл без сигнатуры (Legacy) начинается с количества элементов,
+ * индексы элементов в нём не хранятся и назначаются по порядку с 1.
+ * В файле с сигнатурой DATA_FILE_MAGIC (предпоследний байт - версия) после неё
+ * следуют максимальный выданный индекс и количество элементов, а у каждого
+ * элемента записан его индекс, поэтому после уплотнения индексы оставшихся
+ * элементов не меняются.
+ *
+ * Начиная с версии Checksummed содержимое файла разбито на блоки размером
+ * DATA_BLOCK_SIZE (последний блок короче): длина данных блока:u32, CRC32C:u32,
+ * данные. Сигнатура файла входит в заголовок первого блока, поэтому
+ * все блоки выровнены по DATA_BLOCK_SIZE.
+ *
+ * В версии Portable все числа фиксированной ширины записываются в порядке
+ * little-endian (см. hw/l4_ByteBuffer.h). Прежние версии записывались
+ * в машинном представлении x86-64 и читаются как little-endian.
+ *
+ * Запись всегда выполняется в последней версии, формат самого элемента
+ * определяют T::write и T::read, см. hw/l4_Collector.h (через интерфейс
+ * ACollector - ICollectable::write).
+ *
+ */
+enum class DataFormat : uint8_t
 {
-    T result;
-    is.read(reinterpret_cast<char *>(&result), sizeof(result));
-    return result;
-}
+    Legacy      = 0,
+    Indexed     = 1,    ///< числа в машинном представлении
+    Compact     = 2,    ///< varint, индексы и даты визитов - разности с предыдущими
+    Checksummed = 3,    ///< Compact в блоках с контрольными суммами
+    Portable    = 4,    ///< Checksummed, визиты вне календаря - массив int32
+};
 
-template<typename T>
-void writeNumber(std::ostream& os, T i)
+const DataFormat DATA_FORMAT_CURRENT = DataFormat::Portable;
+const size_t     DATA_BLOCK_SIZE     = 1 << 20;
+
+inline const char DATA_FILE_MAGIC[8] = {'\x89','L','A','B','D','B',static_cast<char>(DATA_FORMAT_CURRENT),'\n'};
+
+/**
+ * @brief Контрольная сумма CRC32C (полином Castagnoli)
+ *
+ * @details На x86-64 при поддержке SSE4.2 используется инструкция crc32,
+ * иначе - табличный алгоритм.
+ *
+ */
+uint32_t crc32c(const void * data, size_t size, uint32_t crc = 0);
+
+/**
+ * @brief Файл, отображённый в память только для чтения
+ *
+ */
+class MappedFile
 {
-    os.write(reinterpret_cast<char *>(&i),sizeof(i));
-}
-
-std::string readString(std::istream& is, size_t max_string_length);
-void writeString(std::ostream& os, const std::string& s);
+    const char * _data  = nullptr;
+    size_t       _size  = 0;
+    bool         _valid = false;
 
-class ICollectable
-{
 public:
-    virtual ~ICollectable() = default;
+    explicit MappedFile(const std::string & file_name);
+    ~MappedFile();
 
-    virtual bool write(std::ostream& os) = 0;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    bool         valid() const { return _valid; }
+    const char * data()  const { return _data; }
+    size_t       size()  const { return _size; }
 };
 
-class CollectorData
+/**
+ * @brief Файл данных с проверенной структурой
+ *
+ * @details Проверяет сигнатуру и контрольные суммы блоков, после чего
+ * элементы читаются из items() функцией readDataItems.
+ *
+ */
+class DataFileReader
 {
-    bool                          _removed_signs;
-    std::shared_ptr<ICollectable> _item;
+    MappedFile   _mapped;
+    std::string  _payload;              ///< данные блоков Checksummed и Portable
+    DataFormat   _format = DataFormat::Legacy;
+    const char * _items  = nullptr;
+    size_t       _size   = 0;
+    bool         _valid  = false;
 
 public:
-    CollectorData() = delete;
-    CollectorData(std::shared_ptr<ICollectable> item, bool removed_signs = false) 
-        : _removed_signs(removed_signs)
-        , _item(item)
-    {}
+    explicit DataFileReader(const std::string & file_name);
 
-    bool                          removed() const { return _removed_signs; }
-    std::shared_ptr<ICollectable> item()    const { return _item; }
+    /// Файл прочитан, его структура и контрольные суммы верны
+    bool       valid()  const { return _valid; }
+    bool       empty()  const { return _size == 0; }
+    DataFormat format() const { return _format; }
 
-    void remove() { _removed_signs = true; }
+    ByteReader items() const { return ByteReader(_items, _size); }
 };
 
-class ACollector
+/**
+ * @brief Чтение элементов файла данных
+ *
+ * @details Для каждого элемента вызывается read_item(index, removed, ByteReader &),
+ * которое читает сам элемент и возвращает false при повреждённых данных.
+ * В файле формата Legacy индексы не хранятся и назначаются по порядку после max_index.
+ *
+ * @param max_index Максимальный выданный индекс, увеличивается до максимального индекса файла.
+ *
+ * @return false Данные повреждены.
+ *
+ */
+template<typename F>
+bool readDataItems(const DataFileReader & file, size_t & max_index, F && read_item)
 {
-    std::string                    _file_name;
-    std::map<size_t,CollectorData> _items;
-    mutable std::mutex             _mutex;
-    size_t                         _max_index = 0;
-
-public:
-    virtual ~ACollector() = default;
+    if (file.empty())
+        return true;
 
-    virtual std::shared_ptr<ICollectable> read(std::istream& is) = 0;
+    ByteReader in = file.items();
 
-    size_t getSize() const 
-    {
-        std::lock_guard locker(_mutex);
-        if (_items.empty())
-            return 0;
-        return _items.size();
+    if (file.format() == DataFormat::Legacy) {
+        uint64_t count = in.getFixed<uint64_t>();
+        for(uint64_t i=0; i < count && !in.error(); ++i) {
+            bool removed = in.getFixed<uint8_t>() == 1;
+            if (!read_item(++max_index, removed, in))
+                return false;
+        }
+        return !in.error();
     }
 
-    std::shared_ptr<ICollectable> getItem(size_t index) const
-    {
-        std::lock_guard locker(_mutex);
-        auto it = _items.find(index);
-        if (it == _items.end())
-            return std::shared_ptr<ICollectable>();
-        return it->second.item();
+    uint64_t file_max_index = in.getFixed<uint64_t>();
+    uint64_t count          = in.getFixed<uint64_t>();
+
+    size_t index = 0;
+    for(uint64_t i=0; i < count && !in.error(); ++i) {
+        bool removed;
+        if (file.format() != DataFormat::Indexed) {
+            uint64_t tag = in.getVarint();
+            index  += tag >> 1;
+            removed = (tag & 1) != 0;
+        }
+        else {
+            index   = in.getFixed<uint64_t>();
+            removed = in.getFixed<uint8_t>() == 1;
+        }
+
+        if (!read_item(index, removed, in))
+            return false;
+        max_index = std::max(max_index, index);
     }
 
-    bool isRemoved(size_t index) const
-    {
-        std::lock_guard locker(_mutex);
-        auto it = _items.find(index);
-        if (it == _items.end())
-            return true;
-        return it->second.removed();
-    }
+    max_index = std::max<size_t>(max_index, file_max_index);
+    return !in.error();
+}
 
-    size_t addItem(std::shared_ptr<ICollectable> item, bool removed=false)
-    {
-        std::lock_guard locker(_mutex);
-        _max_index ++;
-        _items.insert({_max_index,{item,removed}});
-        return _max_index;
-    }
+class BlockWriter;
+
+/**
+ * @brief Запись файла данных в формате DATA_FORMAT_CURRENT
+ *
+ * @details Данные пишутся во временный файл блоками DATA_BLOCK_SIZE, commit()
+ * после fsync переименовывает его в файл данных, поэтому сбой во время записи
+ * не повреждает ранее сохранённые данные. Без commit() временный файл удаляется.
+ *
+ */
+class DataFileWriter
+{
+    std::string                  _file_name;
+    std::string                  _temp_name;
+    int                          _fd;
+    std::unique_ptr<BlockWriter> _blocks;
+    ByteWriter                   _out;
+    size_t                       _previous = 0;
+    bool                         _done     = false;
 
-    bool removeItem(size_t index)
-    {
-        std::lock_guard locker(_mutex);
-        auto it = _items.find(index);
-        if (it == _items.end())
-            return false;
-        it->second.remove();
-        return true;
-    }
+public:
+    DataFileWriter(const std::string & file_name, size_t max_index, size_t count);
+    ~DataFileWriter();
 
-    bool updateItem(size_t index, const std::shared_ptr<ICollectable> item)
-    {
-        std::lock_guard locker(_mutex);
-        auto it = _items.find(index);
-        if (it == _items.end())
-            return false;
-        it->second.item() = item;
-        return true;
-    }
+    DataFileWriter(const DataFileWriter &) = delete;
+    DataFileWriter & operator=(const DataFileWriter &) = delete;
+
+    /// Заголовок очередного элемента, сам элемент записывается в возвращаемый буфер
+    ByteWriter & beginItem(size_t index, bool removed);
+
+    /// Завершение элемента: набранный блок передаётся в файл
+    void endItem();
+
+    bool commit();
+};
+
+class ICollectable
+{
+public:
+    virtual ~ICollectable() = default;
+
+    virtual bool write(ByteWriter & out) = 0;
+};
+
+/**
+ * @brief Интерфейс коллекции с типом элементов, неизвестным при компиляции
+ *
+ * @details Оставлен для совместимости. Коллекции строятся на Collector<T>
+ * (hw/l4_Collector.h) и реализуют этот интерфейс через CollectorAdapter.
+ * getItem возвращает зафиксированное состояние элемента, которое записывается
+ * ICollectable::write и не меняется при последующих изменениях коллекции.
+ *
+ */
+class ACollector
+{
+public:
+    virtual ~ACollector() = default;
+
+    virtual size_t getSize() const = 0;
+
+    /// Зафиксированное состояние элемента (в том числе удалённого), nullptr - элемента нет
+    virtual std::shared_ptr<ICollectable> getItem(size_t index) const = 0;
+
+    virtual bool isRemoved(size_t index) const = 0;
+    virtual bool removeItem(size_t index) = 0;
+
+    virtual bool loadCollection(const std::string file_name) = 0;
+    virtual bool saveCollection() = 0;
 
-    bool loadCollection(const std::string file_name);
+    /// Уплотнение коллекции, см. Collector::compact
+    virtual size_t compact() = 0;
 
-    bool saveCollection() const;
+    /// Номер версии коллекции, см. Collector::generation
+    virtual uint64_t generation() const = 0;
 
-    const std::string & data_file_name() const { return _file_name; }
+    virtual const std::string & data_file_name() const = 0;
 };
 
 #endif // HW_L4_INFRASTRUCTURE_LAYER_H
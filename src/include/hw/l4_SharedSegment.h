@@ -0,0 +1,123 @@
+#ifndef HW_L4_SHARED_SEGMENT_H
+#define HW_L4_SHARED_SEGMENT_H
+
+/**
+ * Сегмент разделяемой памяти POSIX (shm_open), в котором один процесс-писатель
+ * публикует версии данных, а процессы-читатели просматривают их без копирования.
+ *
+ * Сегмент состоит из заголовка и двух областей данных. Версия n записывается
+ * в область n % 2, поэтому последняя опубликованная версия не меняется, пока
+ * записывается следующая. Счётчик версий в заголовке работает как seqlock:
+ * значение 2n-1 - версия n записывается, 2n - версия n опубликована. Читатель
+ * просматривает область последней опубликованной версии n и после просмотра
+ * проверяет, что писатель не начал записывать в ту же область версию n+2,
+ * иначе просмотр повторяется. Читатели не блокируют писателя и друг друга.
+ *
+ * Данные области адресуются смещениями от её начала, поэтому сегмент
+ * отображается в разных процессах по разным адресам. Сегмент только растёт:
+ * области, которой не хватает места, выделяется новое место в конце сегмента,
+ * поэтому отображение читателя никогда не указывает за конец объекта.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+class SharedSegment
+{
+public:
+    /// Наибольшее количество повторов просмотра, прерванного писателем
+    static constexpr int MAX_READ_ATTEMPTS = 100;
+
+private:
+    struct Header;
+
+    std::string _name;
+    int         _fd       = -1;
+    char *      _data     = nullptr;
+    size_t      _size     = 0;          ///< размер отображения
+    bool        _writable = false;
+    bool        _valid    = false;
+    std::mutex  _publish_mutex;
+
+    Header *       header()       { return reinterpret_cast<Header *>(_data); }
+    const Header * header() const { return reinterpret_cast<const Header *>(_data); }
+
+    bool map(size_t size);
+
+    /// Начало просмотра: последняя опубликованная версия и её область
+    bool beginRead(uint64_t & version, std::string_view & area);
+
+    /// Просмотр версии version не был прерван писателем
+    bool validateRead(uint64_t version) const;
+
+public:
+    enum class Mode { Write, Read };
+
+    /**
+     * @brief Открытие сегмента
+     *
+     * @param name Имя объекта разделяемой памяти, ведущий '/' добавляется при необходимости.
+     *
+     * @details Писатель создаёт сегмент (или продолжает нумерацию версий
+     * существующего) и получает исключительную блокировку flock: второй
+     * писатель того же сегмента не откроется. Читатель отображает сегмент
+     * только для чтения.
+     *
+     */
+    SharedSegment(const std::string & name, Mode mode);
+    ~SharedSegment();
+
+    SharedSegment(const SharedSegment &) = delete;
+    SharedSegment & operator=(const SharedSegment &) = delete;
+
+    bool                valid() const { return _valid; }
+    const std::string & name()  const { return _name; }
+
+    /// Номер последней опубликованной версии, 0 - ни одной
+    uint64_t version() const;
+
+    /**
+     * @brief Публикация новой версии (только писатель)
+     *
+     * @details fill(char * area) записывает size байт данных версии в область,
+     * которую сейчас не просматривают читатели последней версии.
+     *
+     * @return false Не удалось увеличить сегмент.
+     *
+     */
+    bool publish(size_t size, const std::function<void(char *)> & fill);
+
+    /**
+     * @brief Просмотр последней опубликованной версии
+     *
+     * @details scan(std::string_view area) вызывается для данных версии и может
+     * прочитать их частично изменёнными, если писатель успел начать запись
+     * в ту же область, поэтому scan должен проверять все смещения и не выводить
+     * ничего до возврата из read. Если просмотр был прерван, он повторяется.
+     *
+     * @return Результат scan или false, если версий нет или просмотр повторялся
+     * MAX_READ_ATTEMPTS раз.
+     *
+     */
+    template<typename F>
+    bool read(F && scan)
+    {
+        for(int attempt = 0; attempt < MAX_READ_ATTEMPTS; ++attempt) {
+            uint64_t         version;
+            std::string_view area;
+            if (!beginRead(version, area))
+                return false;
+
+            bool ok = scan(area);
+            if (validateRead(version))
+                return ok;
+        }
+        return false;
+    }
+};
+
+#endif // HW_L4_SHARED_SEGMENT_H
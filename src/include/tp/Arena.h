@@ -0,0 +1,88 @@
+/**
+ * @file Arena.h
+ * @brief Монотонный источник памяти на крупных областях, в том числе на больших страницах
+ *
+ * Память выделяется из областей, отображённых mmap, сдвигом указателя, поэтому
+ * мелкие объекты, созданные подряд, лежат плотно, без заголовков malloc,
+ * а проход по ним затрагивает меньше страниц и записей TLB. Освобождение
+ * отдельных блоков ничего не делает: память возвращается системе при
+ * разрушении арены. Для повторного использования освобождённых блоков арену
+ * ставят источником (upstream) для std::pmr::synchronized_pool_resource.
+ *
+ * Области могут размещаться на больших страницах:
+ *
+ * * HugePages::Transparent - области выравниваются по 2 МиБ и отмечаются
+ *   madvise(MADV_HUGEPAGE), ядро подставляет большие страницы, если может;
+ * * HugePages::Explicit - области отображаются с MAP_HUGETLB из заранее
+ *   выделенных больших страниц (vm.nr_hugepages). Если их не хватает,
+ *   арена переходит к HugePages::Transparent.
+ *
+ */
+
+#ifndef tp_arena_H
+#define tp_arena_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+namespace tp
+{
+
+class Arena : public std::pmr::memory_resource
+{
+public:
+    enum class HugePages { None, Transparent, Explicit };
+
+    static constexpr size_t HUGE_PAGE_SIZE     = size_t(2) << 20;
+    static constexpr size_t MAX_REGION_SIZE    = size_t(64) << 20;
+
+    struct Stats
+    {
+        size_t regions      = 0;
+        size_t huge_regions = 0;    ///< области с MAP_HUGETLB
+        size_t reserved     = 0;    ///< байт отображено
+        size_t allocated    = 0;    ///< байт выдано
+    };
+
+private:
+    struct Region
+    {
+        char * base;
+        size_t size;
+    };
+
+    HugePages           _huge_pages;
+    size_t              _region_size;   ///< размер следующей области, удваивается до MAX_REGION_SIZE
+    mutable std::mutex  _mutex;
+    std::vector<Region> _regions;
+    char *              _current = nullptr;
+    char *              _end     = nullptr;
+    Stats               _stats;
+
+    /// Отображение области не меньше size байт; nullptr - память исчерпана
+    char * mapRegion(size_t & size);
+
+protected:
+    virtual void * do_allocate(size_t bytes, size_t alignment) override;
+    virtual void   do_deallocate(void * p, size_t bytes, size_t alignment) override;
+    virtual bool   do_is_equal(const std::pmr::memory_resource & other) const noexcept override;
+
+public:
+    /**
+     * @param region_size Размер первой области, округляется до HUGE_PAGE_SIZE.
+     *
+     */
+    explicit Arena(HugePages huge_pages = HugePages::Transparent, size_t region_size = HUGE_PAGE_SIZE);
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena & operator=(const Arena &) = delete;
+
+    Stats stats() const;
+};
+
+}
+
+#endif
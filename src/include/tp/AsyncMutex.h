@@ -0,0 +1,130 @@
+/**
+ * @file AsyncMutex.h
+ * @brief Мьютекс, который можно захватывать как из потока, так и из сопрограммы
+ *
+ * Обычный захват (lock, try_lock, unlock) совместим с std::lock_guard
+ * и tp::MeasuredLock. Сопрограмма захватывает мьютекс выражением
+ * co_await mutex.lockAsync(): если мьютекс занят, она приостанавливается,
+ * не занимая поток, и продолжается в потоке пула, в котором ожидала
+ * (см. ThreadPool::current), захватив мьютекс.
+ *
+ * Свободный мьютекс захватывается и освобождается одной атомарной операцией.
+ * Потоки ждут занятый мьютекс на самом его состоянии (std::atomic::wait),
+ * сопрограммы - в очереди. Освобождающий занятый мьютекс будит один поток
+ * и первую сопрограмму очереди, и они повторяют захват. Мьютекс не передаётся
+ * ожидающему напрямую: сопрограмма до возобновления может долго стоять
+ * в очереди пула, и потоки пула, захватывающие мьютекс обычным образом,
+ * ждали бы её, не оставив ей свободного потока.
+ *
+ */
+
+#ifndef tp_async_mutex_H
+#define tp_async_mutex_H
+
+#include <atomic>
+#include <coroutine>
+#include <mutex>
+#include <utility>
+
+namespace tp
+{
+
+class ThreadPool;
+
+class AsyncMutex
+{
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        ThreadPool *            pool = nullptr;     ///< пул, в котором продолжится сопрограмма
+        Waiter *                next = nullptr;
+    };
+
+    /// 0 - свободен, 1 - захвачен, 2 - захвачен, возможно, есть ожидающие
+    std::atomic<int>    _state {0};
+    /// Сопрограмм в очереди: освобождающий не захватывает _queue_mutex, пока их нет
+    std::atomic<size_t> _queued {0};
+    std::mutex          _queue_mutex;
+    Waiter *            _head = nullptr;
+    Waiter *            _tail = nullptr;
+
+    class AcquireTask;
+
+    /// Постановка сопрограммы в очередь, если мьютекс занят; false - мьютекс захвачен без ожидания
+    bool enqueue(Waiter & waiter);
+
+    /// Захват мьютекса для разбуженной сопрограммы и её возобновление либо повторное ожидание
+    void acquireFor(Waiter & waiter);
+
+    void lockSlow();
+    void unlockSlow();
+
+public:
+    /**
+     * @brief Владение мьютексом, захваченным сопрограммой
+     *
+     */
+    class Guard
+    {
+        AsyncMutex * _mutex;
+
+    public:
+        explicit Guard(AsyncMutex * mutex) : _mutex(mutex) {}
+
+        Guard(Guard && other) noexcept : _mutex(std::exchange(other._mutex, nullptr)) {}
+
+        Guard(const Guard &) = delete;
+        Guard & operator=(const Guard &) = delete;
+        Guard & operator=(Guard &&) = delete;
+
+        ~Guard()
+        {
+            if (_mutex != nullptr)
+                _mutex->unlock();
+        }
+    };
+
+    class LockAwaiter
+    {
+        AsyncMutex & _mutex;
+        Waiter       _waiter;
+
+    public:
+        explicit LockAwaiter(AsyncMutex & mutex) : _mutex(mutex) {}
+
+        bool  await_ready() { return _mutex.try_lock(); }
+        bool  await_suspend(std::coroutine_handle<> handle);
+        Guard await_resume() noexcept { return Guard(&_mutex); }
+    };
+
+    AsyncMutex() = default;
+
+    AsyncMutex(const AsyncMutex &) = delete;
+    AsyncMutex & operator=(const AsyncMutex &) = delete;
+
+    bool try_lock()
+    {
+        int expected = 0;
+        return _state.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void lock()
+    {
+        if (!try_lock())
+            lockSlow();
+    }
+
+    void unlock()
+    {
+        int expected = 1;
+        if (!_state.compare_exchange_strong(expected, 0, std::memory_order_release, std::memory_order_relaxed))
+            unlockSlow();
+    }
+
+    /// Захват сопрограммой: co_await возвращает Guard
+    LockAwaiter lockAsync() { return LockAwaiter(*this); }
+};
+
+}
+
+#endif
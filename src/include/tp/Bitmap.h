@@ -0,0 +1,91 @@
+/**
+ * @file Bitmap.h
+ * @brief Сжатое множество неотрицательных целых в стиле Roaring
+ *
+ * Значение делится на ключ контейнера (старшие биты) и младшие 16 бит.
+ * Контейнер, в котором не больше ARRAY_MAX_SIZE значений, хранит их
+ * отсортированным массивом uint16_t, больший - битовой картой из 65536 бит.
+ * Поэтому разреженное множество занимает около 2 байт на значение, а плотное -
+ * не больше 8 КиБ на 65536 значений.
+ *
+ */
+
+#ifndef tp_bitmap_H
+#define tp_bitmap_H
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tp
+{
+
+class Bitmap
+{
+public:
+    static constexpr size_t ARRAY_MAX_SIZE = 4096;
+    static constexpr size_t BITMAP_WORDS   = (1 << 16) / 64;
+
+private:
+    struct Container
+    {
+        uint64_t              key;
+        size_t                cardinality = 0;
+        std::vector<uint16_t> array;    ///< значения по возрастанию, пока контейнер - массив
+        std::vector<uint64_t> bits;     ///< BITMAP_WORDS слов, если контейнер - битовая карта
+
+        bool isBitmap() const { return !bits.empty(); }
+
+        void toBitmap();
+        void toArray();
+    };
+
+    std::vector<Container> _containers;     ///< по возрастанию ключа
+
+    std::vector<Container>::iterator find(uint64_t key);
+
+public:
+    /// @return false Значение уже было в множестве
+    bool add(uint64_t value);
+
+    /// @return false Значения не было в множестве
+    bool remove(uint64_t value);
+
+    bool contains(uint64_t value) const;
+
+    bool   empty() const { return _containers.empty(); }
+    size_t cardinality() const;
+
+    /**
+     * @brief Объединение с другим множеством
+     *
+     * @details Битовые карты объединяются словами по 256 бит (AVX2),
+     * если процессор это поддерживает.
+     *
+     */
+    Bitmap & operator |= (const Bitmap & other);
+
+    /// Обход значений по возрастанию
+    template<typename F>
+    void forEach(F && action) const
+    {
+        for(const Container & c : _containers) {
+            uint64_t high = c.key << 16;
+
+            if (!c.isBitmap()) {
+                for(uint16_t low : c.array)
+                    action(high | low);
+                continue;
+            }
+
+            for(size_t w=0; w < BITMAP_WORDS; ++w)
+                for(uint64_t word = c.bits[w]; word != 0; word &= word - 1)
+                    action(high | (w * 64 + std::countr_zero(word)));
+        }
+    }
+};
+
+}
+
+#endif // tp_bitmap_H
@@ -0,0 +1,265 @@
+/**
+ * @file Coroutine.h
+ * @brief Сопрограммы C++20, выполняемые потоками tp::ThreadPool
+ *
+ * tp::Task<T> - ленивая сопрограмма: начинает выполняться при co_await и по
+ * завершении передаёт управление ожидающей сопрограмме без участия очереди
+ * пула (symmetric transfer). Сопрограммы верхнего уровня запускаются
+ * в пуле через tp::TaskGroup, который позволяет дождаться их завершения
+ * из обычного потока.
+ *
+ * Пока сопрограмма ожидает (co_await tp::yield(), блокировки tp::AsyncMutex,
+ * готовности дескриптора tp::Poller), поток пула выполняет другие задачи,
+ * поэтому одновременно могут выполняться тысячи сопрограмм на нескольких потоках.
+ *
+ */
+
+#ifndef tp_coroutine_H
+#define tp_coroutine_H
+
+#include "tp/ThreadPool.h"
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace tp
+{
+
+/**
+ * @brief Задача пула, возобновляющая сопрограмму
+ *
+ */
+class ResumeTask : public Task_interface
+{
+    std::coroutine_handle<> _handle;
+
+public:
+    explicit ResumeTask(std::coroutine_handle<> handle) : _handle(handle) {}
+
+    virtual void work() override { _handle.resume(); }
+};
+
+template<typename T = void>
+class Task;
+
+namespace detail
+{
+    class PromiseBase
+    {
+        std::coroutine_handle<> _continuation = std::noop_coroutine();
+        std::exception_ptr      _error;
+
+    public:
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            template<typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                return handle.promise()._continuation;
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter        final_suspend()   noexcept { return {}; }
+
+        void unhandled_exception() { _error = std::current_exception(); }
+
+        void setContinuation(std::coroutine_handle<> continuation) { _continuation = continuation; }
+
+        void rethrow()
+        {
+            if (_error)
+                std::rethrow_exception(_error);
+        }
+    };
+
+    template<typename T>
+    class Promise : public PromiseBase
+    {
+        std::optional<T> _value;
+
+    public:
+        Task<T> get_return_object();
+
+        void return_value(T value) { _value.emplace(std::move(value)); }
+
+        T result()
+        {
+            rethrow();
+            return std::move(*_value);
+        }
+    };
+
+    template<>
+    class Promise<void> : public PromiseBase
+    {
+    public:
+        Task<void> get_return_object();
+
+        void return_void() {}
+
+        void result() { rethrow(); }
+    };
+}
+
+/**
+ * @brief Ленивая сопрограмма с результатом T
+ *
+ * @details Выполняется при первом (и единственном) co_await, исключение
+ * сопрограммы передаётся ожидающей. Задача владеет кадром сопрограммы.
+ *
+ */
+template<typename T>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+    Task(Task && other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+
+    Task & operator=(Task && other) noexcept
+    {
+        if (this != &other) {
+            if (_handle)
+                _handle.destroy();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task & operator=(const Task &) = delete;
+
+    ~Task()
+    {
+        if (_handle)
+            _handle.destroy();
+    }
+
+    auto operator co_await() noexcept
+    {
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                handle.promise().setContinuation(continuation);
+                return handle;
+            }
+
+            T await_resume() { return handle.promise().result(); }
+        };
+
+        return Awaiter {_handle};
+    }
+};
+
+namespace detail
+{
+    template<typename T>
+    Task<T> Promise<T>::get_return_object()
+    {
+        return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+    }
+
+    inline Task<void> Promise<void>::get_return_object()
+    {
+        return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+    }
+}
+
+/**
+ * @brief Продолжение сопрограммы в потоке пула
+ *
+ * @details Сопрограмма ставится в конец очереди пула. Пул без потоков
+ * выполняет задачи сразу, поэтому в нём сопрограмма продолжается без ожидания.
+ *
+ */
+class Schedule
+{
+    ThreadPool * _pool;
+
+public:
+    explicit Schedule(ThreadPool * pool) : _pool(pool) {}
+
+    bool await_ready() const noexcept { return _pool == nullptr || _pool->size() == 0; }
+
+    void await_suspend(std::coroutine_handle<> handle) { _pool->submit(new ResumeTask(handle)); }
+
+    void await_resume() noexcept {}
+};
+
+inline Schedule schedule(ThreadPool & pool) { return Schedule(&pool); }
+
+/**
+ * @brief Уступить поток пула другим задачам
+ *
+ * @details Используется в долгих просмотрах: сопрограмма продолжится после
+ * задач, уже стоящих в очереди пула. Вне потока пула не приостанавливает.
+ *
+ */
+inline Schedule yield() { return Schedule(ThreadPool::current()); }
+
+/**
+ * @brief Группа сопрограмм верхнего уровня
+ *
+ * @details Каждая сопрограмма, переданная spawn, начинает выполняться
+ * в потоке пула, кадр освобождается по её завершении. wait ожидает
+ * завершения всех сопрограмм группы и передаёт первое из их исключений.
+ * Пул должен жить, пока группа не дождалась сопрограмм.
+ *
+ */
+class TaskGroup
+{
+    std::mutex              _mutex;
+    std::condition_variable _done;
+    size_t                  _active = 0;
+    std::exception_ptr      _error;
+
+    struct Detached
+    {
+        struct promise_type
+        {
+            Detached            get_return_object() noexcept { return {}; }
+            std::suspend_never  initial_suspend() noexcept { return {}; }
+            std::suspend_never  final_suspend() noexcept { return {}; }
+            void                return_void() noexcept {}
+            void                unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    static Detached run(TaskGroup & group, ThreadPool & pool, Task<void> task);
+
+    void finish(std::exception_ptr error);
+
+public:
+    TaskGroup() = default;
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup & operator=(const TaskGroup &) = delete;
+
+    void spawn(ThreadPool & pool, Task<void> task);
+
+    void wait();
+};
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * @file PageFile.h
+ * @brief Файл записей переменной длины на страницах со слотами, отображённый в память
+ *
+ * Файл делится на страницы по PAGE_SIZE байт. В начале страницы - заголовок
+ * и каталог слотов (смещение и длина записи), данные записей заполняют
+ * страницу с конца. Запись адресуется номером страницы и слота (Ref), поэтому
+ * при уплотнении страницы записи перемещаются внутри неё, а ссылки на них
+ * не меняются. Чтение записи затрагивает одну страницу.
+ *
+ * Запись, которая не помещается на страницу, занимает несколько страниц подряд
+ * в конце файла. После освобождения эти страницы используются для обычных записей.
+ *
+ * Файл отображается в память (MAP_SHARED) на всё допустимое пространство
+ * адресов сразу, поэтому при росте файла адреса страниц не меняются,
+ * а ядро может выгружать страницы на диск, не занимая память процесса.
+ * Место на диске резервируется при росте файла (posix_fallocate): при нехватке
+ * места запись не выполняется, а не завершает процесс сигналом SIGBUS.
+ * Файл удаляется сразу после создания, его место освобождается с завершением процесса.
+ *
+ */
+
+#ifndef tp_page_file_H
+#define tp_page_file_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+
+namespace tp
+{
+
+class PageFile
+{
+public:
+    using Ref = uint64_t;
+
+    static constexpr Ref    NO_REF           = ~Ref(0);
+    static constexpr size_t PAGE_SIZE        = 4096;
+    static constexpr size_t DEFAULT_MAX_SIZE = size_t(1) << 40;
+
+    struct Stats
+    {
+        size_t pages   = 0;     ///< страниц в файле
+        size_t records = 0;     ///< записей в файле
+        size_t bytes   = 0;     ///< байт в записях
+        size_t writes  = 0;     ///< записей добавлено
+        size_t reads   = 0;     ///< записей прочитано
+    };
+
+private:
+    struct PageHeader
+    {
+        uint32_t run;           ///< 0 - страница со слотами, иначе страниц в большой записи
+        uint32_t length;        ///< длина большой записи
+        uint16_t slots;         ///< элементов в каталоге слотов
+        uint16_t data_begin;    ///< начало данных записей
+        uint16_t free_bytes;    ///< свободно, включая промежутки между записями
+        uint16_t reserved;
+    };
+
+    struct Slot
+    {
+        uint16_t offset;        ///< 0 - слот свободен
+        uint16_t length;
+    };
+
+    static constexpr uint16_t LARGE_SLOT = 0xFFFF;
+    static constexpr size_t   MAX_SMALL  = PAGE_SIZE - sizeof(PageHeader) - sizeof(Slot);
+
+    std::string      _file_name;
+    int              _fd       = -1;
+    char *           _base     = nullptr;
+    size_t           _capacity = 0;     ///< страниц в отображении
+    size_t           _file_pages = 0;   ///< страниц, для которых выделено место в файле
+    size_t           _pages    = 0;     ///< использовано страниц
+    mutable std::mutex _mutex;
+    mutable Stats    _stats;
+
+    /// Страницы со слотами, где есть место: (свободно байт, номер страницы)
+    std::set<std::pair<uint16_t,uint32_t>> _free_pages;
+
+    PageHeader & header(size_t page) const { return *reinterpret_cast<PageHeader *>(_base + page * PAGE_SIZE); }
+    Slot *       slots(size_t page)  const { return reinterpret_cast<Slot *>(_base + page * PAGE_SIZE + sizeof(PageHeader)); }
+
+    /// Новые страницы в конце файла; SIZE_MAX - файл нельзя увеличить
+    size_t appendPages(size_t count);
+
+    void resetPage(size_t page);
+    void compactPage(size_t page);
+    void updateFreePages(size_t page, uint16_t old_free);
+
+    std::string_view recordLocked(Ref ref) const;
+
+public:
+    /**
+     * @param max_size Наибольший размер файла, столько же адресного пространства
+     * резервируется отображением. Если столько недоступно, резервируется меньше.
+     *
+     */
+    explicit PageFile(const std::string & file_name, size_t max_size = DEFAULT_MAX_SIZE);
+    ~PageFile();
+
+    PageFile(const PageFile &) = delete;
+    PageFile & operator=(const PageFile &) = delete;
+
+    bool valid() const { return _base != nullptr; }
+
+    const std::string & file_name() const { return _file_name; }
+
+    /// Добавление записи; NO_REF - файл заполнен или нет места на диске
+    Ref put(std::string_view record);
+
+    /**
+     * @brief Чтение записи без копирования
+     *
+     * @details action(std::string_view) вызывается под блокировкой файла,
+     * его результат возвращается. Данные действительны только внутри action.
+     *
+     */
+    template<typename F>
+    auto withRecord(Ref ref, F && action) const
+    {
+        std::lock_guard locker(_mutex);
+        _stats.reads ++;
+        return action(recordLocked(ref));
+    }
+
+    /// Освобождение записи, ссылка на неё становится недействительной
+    void free(Ref ref);
+
+    Stats stats() const;
+};
+
+}
+
+#endif
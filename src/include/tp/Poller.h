@@ -0,0 +1,90 @@
+/**
+ * @file Poller.h
+ * @brief Асинхронный ввод-вывод для сопрограмм
+ *
+ * Отдельный поток ждёт готовности дескрипторов (epoll) и возобновляет
+ * ожидавшие их сопрограммы в потоках пула, поэтому сопрограмма, ожидающая
+ * ввода или возможности вывода, не занимает поток пула.
+ *
+ * Дескрипторы должны быть неблокирующими (O_NONBLOCK). Обычные файлы
+ * всегда готовы к чтению и записи и не регистрируются в epoll: сопрограмма
+ * продолжается без приостановки. Один дескриптор в один момент может
+ * ожидать только одна сопрограмма.
+ *
+ */
+
+#ifndef tp_poller_H
+#define tp_poller_H
+
+#include "tp/Coroutine.h"
+
+#include <atomic>
+#include <string_view>
+#include <sys/types.h>
+#include <thread>
+
+namespace tp
+{
+
+class Poller
+{
+    ThreadPool &     _pool;
+    int              _epoll_fd = -1;
+    int              _wake_fd  = -1;
+    std::atomic_bool _stop {false};
+    std::thread      _thread;
+
+    void loop();
+
+    /// Ожидание событий events дескриптора fd; false - дескриптор не поддерживает ожидание
+    bool arm(int fd, uint32_t events, std::coroutine_handle<> handle);
+
+public:
+    class Awaiter
+    {
+        Poller & _poller;
+        int      _fd;
+        uint32_t _events;
+
+    public:
+        Awaiter(Poller & poller, int fd, uint32_t events) : _poller(poller), _fd(fd), _events(events) {}
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle) { return _poller.arm(_fd, _events, handle); }
+        void await_resume() noexcept {}
+    };
+
+    explicit Poller(ThreadPool & pool);
+    ~Poller();
+
+    Poller(const Poller &) = delete;
+    Poller & operator=(const Poller &) = delete;
+
+    bool valid() const { return _epoll_fd >= 0 && _wake_fd >= 0; }
+
+    /// Ожидание готовности дескриптора к чтению
+    Awaiter readable(int fd);
+
+    /// Ожидание готовности дескриптора к записи
+    Awaiter writable(int fd);
+};
+
+/**
+ * @brief Чтение из неблокирующего дескриптора
+ *
+ * @return Количество прочитанных байт, 0 - конец ввода, -1 - ошибка (errno).
+ *
+ */
+Task<ssize_t> asyncRead(Poller & poller, int fd, char * buffer, size_t size);
+
+/**
+ * @brief Запись всех данных в неблокирующий дескриптор
+ *
+ * @return false Ошибка записи (errno).
+ *
+ */
+Task<bool> asyncWrite(Poller & poller, int fd, std::string_view data);
+
+}
+
+#endif
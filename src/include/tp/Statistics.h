@@ -0,0 +1,275 @@
+/**
+ * @file Statistics.h
+ * @brief Встроенная статистика: счётчики и гистограммы задержек
+ *
+ * Каждый поток пишет в собственные счётчики без блокировок,
+ * объединение выполняется один раз при формировании отчёта.
+ *
+ */
+
+#ifndef tp_statistics_H
+#define tp_statistics_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef TP_TRACE
+#include "tp/Trace.h"
+#endif
+
+namespace tp
+{
+
+/**
+ * @brief Гистограмма задержек в стиле HDR
+ *
+ * @details Значения до 32 хранятся точно, далее каждый интервал [2^k, 2^(k+1))
+ * делится на 16 равных частей, что даёт относительную погрешность не более 6.25%.
+ * Значения больше 2^40 нс (около 18 минут) попадают в последнюю корзину.
+ *
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned SUB_BUCKET_BITS  = 4;
+    static constexpr unsigned SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_VALUE_BITS   = 40;
+    static constexpr size_t   BUCKET_COUNT     = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+private:
+    std::array<uint64_t,BUCKET_COUNT> _buckets {};
+    uint64_t _count = 0;
+    uint64_t _sum   = 0;
+    uint64_t _min   = UINT64_MAX;
+    uint64_t _max   = 0;
+
+    static size_t   bucketIndex(uint64_t value);
+    static uint64_t bucketValue(size_t index);
+
+public:
+    void record(uint64_t value)
+    {
+        _buckets[bucketIndex(value)] ++;
+        _count ++;
+        _sum += value;
+        if (value < _min) _min = value;
+        if (value > _max) _max = value;
+    }
+
+    void merge(const LatencyHistogram & other);
+
+    uint64_t count() const { return _count; }
+    uint64_t sum()   const { return _sum; }
+    uint64_t min()   const { return _count ? _min : 0; }
+    uint64_t max()   const { return _max; }
+    double   mean()  const { return _count ? double(_sum) / double(_count) : 0.0; }
+
+    /**
+     * @brief Значение, не превышаемое заданной долей замеров
+     *
+     * @param fraction Доля в диапазоне [0,1], например 0.99
+     *
+     */
+    uint64_t percentile(double fraction) const;
+};
+
+/**
+ * @brief Реестр статистики процесса
+ *
+ * @details Серии (именованные гистограммы) регистрируются один раз, обычно в
+ * статической переменной по месту использования. Запись выполняется в
+ * потоколокальный набор гистограмм, поэтому не требует синхронизации.
+ *
+ * Пока статистика не включена, record сводится к одной проверке флага.
+ *
+ * @attention Отчёт следует формировать после завершения потоков,
+ * которые пишут статистику (например, после разрушения tp::ThreadPool).
+ *
+ */
+class Statistics
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum class Format { Text, Json };
+
+private:
+    struct ThreadData
+    {
+        std::vector<std::unique_ptr<LatencyHistogram>> series;
+    };
+
+    std::atomic_bool                         _enabled {false};
+    clock::time_point                        _enabled_at;
+    mutable std::mutex                       _mutex;
+    std::vector<std::string>                 _series_names;
+    std::vector<std::unique_ptr<ThreadData>> _threads;
+
+    Statistics() = default;
+
+    ThreadData & threadData();
+
+public:
+    Statistics(const Statistics &) = delete;
+    Statistics & operator=(const Statistics &) = delete;
+
+    static Statistics & instance();
+
+    void enable();
+    bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Регистрация серии
+     *
+     * @return size_t Идентификатор серии. Повторная регистрация того же имени
+     * возвращает тот же идентификатор.
+     *
+     */
+    size_t registerSeries(const std::string & name);
+
+    void record(size_t series, uint64_t value)
+    {
+        if (!enabled())
+            return;
+        recordEnabled(series, value);
+    }
+
+    void recordEnabled(size_t series, uint64_t value);
+
+    /**
+     * @brief Объединение потоковых счётчиков и формирование отчёта
+     *
+     */
+    std::string report(Format format) const;
+
+    static uint64_t nanosecondsSince(clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+};
+
+/**
+ * @brief Замер длительности области видимости
+ *
+ */
+class ScopedLatency
+{
+    size_t                        _series;
+    bool                          _active;
+    Statistics::clock::time_point _start;
+
+public:
+    explicit ScopedLatency(size_t series)
+        : _series(series)
+        , _active(Statistics::instance().enabled())
+    {
+        if (_active)
+            _start = Statistics::clock::now();
+    }
+
+    ScopedLatency(const ScopedLatency &) = delete;
+    ScopedLatency & operator=(const ScopedLatency &) = delete;
+
+    ~ScopedLatency()
+    {
+        if (_active)
+            Statistics::instance().recordEnabled(_series, Statistics::nanosecondsSince(_start));
+    }
+};
+
+/**
+ * @brief Место захвата блокировки: имя для трассировки и серия статистики ожидания
+ *
+ * @details Создаётся один раз, обычно в статической переменной. Имя должно быть
+ * строкой со статическим временем жизни.
+ *
+ */
+struct LockSite
+{
+    const char * name;
+    size_t       series;
+
+    explicit LockSite(const char * lock_name)
+        : name(lock_name)
+        , series(Statistics::instance().registerSeries(lock_name))
+    {}
+};
+
+/**
+ * @brief Аналог std::lock_guard, замеряющий время ожидания блокировки
+ *
+ * @details Сначала выполняется try_lock, поэтому захват свободного мьютекса
+ * не требует обращения к часам.
+ *
+ * При сборке с TP_TRACE в трассировку записываются интервалы ожидания
+ * и удержания блокировки.
+ *
+ */
+template <typename Mutex>
+class MeasuredLock
+{
+    Mutex &          _mutex;
+#ifdef TP_TRACE
+    const LockSite & _site;
+    uint64_t         _acquired = 0;
+#endif
+
+public:
+    MeasuredLock(Mutex & mutex, const LockSite & site)
+        : _mutex(mutex)
+#ifdef TP_TRACE
+        , _site(site)
+#endif
+    {
+#ifdef TP_TRACE
+        Trace & trace = Trace::instance();
+        if (trace.enabled()) {
+            uint64_t start = trace.now();
+            if (!_mutex.try_lock()) {
+                _mutex.lock();
+                trace.complete("lock", "lock wait", start);
+            }
+            _acquired = trace.now();
+            Statistics::instance().record(site.series, _acquired - start);
+            return;
+        }
+#endif
+        Statistics & stat = Statistics::instance();
+
+        if (!stat.enabled()) {
+            _mutex.lock();
+            return;
+        }
+
+        if (_mutex.try_lock()) {
+            stat.recordEnabled(site.series, 0);
+            return;
+        }
+
+        Statistics::clock::time_point start = Statistics::clock::now();
+        _mutex.lock();
+        stat.recordEnabled(site.series, Statistics::nanosecondsSince(start));
+    }
+
+    MeasuredLock(const MeasuredLock &) = delete;
+    MeasuredLock & operator=(const MeasuredLock &) = delete;
+
+    ~MeasuredLock()
+    {
+#ifdef TP_TRACE
+        if (_acquired != 0)
+            Trace::instance().complete("lock", _site.name, _acquired);
+#endif
+        _mutex.unlock();
+    }
+};
+
+}
+
+#endif
@@ -20,6 +20,7 @@
 
 #include "tp/ThreadsafeQueue.h"
 #include "tp/Task_interface.h"
+#include "tp/Statistics.h"
 
 #include <vector>
 #include <functional>
@@ -27,6 +28,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <utility>
 
 namespace tp
 {
@@ -54,10 +56,28 @@ class ThreadPool
     std::mutex               _waiting_mutex;
     std::vector<std::thread> _threads;
 
-    ThreadsafeQueue<Task_interface *> _task_queue;
+    struct QueuedTask
+    {
+        Task_interface *              task = nullptr;
+        Statistics::clock::time_point submitted;    ///< Заполняется только при включённой статистике
+    };
+
+    ThreadsafeQueue<QueuedTask> _task_queue;
 
     void worker();
 
+    /**
+     * @brief Выполнение chunk(0) ... chunk(count-1) вызывающим потоком и задачами пула
+     *
+     * @details Номера частей разбираются по общему счётчику, завершение ожидается
+     * по счётчику выполненных частей (join). Вызывающий поток сам выполняет части,
+     * которые не успели взять задачи пула, поэтому вызов из задачи этого же пула
+     * не приводит к взаимоблокировке, даже если все потоки пула заняты.
+     * Исключение, выброшенное частью, передаётся вызывающему потоку.
+     *
+     */
+    void runChunks(size_t count, const std::function<void(size_t)> & chunk);
+
 public:
     /**
      * @brief Конструктор.
@@ -113,6 +133,15 @@ public:
      */
     size_t size() const { return _number_of_threads; } 
 
+    /**
+     * @brief Пул, потоком которого является вызывающий поток, или nullptr
+     *
+     * @details Используется сопрограммами (см. tp/Coroutine.h), чтобы
+     * продолжиться в том же пуле после ожидания.
+     *
+     */
+    static ThreadPool * current();
+
     /**
      * @brief Возвращает примерный размер очереди.
      * 
@@ -123,6 +152,46 @@ public:
      * 
      */
     size_t queue_length() const { return _task_queue.size(); }
+
+    /**
+     * @brief Количество частей, на которые делится диапазон из size элементов
+     *
+     * @details Части содержат не меньше grain элементов; частей не больше,
+     * чем по четыре на поток пула, чтобы выровнять нагрузку потоков.
+     *
+     */
+    size_t chunk_count(size_t size, size_t grain) const;
+
+    /**
+     * @brief Параллельное выполнение body(begin, end) для частей диапазона [0, size)
+     *
+     * @details Возвращает управление после выполнения всех частей, см. runChunks.
+     *
+     */
+    void parallel_for(size_t size, size_t grain, const std::function<void(size_t,size_t)> & body);
+
+    /**
+     * @brief Параллельная свёртка диапазона [0, size)
+     *
+     * @details Для каждой части вычисляется map(begin, end), результаты частей
+     * объединяются reduce(накопленное, результат части) в порядке частей,
+     * поэтому reduce может быть некоммутативным (например, конкатенацией).
+     *
+     */
+    template<typename T, typename Map, typename Reduce>
+    T parallel_reduce(size_t size, size_t grain, T init, Map map, Reduce reduce)
+    {
+        size_t         count = chunk_count(size, grain);
+        std::vector<T> partial(count);
+
+        runChunks(count, [&](size_t i) {
+            partial[i] = map(size * i / count, size * (i + 1) / count);
+        });
+
+        for(T & part : partial)
+            init = reduce(std::move(init), std::move(part));
+        return init;
+    }
 };
 
 }
@@ -0,0 +1,154 @@
+/**
+ * @file Trace.h
+ * @brief Трассировка событий пула потоков в формате Chrome trace_event
+ *
+ * Трассировка включается при сборке (cmake -DLAB_TRACE=ON, определяется макрос TP_TRACE)
+ * и затем при запуске (bin/lab --trace=<файл>). Без TP_TRACE макросы TP_TRACE_*
+ * раскрываются в пустые выражения и не создают накладных расходов.
+ *
+ * Полученный файл открывается в chrome://tracing или https://ui.perfetto.dev.
+ *
+ */
+
+#ifndef tp_trace_H
+#define tp_trace_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace tp
+{
+
+/**
+ * @brief Журнал событий трассировки
+ *
+ * @details Каждый поток пишет события в собственный кольцевой буфер фиксированного
+ * размера без синхронизации. При переполнении самые старые события затираются.
+ * Имена и категории событий должны быть строками со статическим временем жизни.
+ *
+ * @attention Запись файла следует выполнять после завершения потоков,
+ * которые пишут события (например, после разрушения tp::ThreadPool).
+ *
+ */
+class Trace
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t RING_CAPACITY = 1 << 16;
+
+private:
+    struct Event
+    {
+        const char * category;
+        const char * name;
+        char         phase;     ///< 'X' - интервал, 'i' - мгновенное событие
+        uint64_t     timestamp; ///< нс от начала трассировки
+        uint64_t     duration;  ///< нс, только для интервалов
+    };
+
+    struct ThreadRing
+    {
+        size_t             thread_id;
+        uint64_t           written = 0;
+        std::vector<Event> events;
+    };
+
+    std::atomic_bool                         _enabled {false};
+    clock::time_point                        _start;
+    std::mutex                               _mutex;
+    std::vector<std::unique_ptr<ThreadRing>> _rings;
+
+    Trace() = default;
+
+    ThreadRing & threadRing();
+    void         append(const Event & event);
+
+public:
+    Trace(const Trace &) = delete;
+    Trace & operator=(const Trace &) = delete;
+
+    static Trace & instance();
+
+    void enable();
+    bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start).count();
+    }
+
+    void instant(const char * category, const char * name)
+    {
+        if (enabled())
+            append({category, name, 'i', now(), 0});
+    }
+
+    void complete(const char * category, const char * name, uint64_t start)
+    {
+        if (enabled()) {
+            uint64_t end = now();
+            append({category, name, 'X', start, end - start});
+        }
+    }
+
+    /**
+     * @brief Запись накопленных событий в файл в формате JSON trace_event
+     *
+     * @return true Файл успешно записан.
+     *
+     */
+    bool write(const std::string & file_name);
+};
+
+/**
+ * @brief Интервал трассировки на время области видимости
+ *
+ */
+class TraceScope
+{
+    const char * _category;
+    const char * _name;
+    uint64_t     _start;
+    bool         _active;
+
+public:
+    TraceScope(const char * category, const char * name)
+        : _category(category)
+        , _name(name)
+        , _start(0)
+        , _active(Trace::instance().enabled())
+    {
+        if (_active)
+            _start = Trace::instance().now();
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope & operator=(const TraceScope &) = delete;
+
+    ~TraceScope()
+    {
+        if (_active)
+            Trace::instance().complete(_category, _name, _start);
+    }
+};
+
+}
+
+#define TP_TRACE_CONCAT_IMPL(a, b) a##b
+#define TP_TRACE_CONCAT(a, b)      TP_TRACE_CONCAT_IMPL(a, b)
+
+#ifdef TP_TRACE
+#define TP_TRACE_SCOPE(category, name)   ::tp::TraceScope TP_TRACE_CONCAT(tp_trace_scope_, __LINE__)(category, name)
+#define TP_TRACE_INSTANT(category, name) ::tp::Trace::instance().instant(category, name)
+#else
+#define TP_TRACE_SCOPE(category, name)   static_cast<void>(0)
+#define TP_TRACE_INSTANT(category, name) static_cast<void>(0)
+#endif
+
+#endif
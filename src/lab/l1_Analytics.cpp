@@ -0,0 +1,228 @@
+#include "hw/l1_Analytics.h"
+
+#include <algorithm>
+#include <tuple>
+
+namespace
+{
+    /// Строки вывода команды, передаются в out только после проверки просмотра
+    using Lines = std::vector<std::string>;
+
+    /// Отметка об ограничении вывода, как у Application
+    std::string limitLine(size_t lines_limit)
+    {
+        return "Выведено первые " + std::to_string(lines_limit) + " строк";
+    }
+
+    bool view(const SharedCollectionView & col, const Command & cmd, Lines & lines)
+    {
+        size_t lines_limit  = cmd.argc > 0 ? cmd.args[0] : OUTPUT_LIMIT;
+        size_t visits_limit = cmd.argc > 1 ? cmd.args[1] : OUTPUT_LIMIT;
+
+        for(size_t i=0; i < std::min(lines_limit, col.count()); ++i) {
+            std::optional<SharedPerson> p = col.person(i);
+            if (!p)
+                return false;
+            lines.push_back(Application::formatPerson(p->index, p->alias, p->visits, visits_limit));
+        }
+
+        if (col.count() > lines_limit)
+            lines.push_back(limitLine(lines_limit));
+
+        lines.push_back("Количество элементов в коллекции: " + std::to_string(col.count()));
+        return true;
+    }
+
+    bool report(const SharedCollectionView & col, const Command & cmd, Lines & lines)
+    {
+        using Entry = std::tuple<size_t,size_t,std::string_view>;     ///< визиты, индекс, псевдоним
+
+        size_t lines_limit = cmd.argc > 0 ? cmd.args[0] : OUTPUT_LIMIT;
+
+        std::vector<Entry> top;
+        for(size_t i=0; i < col.count(); ++i) {
+            std::optional<SharedPerson> p = col.person(i);
+            if (!p)
+                return false;
+            if (!p->visits.empty())
+                top.emplace_back(p->visits.size(), p->index, p->alias);
+        }
+
+        size_t with_visits = top.size();
+        auto   before      = [](const Entry & a, const Entry & b) {
+            return std::get<0>(a) > std::get<0>(b) || (std::get<0>(a) == std::get<0>(b) && std::get<1>(a) < std::get<1>(b));
+        };
+
+        size_t shown = std::min(lines_limit, top.size());
+        std::partial_sort(top.begin(), top.begin() + shown, top.end(), before);
+
+        for(size_t i=0; i < shown; ++i)
+            lines.push_back(std::string(std::get<2>(top[i])) + " " + std::to_string(std::get<0>(top[i])));
+
+        if (with_visits > lines_limit)
+            lines.push_back(limitLine(lines_limit));
+
+        lines.push_back("Итого количество посетителей " + std::to_string(with_visits) +
+                        " из " + std::to_string(col.size()) + " зарегистрировавшихся");
+        return true;
+    }
+
+    bool visited(const SharedCollectionView & col, const Command & cmd, Lines & lines)
+    {
+        Visit from(cmd.args[0], cmd.args[1], cmd.args[2]);
+        Visit to = cmd.argc == 6 ? Visit(cmd.args[3], cmd.args[4], cmd.args[5]) : from;
+
+        // Индекса дат визитов в сегменте нет, визиты просматриваются подряд
+        size_t count = 0;
+        for(size_t i=0; i < col.count() && !(to < from); ++i) {
+            std::optional<SharedPerson> p = col.person(i);
+            if (!p)
+                return false;
+
+            bool found = std::any_of(p->visits.begin(), p->visits.end(), [&](const Visit & v) {
+                return !(v < from) && !(to < v);
+            });
+            if (!found)
+                continue;
+
+            if (count < OUTPUT_LIMIT) {
+                std::string & line = lines.emplace_back("[");
+                line += std::to_string(p->index);
+                line += "] ";
+                line += p->alias;
+            }
+            else if (count == OUTPUT_LIMIT)
+                lines.push_back(limitLine(OUTPUT_LIMIT));
+            count ++;
+        }
+
+        lines.push_back("Количество посетителей: " + std::to_string(count));
+        return true;
+    }
+
+    /**
+     * @brief Поиск посетителя по индексу: записи сегмента упорядочены по индексам
+     *
+     * @return false Данные повреждены.
+     *
+     */
+    bool findPerson(const SharedCollectionView & col, size_t index, std::optional<SharedPerson> & person)
+    {
+        size_t begin = 0, end = col.count();
+        while(begin < end) {
+            size_t                      middle = begin + (end - begin) / 2;
+            std::optional<SharedPerson> p      = col.person(middle);
+            if (!p)
+                return false;
+
+            if (p->index == index) {
+                person = p;
+                return true;
+            }
+            if (p->index < index)
+                begin = middle + 1;
+            else
+                end = middle;
+        }
+        return true;
+    }
+
+    bool visitsBetween(const SharedCollectionView & col, const Command & cmd, Lines & lines)
+    {
+        Visit from(cmd.args[1], cmd.args[2], cmd.args[3]);
+        Visit to = cmd.argc == 7 ? Visit(cmd.args[4], cmd.args[5], cmd.args[6]) : from;
+
+        std::optional<SharedPerson> p;
+        if (!findPerson(col, cmd.args[0], p))
+            return false;
+
+        // Порядок визитов в сегменте не известен, они просматриваются подряд
+        if (!p)
+            lines.push_back("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
+        else
+            lines = Application::formatVisitsBetween(Person::selectBetween(p->visits, 0, from, to));
+        return true;
+    }
+
+    bool lastVisit(const SharedCollectionView & col, const Command & cmd, Lines & lines)
+    {
+        std::optional<SharedPerson> p;
+        if (!findPerson(col, cmd.args[0], p))
+            return false;
+
+        if (!p)
+            lines.push_back("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
+        else
+            lines.push_back(Application::formatLastVisit(Person::selectLast(p->visits, 0)));
+        return true;
+    }
+}
+
+int runAnalytics(const std::string & segment_name, std::istream & input, const IOutput & out)
+{
+    SharedSegment segment (segment_name, SharedSegment::Mode::Read);
+    if (!segment.valid()) {
+        out.Output("Ошибка при подключении к сегменту разделяемой памяти '" + segment_name + "'");
+        return 1;
+    }
+
+    for(std::string line; std::getline(input,line); ) {
+        if (line.empty())
+            break;
+
+        Command command;
+        if (!Application::parse(line, command, out))
+            continue;
+
+        bool (*execute)(const SharedCollectionView &, const Command &, Lines &) = nullptr;
+        switch(command.opcode) {
+        case Opcode::View:    execute = view;    break;
+        case Opcode::Report:  execute = report;  break;
+        case Opcode::Visited: execute = visited; break;
+        case Opcode::VisitsBetween: execute = visitsBetween; break;
+        case Opcode::LastVisit:     execute = lastVisit;     break;
+        default: break;
+        }
+
+        if (command.opcode == Opcode::Visited && command.argc != 3 && command.argc != 6) {
+            out.Output("Некорректное количество аргументов команды visited");
+            continue;
+        }
+
+        if (command.opcode == Opcode::VisitsBetween && command.argc != 4 && command.argc != 7) {
+            out.Output("Некорректное количество аргументов команды visits_between");
+            continue;
+        }
+
+        if (command.opcode != Opcode::Count && execute == nullptr) {
+            out.Output("Команда " + std::string(findOpcode(command.opcode)->long_name) + " недоступна в режиме аналитики");
+            continue;
+        }
+
+        Lines lines;
+        bool  ok = segment.read([&](std::string_view area) {
+            SharedCollectionView col(area);
+            lines.clear();
+            if (!col.valid())
+                return false;
+            if (command.opcode == Opcode::Count) {
+                lines.push_back(std::to_string(col.size()));
+                return true;
+            }
+            return execute(col, command, lines);
+        });
+
+        if (!ok) {
+            if (segment.version() == 0)
+                out.Output("Коллекция ещё не опубликована в сегменте '" + segment.name() + "'");
+            else
+                out.Output("Ошибка при чтении коллекции из сегмента '" + segment.name() + "'");
+            continue;
+        }
+
+        for(std::string & l : lines)
+            out.Output(std::move(l));
+    }
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+#include "hw/l1_Server.h"
+#include "tp/ThreadPool.h"
+
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+
+/// Последняя строка ответа сервера: клиент проверяет по ней, что пакет выполнен полностью
+const std::string BATCH_DONE = "Выполнение команд завершено\n";
+
+/**
+ * @brief Соединение с клиентом: входной буфер, счётчик невыполненных команд и накопленный вывод
+ *
+ */
+class Connection : public IOutput
+{
+    mutable std::mutex  _output_mutex;
+    mutable std::string _output;
+
+public:
+    int                 fd;
+    std::string         input;
+    bool                input_done = false;     ///< пакет закончился (пустая строка или конец ввода)
+    bool                eof        = false;     ///< клиент закрыл передачу
+    bool                responding = false;
+    size_t              sent       = 0;
+    std::atomic<size_t> pending {0};
+
+    explicit Connection(int socket_fd) : fd(socket_fd) {}
+
+    virtual void Output(std::string s) const override
+    {
+        std::lock_guard locker(_output_mutex);
+        _output += s;
+        _output += '\n';
+    }
+
+    std::string & output() { return _output; }
+};
+
+/**
+ * @brief Команда пакета: выполняет задачу команды и сообщает циклу событий о завершении пакета
+ *
+ */
+class BatchTask : public tp::Task_interface
+{
+    std::shared_ptr<Connection>         _connection;
+    std::unique_ptr<tp::Task_interface> _task;
+    int                                 _notify_fd;
+
+public:
+    BatchTask(std::shared_ptr<Connection> connection, tp::Task_interface * task, int notify_fd)
+        : _connection(connection)
+        , _task(task)
+        , _notify_fd(notify_fd)
+    {}
+
+    virtual void work() override
+    {
+        // Исключение в потоке пула завершило бы весь сервер вместе с несохранёнными изменениями
+        try {
+            _task->work();
+        }
+        catch(const std::exception & e) {
+            _connection->Output(std::string("Ошибка выполнения команды: ") + e.what());
+        }
+
+        if (--_connection->pending == 0) {
+            uint64_t one = 1;
+            if (write(_notify_fd, &one, sizeof(one)) < 0)
+                std::cerr << "Ошибка уведомления цикла событий: " << std::strerror(errno) << std::endl;
+        }
+    }
+};
+
+class Server
+{
+    ItemCollector &       _col;
+    const ServerOptions & _options;
+    std::unique_ptr<tp::ThreadPool> _pool;
+
+    int _epoll_fd  = -1;
+    int _listen_fd = -1;
+    int _notify_fd = -1;
+    int _signal_fd = -1;
+    int _timer_fd  = -1;
+
+    std::map<int,std::shared_ptr<Connection>> _connections;
+    std::future<bool>                         _background_save;
+
+    bool watch(int fd, uint32_t events, int op = EPOLL_CTL_ADD)
+    {
+        epoll_event ev {};
+        ev.events  = events;
+        ev.data.fd = fd;
+        return epoll_ctl(_epoll_fd, op, fd, &ev) == 0;
+    }
+
+    void accept()
+    {
+        for(;;) {
+            int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            _connections[fd] = std::make_shared<Connection>(fd);
+            watch(fd, EPOLLIN | EPOLLRDHUP);
+        }
+    }
+
+    /// Команды соединения, подряд идущие add_visit объединяются по посетителям
+    VisitCoalescer coalescer(const std::shared_ptr<Connection> & c)
+    {
+        return VisitCoalescer(_col, *c, _pool.get(), [this, c](tp::Task_interface * task) {
+            c->pending ++;
+            _pool->submit(new BatchTask(c, task, _notify_fd));
+        });
+    }
+
+    void submitLines(const std::shared_ptr<Connection> & c)
+    {
+        VisitCoalescer batch = coalescer(c);
+
+        size_t start = 0;
+        for(size_t end; !c->input_done && (end = c->input.find('\n', start)) != std::string::npos; start = end + 1) {
+            std::string line = c->input.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            if (line.empty())
+                c->input_done = true;
+            else
+                batch.add(line);
+        }
+        c->input.erase(0, start);
+    }
+
+    void read(const std::shared_ptr<Connection> & c)
+    {
+        char buf[1 << 16];
+
+        for(;;) {
+            ssize_t n = ::read(c->fd, buf, sizeof(buf));
+            if (n > 0) {
+                if (!c->input_done) {
+                    c->input.append(buf, n);
+                    submitLines(c);
+                }
+                continue;
+            }
+
+            if (n == 0 || errno != EAGAIN) {
+                if (!c->input_done && !c->input.empty())
+                    coalescer(c).add(c->input);
+                c->input.clear();
+                c->input_done = true;
+                c->eof        = true;
+            }
+            break;
+        }
+
+        // После пустой строки остаток ввода читается и отбрасывается, чтобы клиент не заблокировался
+        if (c->eof)
+            watch(c->fd, c->responding ? uint32_t(EPOLLOUT) : 0, EPOLL_CTL_MOD);
+
+        respondIfDone(c);
+    }
+
+    void respondIfDone(const std::shared_ptr<Connection> & c)
+    {
+        if (!c->input_done || c->responding || c->pending != 0)
+            return;
+
+        c->responding = true;
+        c->output() += BATCH_DONE;
+        watch(c->fd, c->eof ? uint32_t(EPOLLOUT) : uint32_t(EPOLLOUT | EPOLLIN | EPOLLRDHUP), EPOLL_CTL_MOD);
+        send(c);
+    }
+
+    void send(const std::shared_ptr<Connection> & c)
+    {
+        std::string & out = c->output();
+
+        while(c->sent < out.size()) {
+            ssize_t n = ::send(c->fd, out.data() + c->sent, out.size() - c->sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN)
+                    return;
+                break;
+            }
+            c->sent += n;
+        }
+
+        close(c->fd);
+        _connections.erase(c->fd);
+    }
+
+    /// Периодическое сохранение в отдельном потоке, цикл событий не ждёт записи файла
+    void save()
+    {
+        using namespace std::chrono_literals;
+
+        if (_background_save.valid()) {
+            if (_background_save.wait_for(0s) != std::future_status::ready)
+                return;
+            reportSave(_background_save.get());
+        }
+
+        _background_save = std::async(std::launch::async, [this] { return _col.saveCollection(); });
+    }
+
+    void reportSave(bool saved)
+    {
+        if (!saved)
+            std::cerr << "Ошибка при сохранении файла данных '" << _col.data_file_name() << "'" << std::endl;
+    }
+
+public:
+    Server(ItemCollector & col, const ServerOptions & options)
+        : _col(col)
+        , _options(options)
+        , _pool(std::make_unique<tp::ThreadPool>(options.number_of_threads))
+    {}
+
+    ~Server()
+    {
+        // Деструктор пула дожидается выполнения команд, оставшихся в очереди,
+        // поэтому пул разрушается до закрытия дескрипторов
+        _pool.reset();
+
+        if (_background_save.valid())
+            reportSave(_background_save.get());
+
+        for(int fd : {_epoll_fd, _listen_fd, _notify_fd, _signal_fd, _timer_fd})
+            if (fd >= 0)
+                close(fd);
+
+        for(auto & [fd, c] : _connections)
+            close(fd);
+
+        if (_listen_fd >= 0)
+            unlink(_options.socket_path.c_str());
+    }
+
+    bool open()
+    {
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        if (_options.socket_path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Слишком длинный путь сокета '" << _options.socket_path << "'" << std::endl;
+            return false;
+        }
+        std::strcpy(addr.sun_path, _options.socket_path.c_str());
+
+        unlink(_options.socket_path.c_str());
+
+        _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_listen_fd < 0
+         || bind(_listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+         || listen(_listen_fd, SOMAXCONN) != 0) {
+            std::cerr << "Ошибка открытия сокета '" << _options.socket_path << "': " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigprocmask(SIG_BLOCK, &signals, nullptr);
+
+        _epoll_fd  = epoll_create1(EPOLL_CLOEXEC);
+        _notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        _signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        if (_epoll_fd < 0 || _notify_fd < 0 || _signal_fd < 0)
+            return false;
+
+        watch(_listen_fd, EPOLLIN);
+        watch(_notify_fd, EPOLLIN);
+        watch(_signal_fd, EPOLLIN);
+
+        if (_options.save_interval > 0) {
+            _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+            itimerspec spec {};
+            spec.it_interval.tv_sec = _options.save_interval;
+            spec.it_value.tv_sec    = _options.save_interval;
+            if (_timer_fd < 0 || timerfd_settime(_timer_fd, 0, &spec, nullptr) != 0)
+                return false;
+
+            watch(_timer_fd, EPOLLIN);
+        }
+
+        _pool->start();
+        return true;
+    }
+
+    void run()
+    {
+        std::cerr << "Сервер ожидает команды на сокете '" << _options.socket_path
+                  << "'. Размер пула потоков: " << _pool->size() << std::endl;
+
+        epoll_event events[64];
+
+        for(;;) {
+            int n = epoll_wait(_epoll_fd, events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            for(int i=0; i < n; ++i) {
+                int fd = events[i].data.fd;
+
+                if (fd == _signal_fd)
+                    return;
+
+                if (fd == _listen_fd)
+                    accept();
+                else if (fd == _notify_fd) {
+                    uint64_t value;
+                    while(::read(_notify_fd, &value, sizeof(value)) > 0)
+                        ;
+
+                    std::vector<std::shared_ptr<Connection>> ready;
+                    for(auto & [cfd, c] : _connections)
+                        if (c->input_done && !c->responding && c->pending == 0)
+                            ready.push_back(c);
+
+                    for(auto & c : ready)
+                        respondIfDone(c);
+                }
+                else if (fd == _timer_fd) {
+                    uint64_t expirations;
+                    while(::read(_timer_fd, &expirations, sizeof(expirations)) > 0)
+                        ;
+                    save();
+                }
+                else {
+                    auto it = _connections.find(fd);
+                    if (it == _connections.end())
+                        continue;
+
+                    std::shared_ptr<Connection> c = it->second;
+                    if (!c->eof && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                        read(c);
+                    if (c->responding && _connections.count(fd) != 0)
+                        send(c);
+                }
+            }
+        }
+    }
+};
+
+}
+
+int runServer(ItemCollector & col, const ServerOptions & options)
+{
+    {
+        Server server(col, options);
+        if (!server.open())
+            return 1;
+
+        server.run();
+    }
+
+    std::cerr << "Сервер остановлен" << std::endl;
+    return 0;
+}
+
+int runClient(const std::string & socket_path)
+{
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Слишком длинный путь сокета '" << socket_path << "'" << std::endl;
+        return 1;
+    }
+    std::strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "Ошибка подключения к сокету '" << socket_path << "': " << std::strerror(errno) << std::endl;
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    char buf[1 << 16];
+
+    for(ssize_t n; (n = ::read(STDIN_FILENO, buf, sizeof(buf))) > 0; )
+        for(ssize_t off = 0; off < n; ) {
+            ssize_t w = ::send(fd, buf + off, n - off, MSG_NOSIGNAL);
+            if (w < 0) {
+                std::cerr << "Ошибка передачи пакета команд: " << std::strerror(errno) << std::endl;
+                close(fd);
+                return 1;
+            }
+            off += w;
+        }
+
+    shutdown(fd, SHUT_WR);
+
+    // Ответ без завершающей строки означает, что сервер закрыл соединение, не выполнив пакет
+    std::string tail;
+    for(ssize_t n; (n = ::read(fd, buf, sizeof(buf))) > 0; ) {
+        std::cout.write(buf, n);
+        tail.append(buf, n);
+        if (tail.size() > BATCH_DONE.size())
+            tail.erase(0, tail.size() - BATCH_DONE.size());
+    }
+    std::cout.flush();
+
+    close(fd);
+
+    if (tail != BATCH_DONE) {
+        std::cerr << "Сервер закрыл соединение до завершения пакета команд" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,958 @@
+#include "hw/l1_Shards.h"
+#include "tp/Statistics.h"
+#include "tp/ThreadPool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+
+/**
+ * Сообщения между маршрутизатором и сегментом: длина:u32, содержимое.
+ * Запрос начинается с Opcode команды, индексы в запросах локальные, в ответах -
+ * глобальные. Сегмент отвечает на каждый запрос одним сообщением в порядке
+ * запросов, а после загрузки коллекции присылает приветствие:
+ * признак загрузки:u8, максимальный локальный индекс:varint.
+ */
+
+/// Наибольшая длина строки в ответе сегмента (псевдоним или вывод view для посетителя)
+const size_t MAX_TEXT_LENGTH = 1 << 30;
+
+/// Неотправленных байт на сегмент, после которых маршрутизатор ждёт ответов
+const size_t OUTBOUND_LIMIT = 1 << 20;
+
+/// Команд без ответа, после которых маршрутизатор ждёт ответов
+const size_t PENDING_LIMIT = 1 << 16;
+
+void appendFrame(std::string & out, const ByteWriter & payload)
+{
+    ByteWriter header;
+    header.putFixed<uint32_t>(static_cast<uint32_t>(payload.buffer().size()));
+    out += header.buffer();
+    out += payload.buffer();
+}
+
+/// Очередное полное сообщение из буфера, начиная с pos
+bool takeFrame(const std::string & in, size_t & pos, std::string_view & payload)
+{
+    ByteReader header(in.data() + pos, in.size() - pos);
+    uint32_t   length = header.getFixed<uint32_t>();
+    if (header.error() || header.remaining() < length)
+        return false;
+
+    payload = std::string_view(in.data() + pos + sizeof(uint32_t), length);
+    pos    += sizeof(uint32_t) + length;
+    return true;
+}
+
+bool writeAll(int fd, const std::string & data)
+{
+    for(size_t off = 0; off < data.size(); ) {
+        ssize_t n = ::write(fd, data.data() + off, data.size() - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+std::string shardFileName(const std::string & data_file_name, size_t shard)
+{
+    return data_file_name + "." + std::to_string(shard);
+}
+
+/**
+ * @brief Процесс сегмента: своя коллекция и пул потоков, запросы выполняются по порядку
+ *
+ */
+class ShardWorker
+{
+    ItemCollector       _col;
+    IndexShard          _shard;
+    const ShardOptions & _options;
+    tp::ThreadPool      _pool;
+    int                 _fd;
+
+    void execute(ByteReader & in, ByteWriter & out)
+    {
+        Opcode opcode = static_cast<Opcode>(in.getFixed<uint8_t>());
+
+        if (opcode == Opcode::Count)
+            out.putVarint(_col.getSize());
+        else if (opcode == Opcode::Add) {
+            size_t      local = in.getVarint();
+            std::string alias (in.getString(MAX_TEXT_LENGTH));
+
+            std::vector<Person> persons;
+            persons.emplace_back(alias);
+            _col.publishItems(local, std::move(persons));
+        }
+        else if (opcode == Opcode::AddVisit) {
+            size_t local = in.getVarint();
+            int    year  = static_cast<int>(zigzagDecode(in.getVarint()));
+            int    month = static_cast<int>(zigzagDecode(in.getVarint()));
+            int    day   = static_cast<int>(zigzagDecode(in.getVarint()));
+
+            out.putFixed<uint8_t>(_col.addVisit(local, Visit(year, month, day)) ? 1 : 0);
+        }
+        else if (opcode == Opcode::Remove)
+            _col.removeItem(in.getVarint());
+        else if (opcode == Opcode::Update) {
+            size_t      local = in.getVarint();
+            std::string alias (in.getString(MAX_TEXT_LENGTH));
+            _col.setAlias(local, alias);
+        }
+        else if (opcode == Opcode::View) {
+            size_t lines_limit  = in.getVarint();
+            size_t visits_limit = in.getVarint();
+
+            std::shared_ptr<const CollectionSnapshot> snapshot = _col.snapshot();
+            size_t count = std::min(lines_limit, snapshot->size());
+
+            out.putVarint(snapshot->size());
+            out.putVarint(count);
+            for(size_t i=0; i < count; ++i) {
+                const PersonView & person = (*snapshot)[i];
+                size_t             global = _shard.toGlobal(person.index());
+
+                out.putVarint(global);
+                out.putString(Application::formatPerson(global, person, visits_limit));
+            }
+        }
+        else if (opcode == Opcode::Report) {
+            size_t lines_limit = in.getVarint();
+
+            // Глобальные индексы сегмента возрастают вместе с локальными,
+            // поэтому порядок лучших посетителей тот же, что у Application
+            std::shared_ptr<const CollectionSnapshot> snapshot = _col.snapshot();
+            std::vector<const PersonView *>           top;
+            for(const PersonView & p : *snapshot)
+                if (p.visitCount() > 0)
+                    top.push_back(&p);
+
+            auto before = [](const PersonView * a, const PersonView * b) {
+                return a->visitCount() > b->visitCount() || (a->visitCount() == b->visitCount() && a->index() < b->index());
+            };
+
+            size_t with_visits = top.size();
+            if (top.size() > lines_limit) {
+                std::nth_element(top.begin(), top.begin() + lines_limit, top.end(), before);
+                top.resize(lines_limit);
+            }
+            std::sort(top.begin(), top.end(), before);
+
+            out.putVarint(with_visits);
+            out.putVarint(_col.getSize());
+            out.putVarint(top.size());
+            for(const PersonView * p : top) {
+                out.putVarint(p->visitCount());
+                out.putVarint(_shard.toGlobal(p->index()));
+                out.putString(p->alias());
+            }
+        }
+        else if (opcode == Opcode::Save) {
+            out.putFixed<uint8_t>(_col.saveCollection() ? 1 : 0);
+            out.putString(_col.data_file_name());
+        }
+        else if (opcode == Opcode::Compact)
+            out.putVarint(_col.compact());
+        else if (opcode == Opcode::Visited) {
+            int args[6];
+            for(int & a : args)
+                a = static_cast<int>(zigzagDecode(in.getVarint()));
+
+            std::vector<std::pair<size_t,std::string>> persons = _col.visited(Visit(args[0], args[1], args[2]),
+                                                                              Visit(args[3], args[4], args[5]));
+
+            // Маршрутизатор выводит не больше OUTPUT_LIMIT строк, остальные только считаются
+            size_t count = std::min<size_t>(persons.size(), OUTPUT_LIMIT + 1);
+            out.putVarint(persons.size());
+            out.putVarint(count);
+            for(size_t i=0; i < count; ++i) {
+                out.putVarint(_shard.toGlobal(persons[i].first));
+                out.putString(persons[i].second);
+            }
+        }
+        else if (opcode == Opcode::VisitsBetween || opcode == Opcode::LastVisit) {
+            // Вывод формируется сегментом, маршрутизатор только передаёт строки
+            size_t      local = in.getVarint();
+            QueryResult lines;
+
+            if (opcode == Opcode::VisitsBetween) {
+                int args[6];
+                for(int & a : args)
+                    a = static_cast<int>(zigzagDecode(in.getVarint()));
+
+                std::optional<std::vector<Visit>> visits = _col.visitsBetween(local, Visit(args[0], args[1], args[2]),
+                                                                                     Visit(args[3], args[4], args[5]));
+                if (visits)
+                    lines = Application::formatVisitsBetween(*visits);
+            }
+            else if (std::optional<Visit> last; _col.lastVisit(local, last))
+                lines.push_back(Application::formatLastVisit(last));
+
+            if (lines.empty())
+                lines.push_back("Недопустимый индекс посетителя " + std::to_string(_shard.toGlobal(local)));
+
+            out.putVarint(lines.size());
+            for(const std::string & line : lines)
+                out.putString(line);
+        }
+        else if (opcode == Opcode::Import) {
+            size_t       first     = in.getVarint();
+            std::string  file_name (in.getString(MAX_TEXT_LENGTH));
+            ImportResult result    = _col.importFile(file_name, &_pool, _shard, first);
+
+            out.putFixed<uint8_t>(result.opened ? 1 : 0);
+            out.putFixed<uint8_t>(result.valid ? 1 : 0);
+            out.putVarint(result.error_line);
+            out.putVarint(result.count);
+        }
+    }
+
+public:
+    ShardWorker(int fd, size_t shard, const ShardOptions & options)
+        : _shard {options.number_of_shards, shard}
+        , _options(options)
+        , _pool(options.number_of_threads)
+        , _fd(fd)
+    {}
+
+    int run()
+    {
+        _pool.start();
+        _col.setVisitOrder(_options.visit_order);
+
+        // Бюджет памяти делится между сегментами поровну
+        bool budget = _options.memory_budget == 0
+                   || _col.setMemoryBudget(shardFileName(_options.page_file_name, _shard.shard),
+                                           _options.memory_budget / _options.number_of_shards);
+
+        std::string file_name = shardFileName(_options.data_file_name, _shard.shard);
+        bool        loaded    = budget && (_col.loadCollection(file_name) || access(file_name.c_str(), F_OK) != 0);
+        _col.setCompactOnSave(_options.compact_on_save);
+
+        ByteWriter hello;
+        hello.putFixed<uint8_t>(loaded ? 1 : 0);
+        hello.putVarint(_col.maxIndex());
+
+        std::string reply;
+        appendFrame(reply, hello);
+        if (!writeAll(_fd, reply) || !loaded)
+            return 1;
+
+        std::string input;
+        char        buf[1 << 16];
+
+        for(;;) {
+            ssize_t n = ::read(_fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            input.append(buf, n);
+
+            reply.clear();
+            size_t           pos = 0;
+            std::string_view payload;
+            while(takeFrame(input, pos, payload)) {
+                ByteReader request(payload.data(), payload.size());
+                ByteWriter response;
+                execute(request, response);
+                appendFrame(reply, response);
+            }
+            input.erase(0, pos);
+
+            if (!writeAll(_fd, reply))
+                return 1;
+        }
+
+        if (_options.statistics)
+            std::cerr << "Статистика сегмента " << _shard.shard << ":\n"
+                      << tp::Statistics::instance().report(tp::Statistics::Format::Text);
+        return 0;
+    }
+};
+
+/**
+ * @brief Маршрутизатор: передаёт команды сегментам и объединяет их ответы
+ *
+ */
+class ShardRouter
+{
+    struct Shard
+    {
+        pid_t              pid = -1;
+        int                fd  = -1;
+        std::string        out;
+        size_t             sent = 0;
+        std::string        in;
+        std::deque<size_t> waiting;     ///< номера команд, ответы на которые ожидаются по порядку
+    };
+
+    /// Команда, вывод которой ещё не выполнен
+    struct Pending
+    {
+        Command                  command;
+        size_t                   target;        ///< сегмент или количество сегментов, если команда передана всем
+        std::vector<std::string> responses;
+        size_t                   remaining = 0;
+        std::vector<std::string> lines;         ///< вывод, сформированный маршрутизатором (ошибки разбора)
+        bool                     final = false; ///< итоговое сохранение: выводятся только ошибки
+    };
+
+    /// Вывод разбора команды, сохраняемый до её очереди вывода
+    class LinesOutput : public IOutput
+    {
+    public:
+        mutable std::vector<std::string> lines;
+
+        virtual void Output(std::string s) const override { lines.push_back(std::move(s)); }
+    };
+
+    const ShardOptions & _options;
+    const IOutput &      _out;
+    std::vector<Shard>   _shards;
+    std::deque<Pending>  _pending;
+    size_t               _first_pending = 0;    ///< номер команды _pending.front()
+    size_t               _next_index    = 1;    ///< глобальный индекс следующего посетителя
+    size_t               _commands      = 0;
+    bool                 _failed        = false;
+    bool                 _save_failed   = false;
+
+    size_t count() const { return _shards.size(); }
+
+    void send(size_t shard, const ByteWriter & request, size_t seq)
+    {
+        appendFrame(_shards[shard].out, request);
+        _shards[shard].waiting.push_back(seq);
+    }
+
+    Pending & enqueue(Command command, size_t target)
+    {
+        Pending & p = _pending.emplace_back();
+        p.command   = std::move(command);
+        p.target    = target;
+        p.remaining = target == count() ? count() : (target < count() ? 1 : 0);
+        p.responses.resize(p.remaining);
+        return p;
+    }
+
+    void broadcast(const Command & command, const ByteWriter & request)
+    {
+        size_t seq = _first_pending + _pending.size();
+        enqueue(command, count());
+        for(size_t k=0; k < count(); ++k)
+            send(k, request, seq);
+    }
+
+    void route(const Command & command, size_t global, const ByteWriter & request)
+    {
+        IndexShard map {count(), 0};
+        size_t     seq   = _first_pending + _pending.size();
+        size_t     shard = map.shardOf(global);
+
+        enqueue(command, shard);
+        send(shard, request, seq);
+    }
+
+    bool startShards()
+    {
+        std::vector<int> worker_fds;
+
+        for(size_t k=0; k < _options.number_of_shards; ++k) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+                _out.Output("Ошибка создания сокета сегмента: " + std::string(std::strerror(errno)));
+                return false;
+            }
+            _shards.emplace_back().fd = fds[0];
+            worker_fds.push_back(fds[1]);
+        }
+
+        std::cout.flush();
+
+        for(size_t k=0; k < count(); ++k) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                _out.Output("Ошибка запуска процесса сегмента: " + std::string(std::strerror(errno)));
+                return false;
+            }
+
+            if (pid == 0) {
+                for(size_t j=0; j < count(); ++j) {
+                    close(_shards[j].fd);
+                    if (j != k)
+                        close(worker_fds[j]);
+                }
+
+                int rc = ShardWorker(worker_fds[k], k, _options).run();
+                std::cout.flush();
+                _exit(rc);
+            }
+
+            _shards[k].pid = pid;
+        }
+
+        for(int fd : worker_fds)
+            close(fd);
+
+        // Приветствия сегментов: результат загрузки и выданные индексы
+        bool loaded = true;
+        for(size_t k=0; k < count(); ++k) {
+            Shard &          shard = _shards[k];
+            size_t           pos   = 0;
+            std::string_view payload;
+            char             buf[256];
+
+            while(!takeFrame(shard.in, pos, payload)) {
+                ssize_t n = ::read(shard.fd, buf, sizeof(buf));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                shard.in.append(buf, n);
+            }
+
+            ByteReader hello(payload.data(), payload.size());
+            if (payload.empty() || hello.getFixed<uint8_t>() != 1) {
+                _out.Output("Ошибка при загрузке файла данных '" + shardFileName(_options.data_file_name, k) + "'");
+                loaded = false;
+                continue;
+            }
+
+            size_t max_local = hello.getVarint();
+            if (max_local > 0)
+                _next_index = std::max(_next_index, IndexShard {count(), k}.toGlobal(max_local) + 1);
+
+            shard.in.erase(0, pos);
+            fcntl(shard.fd, F_SETFL, fcntl(shard.fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        return loaded;
+    }
+
+    bool congested() const
+    {
+        if (_pending.size() > PENDING_LIMIT)
+            return true;
+        for(const Shard & shard : _shards)
+            if (shard.out.size() - shard.sent > OUTBOUND_LIMIT)
+                return true;
+        return false;
+    }
+
+    /**
+     * @brief Обмен с сегментами до отправки всех запросов и получения всех ответов (all)
+     * или до разгрузки очередей
+     *
+     */
+    void pump(bool all)
+    {
+        std::vector<pollfd> fds(count());
+
+        for(complete(); !_failed && (all ? !_pending.empty() : congested()); complete()) {
+            for(size_t k=0; k < count(); ++k) {
+                fds[k].fd      = _shards[k].fd;
+                fds[k].events  = POLLIN | (_shards[k].sent < _shards[k].out.size() ? POLLOUT : 0);
+                fds[k].revents = 0;
+            }
+
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                _failed = true;
+                break;
+            }
+
+            for(size_t k=0; k < count() && !_failed; ++k) {
+                if (fds[k].revents & POLLOUT)
+                    transmit(k);
+                if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+                    receive(k);
+            }
+        }
+    }
+
+    void transmit(size_t k)
+    {
+        Shard & shard = _shards[k];
+
+        ssize_t n = ::send(shard.fd, shard.out.data() + shard.sent, shard.out.size() - shard.sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                fail(k);
+            return;
+        }
+
+        shard.sent += n;
+        if (shard.sent == shard.out.size()) {
+            shard.out.clear();
+            shard.sent = 0;
+        }
+    }
+
+    void receive(size_t k)
+    {
+        Shard & shard = _shards[k];
+        char    buf[1 << 16];
+
+        ssize_t n = ::read(shard.fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                fail(k);
+            return;
+        }
+        if (n == 0) {
+            fail(k);
+            return;
+        }
+        shard.in.append(buf, n);
+
+        size_t           pos = 0;
+        std::string_view payload;
+        while(!shard.waiting.empty() && takeFrame(shard.in, pos, payload)) {
+            Pending & p = _pending[shard.waiting.front() - _first_pending];
+            shard.waiting.pop_front();
+
+            p.responses[p.target == count() ? k : 0] = std::string(payload);
+            p.remaining --;
+        }
+        shard.in.erase(0, pos);
+    }
+
+    void fail(size_t k)
+    {
+        _out.Output("Потеряна связь с процессом сегмента " + std::to_string(k));
+        _failed = true;
+    }
+
+    /// Вывод завершённых команд в порядке пакета
+    void complete()
+    {
+        while(!_pending.empty() && _pending.front().remaining == 0) {
+            finish(_pending.front());
+            _pending.pop_front();
+            _first_pending ++;
+        }
+    }
+
+    void finish(Pending & p)
+    {
+        for(std::string & line : p.lines)
+            _out.Output(std::move(line));
+
+        const Command & cmd = p.command;
+
+        if (cmd.opcode == Opcode::Count) {
+            size_t size = 0;
+            for(const std::string & r : p.responses)
+                size += ByteReader(r.data(), r.size()).getVarint();
+            _out.Output(std::to_string(size));
+        }
+        else if (cmd.opcode == Opcode::AddVisit && !p.responses.empty()) {
+            if (p.responses[0].empty() || p.responses[0][0] != 1)
+                _out.Output("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
+        }
+        else if (cmd.opcode == Opcode::Save) {
+            for(const std::string & r : p.responses) {
+                ByteReader  in(r.data(), r.size());
+                bool        saved     = in.getFixed<uint8_t>() == 1;
+                std::string file_name (in.getString(MAX_TEXT_LENGTH));
+
+                if (!saved) {
+                    _out.Output("Ошибка при сохранении файла данных '" + file_name + "'");
+                    _save_failed = _save_failed || p.final;
+                }
+                else if (!p.final)
+                    _out.Output("Данные сохранены в файл '" + file_name + "'");
+            }
+        }
+        else if (cmd.opcode == Opcode::Compact) {
+            size_t removed = 0;
+            for(const std::string & r : p.responses)
+                removed += ByteReader(r.data(), r.size()).getVarint();
+            _out.Output("Удалено элементов: " + std::to_string(removed));
+        }
+        else if (cmd.opcode == Opcode::Import)
+            finishImport(p);
+        else if (cmd.opcode == Opcode::View)
+            finishView(p);
+        else if (cmd.opcode == Opcode::Report)
+            finishReport(p);
+        else if (cmd.opcode == Opcode::Visited)
+            finishVisited(p);
+        else if ((cmd.opcode == Opcode::VisitsBetween || cmd.opcode == Opcode::LastVisit) && !p.responses.empty()) {
+            ByteReader in(p.responses[0].data(), p.responses[0].size());
+            for(size_t i=0, n=in.getVarint(); i < n && !in.error(); ++i)
+                _out.Output(std::string(in.getString(MAX_TEXT_LENGTH)));
+        }
+    }
+
+    void finishImport(const Pending & p)
+    {
+        ByteReader in(p.responses[0].data(), p.responses[0].size());
+        bool       opened     = in.getFixed<uint8_t>() == 1;
+        bool       valid      = in.getFixed<uint8_t>() == 1;
+        size_t     error_line = in.getVarint();
+        size_t     imported   = in.getVarint();
+        size_t     first      = static_cast<size_t>(p.command.args[0]);
+
+        const std::string & file_name = p.command.alias;
+
+        if (!opened)
+            _out.Output("Ошибка при открытии файла импорта '" + file_name + "'");
+        else if (error_line != 0)
+            _out.Output("Ошибка в строке " + std::to_string(error_line) + " файла импорта '" + file_name + "'");
+        else if (!valid)
+            _out.Output("Ошибка при загрузке файла импорта '" + file_name + "'");
+        else if (imported == 0)
+            _out.Output("Импортировано посетителей: 0");
+        else {
+            _next_index = std::max(_next_index, first + imported);
+            _out.Output("Импортировано посетителей: " + std::to_string(imported) + ", индексы с "
+                        + std::to_string(first) + " по " + std::to_string(first + imported - 1));
+        }
+    }
+
+    void finishView(const Pending & p)
+    {
+        size_t lines_limit = p.command.argc > 0 ? p.command.args[0] : OUTPUT_LIMIT;
+        size_t size        = 0;
+
+        std::vector<std::pair<size_t,std::string>> persons;
+        for(const std::string & r : p.responses) {
+            ByteReader in(r.data(), r.size());
+            size += in.getVarint();
+            for(size_t i=0, n=in.getVarint(); i < n && !in.error(); ++i) {
+                size_t global = in.getVarint();
+                persons.emplace_back(global, in.getString(MAX_TEXT_LENGTH));
+            }
+        }
+
+        std::sort(persons.begin(), persons.end());
+        if (persons.size() > lines_limit)
+            persons.resize(lines_limit);
+
+        std::string text;
+        for(const auto & [global, lines] : persons) {
+            if (!text.empty())
+                text += '\n';
+            text += lines;
+        }
+        if (!text.empty())
+            _out.Output(text);
+
+        if (size > lines_limit)
+            _out.Output("Выведено первые " + std::to_string(lines_limit) + " строк");
+
+        _out.Output("Количество элементов в коллекции: " + std::to_string(size));
+    }
+
+    void finishReport(const Pending & p)
+    {
+        using Entry = std::tuple<size_t,size_t,std::string>;     ///< визиты, индекс, псевдоним
+
+        size_t lines_limit = p.command.argc > 0 ? p.command.args[0] : OUTPUT_LIMIT;
+        size_t with_visits = 0;
+        size_t size        = 0;
+
+        std::vector<Entry> top;
+        for(const std::string & r : p.responses) {
+            ByteReader in(r.data(), r.size());
+            with_visits += in.getVarint();
+            size        += in.getVarint();
+            for(size_t i=0, n=in.getVarint(); i < n && !in.error(); ++i) {
+                size_t visits = in.getVarint();
+                size_t global = in.getVarint();
+                top.emplace_back(visits, global, in.getString(MAX_TEXT_LENGTH));
+            }
+        }
+
+        std::sort(top.begin(), top.end(), [](const Entry & a, const Entry & b) {
+            return std::get<0>(a) > std::get<0>(b) || (std::get<0>(a) == std::get<0>(b) && std::get<1>(a) < std::get<1>(b));
+        });
+        if (top.size() > lines_limit)
+            top.resize(lines_limit);
+
+        std::string text;
+        for(const auto & [quantity, index, alias] : top) {
+            if (!text.empty())
+                text += '\n';
+            text += alias + " " + std::to_string(quantity);
+        }
+        if (!text.empty())
+            _out.Output(text);
+
+        if (with_visits > lines_limit)
+            _out.Output("Выведено первые " + std::to_string(lines_limit) + " строк");
+
+        _out.Output("Итого количество посетителей " + std::to_string(with_visits) +
+                    " из " + std::to_string(size) + " зарегистрировавшихся");
+    }
+
+    void finishVisited(const Pending & p)
+    {
+        size_t total = 0;
+
+        std::vector<std::pair<size_t,std::string>> persons;
+        for(const std::string & r : p.responses) {
+            ByteReader in(r.data(), r.size());
+            total += in.getVarint();
+            for(size_t i=0, n=in.getVarint(); i < n && !in.error(); ++i) {
+                size_t global = in.getVarint();
+                persons.emplace_back(global, in.getString(MAX_TEXT_LENGTH));
+            }
+        }
+
+        std::sort(persons.begin(), persons.end());
+
+        size_t count = 0;
+        for(const auto & [index, alias] : persons) {
+            if (count < OUTPUT_LIMIT)
+                _out.Output("[" + std::to_string(index) + "] " + alias);
+            else if (count == OUTPUT_LIMIT) {
+                _out.Output("Выведено первые " + std::to_string(OUTPUT_LIMIT) + " строк");
+                break;
+            }
+            count ++;
+        }
+
+        _out.Output("Количество посетителей: " + std::to_string(total));
+    }
+
+    /// Команда, которую маршрутизатор выполняет сам: выводит только сообщения lines
+    void local(std::vector<std::string> lines = {})
+    {
+        enqueue(Command(), count() + 1).lines = std::move(lines);
+    }
+
+public:
+    ShardRouter(const ShardOptions & options, const IOutput & out)
+        : _options(options)
+        , _out(out)
+    {}
+
+    ~ShardRouter()
+    {
+        // Закрытие сокета завершает цикл сегмента
+        for(Shard & shard : _shards) {
+            if (shard.fd >= 0)
+                close(shard.fd);
+            if (shard.pid > 0)
+                waitpid(shard.pid, nullptr, 0);
+        }
+    }
+
+    bool start() { return startShards(); }
+
+    bool failed() const { return _failed; }
+
+    size_t commands() const { return _commands; }
+
+    void dispatch(const std::string & line)
+    {
+        LinesOutput errors;
+        Command     command;
+        if (!Application::parse(line, command, errors)) {
+            if (!errors.lines.empty())
+                local(std::move(errors.lines));
+            return;
+        }
+        dispatch(command);
+    }
+
+    void dispatch(const WorkloadRecord & record)
+    {
+        if (record.opcode == Opcode::Text) {
+            dispatch(std::string(record.text));
+            return;
+        }
+
+        Command command;
+        command.opcode = record.opcode;
+        command.argc   = record.argc;
+        std::copy(record.args, record.args + record.argc, command.args);
+        command.alias  = record.text;
+        dispatch(command);
+    }
+
+    void dispatch(Command command)
+    {
+        _commands ++;
+
+        IndexShard map {count(), 0};
+        ByteWriter request;
+        request.putFixed<uint8_t>(static_cast<uint8_t>(command.opcode));
+
+        size_t index = command.argc > 0 ? static_cast<size_t>(command.args[0]) : 0;
+
+        switch(command.opcode) {
+        case Opcode::Count:
+        case Opcode::Save:
+        case Opcode::Compact:
+            broadcast(command, request);
+            break;
+
+        case Opcode::Add:
+            index = _next_index ++;
+            request.putVarint(map.toLocal(index));
+            request.putString(command.alias);
+            route(command, index, request);
+            break;
+
+        case Opcode::AddVisit:
+            if (index == 0) {
+                local({"Недопустимый индекс посетителя 0"});
+                break;
+            }
+            request.putVarint(map.toLocal(index));
+            for(size_t i=1; i < 4; ++i)
+                request.putVarint(zigzagEncode(command.args[i]));
+            route(command, index, request);
+            break;
+
+        case Opcode::Remove:
+        case Opcode::Update:
+            if (index == 0) {
+                local();
+                break;
+            }
+            request.putVarint(map.toLocal(index));
+            if (command.opcode == Opcode::Update)
+                request.putString(command.alias);
+            route(command, index, request);
+            break;
+
+        case Opcode::View:
+            request.putVarint(command.argc > 0 ? command.args[0] : OUTPUT_LIMIT);
+            request.putVarint(command.argc > 1 ? command.args[1] : OUTPUT_LIMIT);
+            broadcast(command, request);
+            break;
+
+        case Opcode::Report:
+            request.putVarint(command.argc > 0 ? command.args[0] : OUTPUT_LIMIT);
+            broadcast(command, request);
+            break;
+
+        case Opcode::Visited:
+            if (command.argc != 3 && command.argc != 6) {
+                local({"Некорректное количество аргументов команды visited"});
+                break;
+            }
+            for(size_t i=0; i < 6; ++i)
+                request.putVarint(zigzagEncode(command.args[command.argc == 6 ? i : i % 3]));
+            broadcast(command, request);
+            break;
+
+        case Opcode::VisitsBetween:
+        case Opcode::LastVisit:
+            if (command.opcode == Opcode::VisitsBetween && command.argc != 4 && command.argc != 7) {
+                local({"Некорректное количество аргументов команды visits_between"});
+                break;
+            }
+            if (index == 0) {
+                local({"Недопустимый индекс посетителя 0"});
+                break;
+            }
+            request.putVarint(map.toLocal(index));
+            if (command.opcode == Opcode::VisitsBetween)
+                for(size_t i=1; i < 7; ++i)
+                    request.putVarint(zigzagEncode(command.args[command.argc == 7 ? i : (i - 1) % 3 + 1]));
+            route(command, index, request);
+            break;
+
+        case Opcode::Import:
+            // Индексы следующих посетителей зависят от количества импортированных,
+            // поэтому перед следующей командой маршрутизатор дожидается результата
+            command.argc    = 1;
+            command.args[0] = static_cast<int64_t>(_next_index);
+            request.putVarint(_next_index);
+            request.putString(command.alias);
+            broadcast(command, request);
+            pump(true);
+            break;
+
+        default:
+            break;
+        }
+
+        complete();
+        if (congested())
+            pump(false);
+    }
+
+    /// Ожидание ответов на все команды и итоговое сохранение сегментов
+    bool finish()
+    {
+        Command save;
+        save.opcode = Opcode::Save;
+
+        ByteWriter request;
+        request.putFixed<uint8_t>(static_cast<uint8_t>(Opcode::Save));
+
+        broadcast(save, request);
+        _pending.back().final = true;
+
+        pump(true);
+        return !_failed && !_save_failed;
+    }
+};
+
+template<typename Source>
+int runRouter(const ShardOptions & options, const IOutput & out, Source && source)
+{
+    ShardRouter router(options, out);
+    if (!router.start())
+        return 1;
+
+    source(router);
+
+    bool ok = router.finish();
+
+    std::cerr << "Выполняем пакет команд. Количество сегментов: " << options.number_of_shards
+              << ", команд: " << router.commands() << std::endl;
+
+    if (!ok)
+        return 1;
+
+    std::cout << "Выполнение команд завершено" << std::endl;
+    return 0;
+}
+
+}
+
+int runShards(std::string_view input, const ShardOptions & options, const IOutput & out)
+{
+    return runRouter(options, out, [&](ShardRouter & router) {
+        BinaryWorkloadReader reader(input.data(), input.size());
+        for(WorkloadRecord record; !router.failed() && reader.next(record); )
+            router.dispatch(record);
+
+        if (reader.error())
+            out.Output("Ошибка в двоичном пакете команд после команды " + std::to_string(router.commands()));
+    });
+}
+
+int runShards(std::istream & input, const ShardOptions & options, const IOutput & out)
+{
+    return runRouter(options, out, [&](ShardRouter & router) {
+        for(std::string line; !router.failed() && std::getline(input, line); ) {
+            if (line.empty())
+                break;
+            router.dispatch(line);
+        }
+    });
+}
@@ -1,10 +1,30 @@
+#include "hw/l1_Analytics.h"
+#include "hw/l1_Server.h"
+#include "hw/l1_Shards.h"
 #include "hw/l2_ApplicationLayer.h"
+#include "tp/Arena.h"
+#include "tp/Poller.h"
 #include "tp/ThreadPool.h"
+#include "tp/Statistics.h"
+#include "tp/Trace.h"
 
+#include <algorithm>
+#include <coroutine>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 #include <cassert>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 
 class TerminalOutput : public IOutput
 {
@@ -18,6 +38,68 @@ void TerminalOutput::Output(std::string s) const
     std::cout << s << std::endl;
 }
 
+/**
+ * @brief Вывод команд, выполняемых сопрограммами
+ *
+ * @details Строки накапливаются в буфере, который записывает в стандартный
+ * вывод отдельная сопрограмма (не больше одной одновременно), поэтому
+ * команды не ждут готовности вывода.
+ *
+ */
+class AsyncOutput : public IOutput
+{
+    tp::Poller &        _poller;
+    tp::ThreadPool &    _pool;
+    tp::TaskGroup &     _group;
+    mutable std::mutex  _mutex;
+    mutable std::string _buffer;
+    mutable bool        _writing = false;
+
+    tp::Task<void> write() const;
+
+public:
+    AsyncOutput(tp::Poller & poller, tp::ThreadPool & pool, tp::TaskGroup & group)
+        : _poller(poller)
+        , _pool(pool)
+        , _group(group)
+    {}
+
+    virtual void Output(std::string s) const override final;
+};
+
+
+void AsyncOutput::Output(std::string s) const
+{
+    {
+        std::lock_guard locker(_mutex);
+        _buffer += s;
+        _buffer += '\n';
+        if (_writing)
+            return;
+        _writing = true;
+    }
+
+    _group.spawn(_pool, write());
+}
+
+tp::Task<void> AsyncOutput::write() const
+{
+    for(;;) {
+        std::string data;
+        {
+            std::lock_guard locker(_mutex);
+            if (_buffer.empty()) {
+                _writing = false;
+                co_return;
+            }
+            data.swap(_buffer);
+        }
+
+        if (!co_await tp::asyncWrite(_poller, STDOUT_FILENO, data))
+            std::cerr << "Ошибка записи результатов команд" << std::endl;
+    }
+}
+
 int convertToInteger(const std::string & str)
 try
 {
@@ -33,14 +115,18 @@ void performCommandsSimultaneously(std::istream & is, ItemCollector & col, const
     tp::ThreadPool tp(number_of_threads);
     tp.start();
 
+    // Подряд идущие команды add_visit выполняются группами по посетителям
+    VisitCoalescer coalescer(col, out, &tp, [&tp](tp::Task_interface * task) { tp.submit(task); });
+
     size_t number_of_commands = 0;
     for(std::string line; std::getline(is,line); ) {
         if (line.empty())
             break;
 
-        tp.submit(new Application(col,line,out));
+        coalescer.add(line);
         number_of_commands ++;
     }
+    coalescer.flush();
 
     std::cerr << "Выполняем пакет команд. Размер пула потоков: " << tp.size() 
               << ", остаток команд в очереди: " << tp.queue_length() 
@@ -48,7 +134,202 @@ void performCommandsSimultaneously(std::istream & is, ItemCollector & col, const
               << std::endl;
 }
 
+void performBinaryCommands(const char * data, size_t size, ItemCollector & col, const TerminalOutput & out, int number_of_threads)
+{
+    BinaryWorkloadReader reader(data, size);
+    tp::ThreadPool       tp(number_of_threads);
+    tp.start();
+
+    VisitCoalescer coalescer(col, out, &tp, [&tp](tp::Task_interface * task) { tp.submit(task); });
+
+    size_t number_of_commands = 0;
+    for(WorkloadRecord record; reader.next(record); ) {
+        coalescer.add(record);
+        number_of_commands ++;
+    }
+    coalescer.flush();
+
+    if (reader.error())
+        out.Output("Ошибка в двоичном пакете команд после команды " + std::to_string(number_of_commands));
+
+    std::cerr << "Выполняем двоичный пакет команд. Размер пула потоков: " << tp.size() 
+              << ", остаток команд в очереди: " << tp.queue_length() 
+              << " из " << number_of_commands
+              << std::endl;
+}
+
+/**
+ * @brief Ограничение количества одновременно выполняемых команд пакета (--async)
+ *
+ * @details Читающая пакет сопрограмма перед запуском команды занимает место
+ * (acquire) и, если выполняется limit команд, приостанавливается, не занимая
+ * поток пула. Завершившаяся команда освобождает место (release) и продолжает
+ * читающую сопрограмму в пуле. Ожидает только читающая сопрограмма.
+ *
+ */
+class CommandWindow
+{
+    tp::ThreadPool &        _pool;
+    const size_t            _limit;
+    std::mutex              _mutex;
+    size_t                  _active = 0;
+    std::coroutine_handle<> _reader;
+
+public:
+    static constexpr size_t DEFAULT_LIMIT = 1024;
+
+    CommandWindow(tp::ThreadPool & pool, size_t limit = DEFAULT_LIMIT)
+        : _pool(pool)
+        , _limit(std::max<size_t>(limit, 1))
+    {}
+
+    class Awaiter
+    {
+        CommandWindow & _window;
+
+    public:
+        explicit Awaiter(CommandWindow & window) : _window(window) {}
+
+        bool await_ready() noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            std::lock_guard locker(_window._mutex);
+            if (_window._active < _window._limit) {
+                _window._active ++;
+                return false;
+            }
+            _window._reader = handle;
+            return true;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    Awaiter acquire() { return Awaiter(*this); }
+
+    void release()
+    {
+        std::coroutine_handle<> reader;
+        {
+            // Место завершившейся команды сразу переходит ожидающей читающей сопрограмме
+            std::lock_guard locker(_mutex);
+            if (_reader)
+                reader = std::exchange(_reader, nullptr);
+            else
+                _active --;
+        }
+
+        if (reader)
+            _pool.submit(new tp::ResumeTask(reader));
+    }
+};
+
+/// Выполнение задачи пакета сопрограммой с освобождением места в окне
+tp::Task<void> performTaskAsync(std::unique_ptr<CommandTask> task, CommandWindow & window)
+{
+    co_await task->workAsync();
+    window.release();
+}
+
+/**
+ * @brief Чтение пакета команд сопрограммой
+ *
+ * @details Как и при выполнении пакета потоками, подряд идущие команды add_visit
+ * объединяются VisitCoalescer. Каждая задача запускается отдельной сопрограммой,
+ * одновременно - не больше, чем позволяет window, поэтому кадры сопрограмм
+ * не создаются для всего пакета сразу. Задачи запускаются в самой читающей
+ * сопрограмме, а не во вложенной: без оптимизации компилятор не заменяет
+ * передачу управления между сопрограммами переходом, и стек рос бы с каждой
+ * командой, пока читающая сопрограмма не приостановится.
+ *
+ */
+tp::Task<void> readCommandsAsync(tp::Poller & poller, int fd, ItemCollector & col, const AsyncOutput & out,
+                                 tp::ThreadPool & pool, tp::TaskGroup & group, CommandWindow & window,
+                                 size_t & number_of_commands)
+{
+    std::vector<char>          buffer(1 << 16);
+    std::string                input;
+    std::vector<CommandTask *> tasks;
+
+    VisitCoalescer coalescer(col, out, &pool, [&tasks](CommandTask * task) { tasks.push_back(task); });
+
+    for(bool done = false; !done; ) {
+        ssize_t n = co_await tp::asyncRead(poller, fd, buffer.data(), buffer.size());
+        if (n > 0)
+            input.append(buffer.data(), n);
+        else {
+            if (n < 0)
+                std::cerr << "Ошибка чтения пакета команд" << std::endl;
+            if (!input.empty())
+                input += '\n';
+            done = true;
+        }
+
+        size_t start = 0;
+        for(size_t end; (end = input.find('\n', start)) != std::string::npos; start = end + 1) {
+            if (end == start) {
+                done = true;
+                break;
+            }
+
+            coalescer.add(input.substr(start, end - start));
+            number_of_commands ++;
+
+            for(CommandTask * task : std::exchange(tasks, {})) {
+                co_await window.acquire();
+                group.spawn(pool, performTaskAsync(std::unique_ptr<CommandTask>(task), window));
+            }
+        }
+        input.erase(0, start);
+    }
+
+    coalescer.flush();
+    for(CommandTask * task : std::exchange(tasks, {})) {
+        co_await window.acquire();
+        group.spawn(pool, performTaskAsync(std::unique_ptr<CommandTask>(task), window));
+    }
+}
+
+/**
+ * @brief Выполнение текстового пакета команд сопрограммами (--async)
+ *
+ * @details Ввод и вывод выполняются через tp::Poller, команды ожидают
+ * блокировку коллекции, не занимая потоков пула, поэтому одновременно
+ * выполняется до CommandWindow::DEFAULT_LIMIT команд пакета.
+ *
+ */
+void performCommandsAsync(int fd, ItemCollector & col, int number_of_threads)
+{
+    tp::ThreadPool pool(number_of_threads);
+    pool.start();
+
+    tp::Poller    poller(pool);
+    tp::TaskGroup group;
+    AsyncOutput   out(poller, pool, group);
+    CommandWindow window(pool);
+    size_t        number_of_commands = 0;
+
+    // Неблокирующий режим устанавливается на время пакета: дескрипторы могут быть общими с другими процессами
+    std::cout.flush();
+    int input_flags  = fcntl(fd, F_GETFL);
+    int output_flags = fcntl(STDOUT_FILENO, F_GETFL);
+    fcntl(fd, F_SETFL, input_flags | O_NONBLOCK);
+    fcntl(STDOUT_FILENO, F_SETFL, output_flags | O_NONBLOCK);
+
+    group.spawn(pool, readCommandsAsync(poller, fd, col, out, pool, group, window, number_of_commands));
+    group.wait();
+
+    fcntl(fd, F_SETFL, input_flags);
+    fcntl(STDOUT_FILENO, F_SETFL, output_flags);
+
+    std::cerr << "Выполнен пакет команд сопрограммами. Размер пула потоков: " << pool.size()
+              << ", команд: " << number_of_commands
+              << std::endl;
+}
+
 inline const std::string DATA_DEFAULT_NAME = "lab.data";
+inline const std::string PAGE_FILE_DEFAULT_NAME = "lab.pages";
 
 int main(int argc, char *argv[])
 {
@@ -57,28 +338,243 @@ int main(int argc, char *argv[])
     std::string    data_file_name = DATA_DEFAULT_NAME;
     std::string    input_file_name;
     int            number_of_threads = -1;
+    bool           statistics = false;
+    tp::Statistics::Format statistics_format = tp::Statistics::Format::Text;
+    std::string    trace_file_name;
+    bool           binary_input = false;
+    std::string    server_socket;
+    std::string    client_socket;
+    int            save_interval = 0;
+    bool           compact_on_save = false;
+    int            number_of_shards = 1;
+    std::string    shared_segment_name;
+    std::string    attach_segment_name;
+    bool           async_commands = false;
+    bool           arena = false;
+    tp::Arena::HugePages huge_pages = tp::Arena::HugePages::Transparent;
+    int            memory_budget = 0;
+    std::string    page_file_name = PAGE_FILE_DEFAULT_NAME;
+    VisitOrder     visit_order = VisitOrder::Insertion;
 
     // Разбираем командную строку
     std::vector<std::string> arguments(argv + 1, argv + argc);
     for(const std::string & arg : arguments)
-        if (std::to_string(convertToInteger(arg)) == arg)
+        if (arg == "--stats" || arg == "--stats=text")
+            statistics = true;
+        else if (arg == "--stats=json") {
+            statistics = true;
+            statistics_format = tp::Statistics::Format::Json;
+        }
+        else if (arg == "--binary")
+            binary_input = true;
+        else if (arg == "--async")
+            async_commands = true;
+        else if (arg == "--arena" || arg == "--arena=thp")
+            arena = true;
+        else if (arg == "--arena=hugetlb") {
+            arena = true;
+            huge_pages = tp::Arena::HugePages::Explicit;
+        }
+        else if (arg == "--arena=plain") {
+            arena = true;
+            huge_pages = tp::Arena::HugePages::None;
+        }
+        else if (arg.substr(0,8) == "--trace=") {
+#ifdef TP_TRACE
+            trace_file_name = arg.substr(8);
+#else
+            out.Output("Программа собрана без поддержки трассировки (cmake -DLAB_TRACE=ON)");
+            return 1;
+#endif
+        }
+        else if (arg.substr(0,9) == "--server=")
+            server_socket = arg.substr(9);
+        else if (arg.substr(0,10) == "--connect=")
+            client_socket = arg.substr(10);
+        else if (arg.substr(0,16) == "--save-interval=")
+            save_interval = convertToInteger(arg.substr(16));
+        else if (arg == "--compact-on-save")
+            compact_on_save = true;
+        else if (arg.substr(0,9) == "--shards=")
+            number_of_shards = convertToInteger(arg.substr(9));
+        else if (arg.substr(0,16) == "--memory-budget=")
+            memory_budget = convertToInteger(arg.substr(16));
+        else if (arg.substr(0,12) == "--page-file=")
+            page_file_name = arg.substr(12);
+        else if (arg == "--sorted-visits")
+            visit_order = VisitOrder::Sorted;
+        else if (arg == "--sorted-visits=unique")
+            visit_order = VisitOrder::SortedUnique;
+        else if (arg.substr(0,6) == "--shm=")
+            shared_segment_name = arg.substr(6);
+        else if (arg.substr(0,9) == "--attach=")
+            attach_segment_name = arg.substr(9);
+        else if (arg.substr(0,2) == "--") {
+            out.Output("Недопустимый параметр '" + arg + "'");
+            return 1;
+        }
+        else if (std::to_string(convertToInteger(arg)) == arg)
             number_of_threads = convertToInteger(arg);
         else
             input_file_name = arg;
 
-    // Соединение и загрузка хранилища
-    col.loadCollection(data_file_name);
+    // Клиент только передаёт пакет команд серверу, хранилище не загружается
+    if (!client_socket.empty())
+        return runClient(client_socket);
+
+    // Процесс аналитики читает коллекцию, опубликованную писателем в разделяемой памяти
+    if (!attach_segment_name.empty()) {
+        if (input_file_name.empty())
+            return runAnalytics(attach_segment_name, std::cin, out);
 
-    // Работа с файлом команд через файл, а не пайп может быть полезна, если нужна отладка
-    if (input_file_name.empty())
-        performCommandsSimultaneously(std::cin,col,out,number_of_threads);
-    else {
         std::ifstream ifs (input_file_name);
         if (!ifs) {
             out.Output("Ошибка при открытии файла команд '" + input_file_name + "'");
             return 1;
         }
-        performCommandsSimultaneously(ifs,col,out,number_of_threads);
+        return runAnalytics(attach_segment_name, ifs, out);
+    }
+
+    if (statistics)
+        tp::Statistics::instance().enable();
+
+    if (!trace_file_name.empty())
+        tp::Trace::instance().enable();
+
+    // Посетители размещаются в арене с загрузки хранилища, в том числе в процессах
+    // сегментов. Источники памяти статические, поэтому разрушаются после коллекции
+    static std::unique_ptr<tp::Arena>                            domain_arena;
+    static std::unique_ptr<std::pmr::synchronized_pool_resource> domain_pool;
+    if (arena) {
+        domain_arena = std::make_unique<tp::Arena>(huge_pages);
+        // Освобождённые блоки (например, заменённые при росте блоки визитов) используются повторно
+        domain_pool  = std::make_unique<std::pmr::synchronized_pool_resource>(
+                            std::pmr::pool_options {0, size_t(1) << 16}, domain_arena.get());
+        setDomainResource(domain_pool.get());
+    }
+
+    // В режиме сегментов коллекцию загружают и сохраняют процессы сегментов
+    if (number_of_shards < 1 || (number_of_shards > 1 && (!server_socket.empty() || !shared_segment_name.empty()))) {
+        out.Output("Недопустимое количество сегментов или режим сервера (разделяемой памяти) с сегментами");
+        return 1;
+    }
+
+    // Сопрограммами выполняется только текстовый пакет из файла или стандартного ввода
+    if (async_commands && (binary_input || !server_socket.empty() || number_of_shards > 1)) {
+        out.Output("Параметр --async несовместим с двоичным пакетом, режимом сервера и сегментами");
+        return 1;
+    }
+
+    if (memory_budget < 0) {
+        out.Output("Недопустимый бюджет памяти посетителей");
+        return 1;
+    }
+
+    if (number_of_shards > 1) {
+        ShardOptions options {size_t(number_of_shards), data_file_name, number_of_threads, compact_on_save, statistics,
+                              size_t(memory_budget) << 20, page_file_name, visit_order};
+        int          rc;
+
+        if (input_file_name.empty()) {
+            if (binary_input || std::cin.peek() == static_cast<unsigned char>(BINARY_WORKLOAD_MAGIC[0])) {
+                std::string data(std::istreambuf_iterator<char>(std::cin), {});
+                rc = runShards(std::string_view(data), options, out);
+            }
+            else
+                rc = runShards(std::cin, options, out);
+        }
+        else {
+            MappedFile mapped (input_file_name);
+            if (!mapped.valid()) {
+                out.Output("Ошибка при открытии файла команд '" + input_file_name + "'");
+                return 1;
+            }
+
+            if (binary_input || isBinaryWorkload(mapped.data(),mapped.size()))
+                rc = runShards(std::string_view(mapped.data(),mapped.size()), options, out);
+            else {
+                std::ifstream ifs (input_file_name);
+                rc = runShards(ifs, options, out);
+            }
+        }
+
+        if (statistics)
+            std::cerr << tp::Statistics::instance().report(statistics_format);
+        return rc;
+    }
+
+    // Бюджет памяти задаётся до загрузки: лишние посетители вытесняются по мере чтения файла данных
+    if (memory_budget > 0 && !col.setMemoryBudget(page_file_name, size_t(memory_budget) << 20)) {
+        out.Output("Ошибка при создании файла страниц '" + page_file_name + "'");
+        return 1;
+    }
+
+    // Визиты загружаемых посетителей сразу упорядочиваются
+    col.setVisitOrder(visit_order);
+
+    // Соединение и загрузка хранилища
+    // Отсутствие файла данных - обычная ситуация при первом запуске, а повреждённый
+    // файл нельзя перезаписывать частично загруженной коллекцией
+    if (!col.loadCollection(data_file_name) && std::filesystem::exists(data_file_name)) {
+        out.Output("Ошибка при загрузке файла данных '" + data_file_name + "'");
+        return 1;
+    }
+    col.setCompactOnSave(compact_on_save);
+
+    // Коллекция публикуется для процессов аналитики после загрузки и при каждом сохранении
+    std::unique_ptr<SharedSegment> shared_segment;
+    if (!shared_segment_name.empty()) {
+        shared_segment = std::make_unique<SharedSegment>(shared_segment_name, SharedSegment::Mode::Write);
+        if (!shared_segment->valid() || !col.publish(*shared_segment)) {
+            out.Output("Ошибка при открытии сегмента разделяемой памяти '" + shared_segment_name + "'");
+            return 1;
+        }
+        col.setSharedSegment(shared_segment.get());
+    }
+
+    // В режиме сервера пакеты команд поступают через сокет до получения SIGINT/SIGTERM
+    if (!server_socket.empty()) {
+        int rc = runServer(col, {server_socket, number_of_threads, save_interval});
+        if (rc != 0)
+            return rc;
+    }
+    // Текстовый пакет, команды которого выполняются сопрограммами
+    else if (async_commands) {
+        int fd = input_file_name.empty() ? STDIN_FILENO : open(input_file_name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            out.Output("Ошибка при открытии файла команд '" + input_file_name + "'");
+            return 1;
+        }
+
+        performCommandsAsync(fd, col, number_of_threads);
+
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    // Работа с файлом команд через файл, а не пайп может быть полезна, если нужна отладка.
+    // Двоичный пакет (см. stressgen --format binary) определяется по сигнатуре
+    // или задаётся параметром --binary.
+    else if (input_file_name.empty()) {
+        if (binary_input || std::cin.peek() == static_cast<unsigned char>(BINARY_WORKLOAD_MAGIC[0])) {
+            std::string data(std::istreambuf_iterator<char>(std::cin), {});
+            performBinaryCommands(data.data(),data.size(),col,out,number_of_threads);
+        }
+        else
+            performCommandsSimultaneously(std::cin,col,out,number_of_threads);
+    }
+    else {
+        MappedFile mapped (input_file_name);
+        if (!mapped.valid()) {
+            out.Output("Ошибка при открытии файла команд '" + input_file_name + "'");
+            return 1;
+        }
+
+        if (binary_input || isBinaryWorkload(mapped.data(),mapped.size()))
+            performBinaryCommands(mapped.data(),mapped.size(),col,out,number_of_threads);
+        else {
+            std::ifstream ifs (input_file_name);
+            performCommandsSimultaneously(ifs,col,out,number_of_threads);
+        }
     }
 
     // Сохраняем данные в хранилище
@@ -87,6 +583,31 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (statistics)
+        std::cerr << tp::Statistics::instance().report(statistics_format);
+
+    if (statistics && statistics_format == tp::Statistics::Format::Text && domain_arena != nullptr) {
+        tp::Arena::Stats arena_stats = domain_arena->stats();
+        std::cerr << "Арена посетителей: областей " << arena_stats.regions
+                  << " (с MAP_HUGETLB " << arena_stats.huge_regions << ")"
+                  << ", отображено " << (arena_stats.reserved >> 20) << " МиБ"
+                  << ", выдано " << (arena_stats.allocated >> 20) << " МиБ" << std::endl;
+    }
+
+    if (statistics && statistics_format == tp::Statistics::Format::Text && col.spillStore() != nullptr) {
+        const SpillStore &   spill       = *col.spillStore();
+        tp::PageFile::Stats  pages_stats = spill.file().stats();
+        std::cerr << "Вытеснение посетителей: в памяти " << (spill.resident() >> 20) << " МиБ"
+                  << " из " << (spill.budget() >> 20) << " МиБ"
+                  << ", в файле страниц " << pages_stats.records << " записей (" << pages_stats.pages << " страниц)"
+                  << ", записано " << pages_stats.writes << ", прочитано " << pages_stats.reads << std::endl;
+    }
+
+    if (!trace_file_name.empty() && !tp::Trace::instance().write(trace_file_name)) {
+        out.Output("Ошибка при записи файла трассировки '" + trace_file_name + "'");
+        return 1;
+    }
+
     std::cout << "Выполнение команд завершено" << std::endl;
     return 0;
 }
@@ -1,169 +1,792 @@
 #include "hw/l2_ApplicationLayer.h"
 
+#include "tp/Statistics.h"
+#include "tp/ThreadPool.h"
+#include "tp/Trace.h"
+
 #include <algorithm>
-#include <thread>
+#include <charconv>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <tuple>
+
+/// Наименьшее количество посетителей в части параллельного просмотра коллекции
+const size_t SCAN_GRAIN = 1 << 14;
+
+/// Наименьшее количество объединённых команд add_visit в одной задаче
+const size_t COALESCED_TASK_SIZE = 256;
+
+namespace
+{
+    struct CommandSeries
+    {
+        std::string name;       ///< Имя серии статистики и события трассировки
+        size_t      series;
+    };
+
+    const CommandSeries & commandSeries(Opcode opcode)
+    {
+        static const std::map<Opcode,CommandSeries> known = [] {
+            tp::Statistics &                stat = tp::Statistics::instance();
+            std::map<Opcode,CommandSeries>  res;
+
+            for(const OpcodeInfo & info : opcodeTable()) {
+                std::string name = "cmd." + std::string(info.long_name);
+                res[info.opcode] = {name, stat.registerSeries(name)};
+            }
+            return res;
+        }();
+        static const CommandSeries invalid {"cmd.invalid", tp::Statistics::instance().registerSeries("cmd.invalid")};
+
+        auto it = known.find(opcode);
+        return it == known.end() ? invalid : it->second;
+    }
+
+    /// Объединение строк вывода, разделённых переводом строки
+    std::string joinLines(std::string a, const std::string & b)
+    {
+        if (!a.empty() && !b.empty())
+            a += '\n';
+        a += b;
+        return a;
+    }
+
+    /**
+     * @brief Часть отчёта: количество посетителей с визитами и лучшие из них
+     *
+     * @details Посетители упорядочены по убыванию количества визитов,
+     * при равенстве - по возрастанию индекса.
+     *
+     */
+    struct ReportPart
+    {
+        using Entry = std::tuple<size_t,size_t,const PersonView *>;   ///< визиты, индекс, посетитель снимка
+
+        size_t             with_visits = 0;
+        std::vector<Entry> top;
+
+        static bool before(const Entry & a, const Entry & b)
+        {
+            return std::get<0>(a) > std::get<0>(b) || (std::get<0>(a) == std::get<0>(b) && std::get<1>(a) < std::get<1>(b));
+        }
+    };
+
+    /// Вывод команды view для посетителей снимка с номерами [begin, end)
+    std::string formatPersons(const CollectionSnapshot & snapshot, size_t begin, size_t end, size_t visits_limit)
+    {
+        std::string text;
+        for(size_t i=begin; i < end; ++i) {
+            const PersonView & item = snapshot[i];
+            text = joinLines(std::move(text), Application::formatPerson(item.index(), item, visits_limit));
+        }
+        return text;
+    }
+
+    /// Строки вывода команды view
+    QueryResult viewResult(std::string text, size_t size, size_t lines_limit)
+    {
+        QueryResult res;
+        if (!text.empty())
+            res.push_back(std::move(text));
+
+        if (size > lines_limit)
+            res.push_back("Выведено первые " + std::to_string(lines_limit) + " строк");
+
+        res.push_back("Количество элементов в коллекции: " + std::to_string(size));
+        return res;
+    }
+
+    /// Не больше lines_limit лучших посетителей снимка с номерами [begin, end)
+    ReportPart selectReport(const CollectionSnapshot & snapshot, size_t begin, size_t end, size_t lines_limit)
+    {
+        ReportPart part;
+        for(size_t i=begin; i < end; ++i) {
+            const PersonView & p = snapshot[i];
+            if (p.visitCount() > 0)
+                part.top.emplace_back(p.visitCount(), p.index(), &p);
+        }
+
+        part.with_visits = part.top.size();
+        if (part.top.size() > lines_limit) {
+            std::nth_element(part.top.begin(), part.top.begin() + lines_limit, part.top.end(), ReportPart::before);
+            part.top.resize(lines_limit);
+        }
+        std::sort(part.top.begin(), part.top.end(), ReportPart::before);
+        return part;
+    }
+
+    ReportPart mergeReport(ReportPart a, ReportPart b, size_t lines_limit)
+    {
+        ReportPart res;
+        res.with_visits = a.with_visits + b.with_visits;
+        res.top.reserve(std::min(a.top.size() + b.top.size(), lines_limit));
+        std::merge(a.top.begin(), a.top.end(), b.top.begin(), b.top.end(), std::back_inserter(res.top), ReportPart::before);
+        if (res.top.size() > lines_limit)
+            res.top.resize(lines_limit);
+        return res;
+    }
+
+    /// Строки вывода команды report
+    QueryResult reportResult(const ReportPart & report, size_t lines_limit, size_t size)
+    {
+        QueryResult res;
+
+        std::string text;
+        // Псевдонимы читаются только у выводимых посетителей, см. PersonView::alias
+        for(const auto & [quantity,index,person] : report.top)
+            text = joinLines(std::move(text), person->alias() + " " + std::to_string(quantity));
+        if (!text.empty())
+            res.push_back(std::move(text));
+
+        if (report.with_visits > lines_limit)
+            res.push_back("Выведено первые " + std::to_string(lines_limit) + " строк");
+
+        res.push_back("Итого количество посетителей " + std::to_string(report.with_visits) +
+                      " из " + std::to_string(size) + " зарегистрировавшихся");
+        return res;
+    }
+
+    /**
+     * @brief Ключ результата команды в снимке: код и аргументы со значениями по умолчанию
+     *
+     * @details Команды "view" и "view 1000 1000" получают один ключ.
+     *
+     */
+    std::string queryKey(Opcode opcode, std::initializer_list<size_t> args)
+    {
+        std::string key = std::to_string(static_cast<int>(opcode));
+        for(size_t arg : args) {
+            key += ' ';
+            key += std::to_string(arg);
+        }
+        return key;
+    }
+
+    void outputResult(const IOutput & out, const QueryResult & result)
+    {
+        for(const std::string & line : result)
+            out.Output(line);
+    }
+}
+
+namespace
+{
+    /**
+     * @brief Разбор команды add_visit по тем же правилам, что и при кодировании двоичного пакета
+     *
+     * @details Команды, которые Application разобрала бы иначе (например, с ведущим
+     * '+' или лишними символами), не распознаются и выполняются по одной.
+     *
+     */
+    std::optional<std::pair<size_t,Visit>> parseAddVisit(std::string_view line)
+    {
+        std::string_view tokens[5];
+        size_t           count = 0;
+
+        for(size_t pos = 0; pos < line.size(); ) {
+            size_t start = line.find_first_not_of(' ', pos);
+            if (start == std::string_view::npos)
+                break;
+            if (count == 5)
+                return {};
+            size_t end = std::min(line.find(' ', start), line.size());
+            tokens[count++] = line.substr(start, end - start);
+            pos = end;
+        }
+
+        if (count != 5 || (tokens[0] != "av" && tokens[0] != "add_visit"))
+            return {};
+
+        int64_t values[4];
+        for(size_t i=0; i < 4; ++i) {
+            std::string_view token      = tokens[i+1];
+            bool             negative   = i > 0 && !token.empty() && token[0] == '-';
+            size_t           max_digits = i > 0 ? 9 : 18;
+            if (negative)
+                token.remove_prefix(1);
+
+            if (token.empty() || token.size() > max_digits || token.find_first_not_of("0123456789") != std::string_view::npos)
+                return {};
+
+            std::from_chars(token.data(), token.data() + token.size(), values[i]);
+            if (negative)
+                values[i] = -values[i];
+        }
 
-const int OUTPUT_LIMIT = 1000;
+        return std::make_pair(static_cast<size_t>(values[0]),
+                              Visit(static_cast<int>(values[1]), static_cast<int>(values[2]), static_cast<int>(values[3])));
+    }
+
+    /**
+     * @brief Визиты из объединённых команд add_visit, упорядоченные по посетителям
+     *
+     */
+    class AddVisitsTask : public CommandTask
+    {
+        ItemCollector &     _col;
+        const IOutput &     _out;
+        std::vector<size_t> _indices;
+        std::vector<Visit>  _visits;
+
+    public:
+        AddVisitsTask(ItemCollector & col, const IOutput & out, std::vector<size_t> indices, std::vector<Visit> visits)
+            : _col(col)
+            , _out(out)
+            , _indices(std::move(indices))
+            , _visits(std::move(visits))
+        {}
+
+        virtual void work() override
+        {
+            static const size_t series = tp::Statistics::instance().registerSeries("cmd.add_visits");
+
+            tp::ScopedLatency latency(series);
+            TP_TRACE_SCOPE("command", "cmd.add_visits");
+
+            for(size_t begin = 0, end; begin < _indices.size(); begin = end) {
+                for(end = begin + 1; end < _indices.size() && _indices[end] == _indices[begin]; ++end)
+                    ;
+
+                if (!_col.addVisits(_indices[begin], {_visits.data() + begin, end - begin}))
+                    for(size_t i=begin; i < end; ++i)
+                        _out.Output("Недопустимый индекс посетителя " + std::to_string(_indices[i]));
+            }
+        }
+
+        /// Группа посетителя ожидает блокировку коллекции, не занимая поток пула
+        virtual tp::Task<void> workAsync() override
+        {
+            static const size_t series = tp::Statistics::instance().registerSeries("cmd.add_visits");
+
+            tp::ScopedLatency latency(series);
+
+            for(size_t begin = 0, end; begin < _indices.size(); begin = end) {
+                for(end = begin + 1; end < _indices.size() && _indices[end] == _indices[begin]; ++end)
+                    ;
+
+                std::vector<Visit> visits(_visits.begin() + begin, _visits.begin() + end);
+                if (!co_await _col.addVisitsAsync(_indices[begin], std::move(visits)))
+                    for(size_t i=begin; i < end; ++i)
+                        _out.Output("Недопустимый индекс посетителя " + std::to_string(_indices[i]));
+            }
+        }
+    };
+}
+
+tp::Task<void> CommandTask::workAsync()
+{
+    work();
+    co_return;
+}
+
+template<typename T, typename Map, typename Reduce>
+T Application::scan(size_t size, Map map, Reduce reduce) const
+{
+    if (_pool == nullptr || size < 2 * SCAN_GRAIN)
+        return map(0, size);
+
+    return _pool->parallel_reduce(size, SCAN_GRAIN, T(), map, reduce);
+}
+
+template<typename T, typename Map, typename Reduce>
+tp::Task<T> Application::scanAsync(size_t size, Map map, Reduce reduce) const
+{
+    T result = map(0, std::min(size, SCAN_GRAIN));
+
+    // После каждой части поток уступается командам, ожидающим в очереди пула
+    for(size_t begin = SCAN_GRAIN; begin < size; begin += SCAN_GRAIN) {
+        co_await tp::yield();
+        result = reduce(std::move(result), map(begin, std::min(size, begin + SCAN_GRAIN)));
+    }
+
+    co_return result;
+}
+
+Application::Application(ItemCollector & col, const WorkloadRecord & record, const IOutput & out, tp::ThreadPool * pool)
+    : _col(col)
+    , _out(out)
+    , _pool(pool)
+{
+    if (record.opcode == Opcode::Text) {
+        _text = record.text;
+        return;
+    }
+
+    // Запись, собранная не BinaryWorkloadReader, проверяется так же, как при чтении пакета
+    const OpcodeInfo * info = findOpcode(record.opcode);
+    if (info == nullptr || !isValidRecordArgc(*info, record.argc)) {
+        _malformed = true;
+        return;
+    }
+
+    _command.opcode = record.opcode;
+    _command.argc   = record.argc;
+    std::copy(record.args, record.args + record.argc, _command.args);
+    _command.alias  = record.text;
+}
+
+bool Application::prepare()
+{
+    if (_malformed) {
+        _out.Output("Некорректная запись двоичного пакета команд");
+        return false;
+    }
+
+    return _command.opcode != Opcode::Invalid || parse(_text, _command, _out);
+}
 
 void Application::work()
 {
-    std::vector<std::string> args = split(_command);
-    if (args.empty())
+    if (!prepare())
         return;
 
-    // Используется для проверки заполнения очереди. 
-    // Очередь слишком быстро опустошалась, пытался понять где тормозит.
-    // std::this_thread::sleep_for(std::chrono::microseconds(10000));
+    // Время выполнения команд учитывается в статистике (bin/lab --stats) и трассировке
+    const CommandSeries & command_series = commandSeries(_command.opcode);
+    tp::ScopedLatency     latency(command_series.series);
+    TP_TRACE_SCOPE("command", command_series.name.c_str());
 
-    // count
-    if (args[0] == "c" || args[0] == "count") {
-        if (args.size() != 1) {
-            _out.Output("Некорректное количество аргументов команды clean");
-            return;
-        }
+    execute();
+}
+
+bool Application::parse(const std::string & text, Command & command, const IOutput & out)
+{
+    std::vector<std::string> args = split(text);
+    if (args.empty())
+        return false;
+
+    const OpcodeInfo * info = findOpcode(args[0]);
+    if (info == nullptr) {
+        out.Output("Недопустимая команда '" + args[0] + "'");
+        return false;
+    }
+
+    if (args.size() - 1 < info->min_args || args.size() - 1 > info->max_args) {
+        out.Output("Некорректное количество аргументов команды " + std::string(info->long_name));
+        return false;
+    }
+
+    command.opcode = info->opcode;
+    command.argc   = args.size() - 1 - (info->has_alias ? 1 : 0);
+
+    // Индексы и ограничения вывода беззнаковые, компоненты даты - целые со знаком.
+    // Команды выполняются потоками пула (в режиме сервера - для всех клиентов),
+    // поэтому ошибка преобразования аргумента не выходит за пределы разбора
+    try {
+        for(size_t i=0; i < command.argc; ++i)
+            if (info->signed_args && i > 0)
+                command.args[i] = stoi(args[i+1]);
+            else
+                command.args[i] = stoul(args[i+1]);
+    }
+    catch(const std::exception &) {
+        out.Output("Некорректные аргументы команды '" + text + "'");
+        return false;
+    }
+
+    if (info->has_alias)
+        command.alias = args.back();
+
+    return true;
+}
+
+std::string Application::formatPerson(size_t index, const PersonView & person, size_t visits_limit)
+{
+    return person.withData([&](std::string_view alias, std::span<const Visit> visits) {
+        return formatPerson(index, alias, visits, visits_limit);
+    });
+}
+
+std::string Application::formatPerson(size_t index, std::string_view alias, std::span<const Visit> visits, size_t visits_limit)
+{
+    std::string text = "[" + std::to_string(index) + "] " + std::string(alias) + " ";
+
+    // Визиты сверх visits_limit не просматриваются, их количество известно заранее
+    size_t visits_count = visits.size();
+    for(const Visit & v : visits.first(std::min(visits_count, visits_limit)))
+        text += "\n\t" + std::to_string(v.getDay()) + "." + std::to_string(v.getMonth()) + "." + std::to_string(v.getYear());
+
+    if (visits_count >= visits_limit)
+        text += "\n\t... " + std::to_string(visits_count) + " визитов";
 
+    return text;
+}
+
+QueryResult Application::formatVisitsBetween(std::span<const Visit> visits)
+{
+    QueryResult res;
+    for(const Visit & v : visits.first(std::min<size_t>(visits.size(), OUTPUT_LIMIT)))
+        res.push_back(std::to_string(v.getDay()) + "." + std::to_string(v.getMonth()) + "." + std::to_string(v.getYear()));
+
+    if (visits.size() > OUTPUT_LIMIT)
+        res.push_back("Выведено первые " + std::to_string(OUTPUT_LIMIT) + " строк");
+
+    res.push_back("Количество визитов: " + std::to_string(visits.size()));
+    return res;
+}
+
+std::string Application::formatLastVisit(const std::optional<Visit> & last)
+{
+    if (!last)
+        return "Визитов нет";
+
+    return std::to_string(last->getDay()) + "." + std::to_string(last->getMonth()) + "." + std::to_string(last->getYear());
+}
+
+void Application::execute()
+{
+    const Command & cmd = _command;
+
+    // count
+    if (cmd.opcode == Opcode::Count) {
         _out.Output(std::to_string(_col.getSize()));
         return;
     }
 
     // add alias
-    if (args[0] == "a" || args[0] == "add") {
-        if (args.size() != 2) {
-            _out.Output("Некорректное количество аргументов команды add");
-            return;
-        }
-
-        _col.addItem(std::make_shared<Person>(args[1].c_str()));
+    if (cmd.opcode == Opcode::Add) {
+        _col.addItem(Person(cmd.alias));
         return;
     }
 
     // add_visit person_no year month day
-    if (args[0] == "av" || args[0] == "add_visit") {
-        if (args.size() != 5) {
-            _out.Output("Некорректное количество аргументов команды add_visit");
-            return;
-        }
-
-        Person & p = _col.getPerson(stoul(args[1]));
-        p.addVisit(Visit(stoi(args[2]),stoi(args[3]),stoi(args[4])));
+    if (cmd.opcode == Opcode::AddVisit) {
+        // Сервер не должен завершаться аварийно из-за ошибки в пакете клиента
+        if (!_col.addVisit(cmd.args[0], Visit(cmd.args[1],cmd.args[2],cmd.args[3])))
+            _out.Output("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
 
         return;
     }
 
     // remove person_no
-    if (args[0] == "r" || args[0] == "remove") {
-        if (args.size() != 2) {
-            _out.Output("Некорректное количество аргументов команды remove");
-            return;
-        }
-
-        _col.removeItem(stoul(args[1]));
+    if (cmd.opcode == Opcode::Remove) {
+        _col.removeItem(cmd.args[0]);
         return;
     }
 
     // update person_no alias
-    if (args[0] == "u" || args[0] == "update") {
-        if (args.size() != 3) {
-            _out.Output("Некорректное количество аргументов команды update");
+    if (cmd.opcode == Opcode::Update) {
+        _col.setAlias(cmd.args[0], cmd.alias);
+        return;
+    }
+
+    // save
+    if (cmd.opcode == Opcode::Save) {
+        if (!_col.saveCollection())
+            _out.Output("Ошибка при сохранении файла данных '" + _col.data_file_name() + "'");
+        else
+            _out.Output("Данные сохранены в файл '" + _col.data_file_name() + "'");
+        return;
+    }
+
+    // import file_name
+    if (cmd.opcode == Opcode::Import) {
+        const std::string & file_name = cmd.alias;
+        ImportResult        result    = _col.importFile(file_name, _pool);
+
+        if (!result.opened)
+            _out.Output("Ошибка при открытии файла импорта '" + file_name + "'");
+        else if (result.error_line != 0)
+            _out.Output("Ошибка в строке " + std::to_string(result.error_line) + " файла импорта '" + file_name + "'");
+        else if (!result.valid)
+            _out.Output("Ошибка при загрузке файла импорта '" + file_name + "'");
+        else if (result.count == 0)
+            _out.Output("Импортировано посетителей: 0");
+        else
+            _out.Output("Импортировано посетителей: " + std::to_string(result.count) + ", индексы с "
+                        + std::to_string(result.first) + " по " + std::to_string(result.first + result.count - 1));
+        return;
+    }
+
+    // compact
+    if (cmd.opcode == Opcode::Compact) {
+        _out.Output("Удалено элементов: " + std::to_string(_col.compact()));
+        return;
+    }
+
+    // visited year month day [year month day]
+    if (cmd.opcode == Opcode::Visited) {
+        if (cmd.argc != 3 && cmd.argc != 6) {
+            _out.Output("Некорректное количество аргументов команды visited");
             return;
         }
 
-        _col.updateItem(stoul(args[1]), std::make_shared<Person>(args[2].c_str()));
+        Visit from(cmd.args[0], cmd.args[1], cmd.args[2]);
+        Visit to = cmd.argc == 6 ? Visit(cmd.args[3], cmd.args[4], cmd.args[5]) : from;
+
+        std::vector<std::pair<size_t,std::string>> persons = _col.visited(from, to);
+
+        size_t count = 0;
+        for(const auto & [index,alias] : persons) {
+            if (count < OUTPUT_LIMIT)
+                _out.Output("[" + std::to_string(index) + "] " + alias);
+            else if (count == OUTPUT_LIMIT) {
+                _out.Output("Выведено первые " + std::to_string(OUTPUT_LIMIT) + " строк");
+                break;
+            }
+            count ++;
+        }
+
+        _out.Output("Количество посетителей: " + std::to_string(persons.size()));
         return;
     }
 
-    // view [lines_limit] [visits_limit]
-    if (args[0] == "v" || args[0] == "view") {
-        if (args.size() > 3) {
-            _out.Output("Некорректное количество аргументов команды view");
+    // visits_between person_no year month day [year month day]
+    if (cmd.opcode == Opcode::VisitsBetween) {
+        if (cmd.argc != 4 && cmd.argc != 7) {
+            _out.Output("Некорректное количество аргументов команды visits_between");
+            return;
+        }
+
+        Visit from(cmd.args[1], cmd.args[2], cmd.args[3]);
+        Visit to = cmd.argc == 7 ? Visit(cmd.args[4], cmd.args[5], cmd.args[6]) : from;
+
+        std::optional<std::vector<Visit>> visits = _col.visitsBetween(cmd.args[0], from, to);
+        if (!visits) {
+            _out.Output("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
             return;
         }
 
+        outputResult(_out, formatVisitsBetween(*visits));
+        return;
+    }
+
+    // last_visit person_no
+    if (cmd.opcode == Opcode::LastVisit) {
+        std::optional<Visit> last;
+        if (!_col.lastVisit(cmd.args[0], last))
+            _out.Output("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
+        else
+            _out.Output(formatLastVisit(last));
+        return;
+    }
+
+    // view [lines_limit] [visits_limit]
+    if (cmd.opcode == Opcode::View) {
         size_t lines_limit = OUTPUT_LIMIT;
-        if (args.size() > 1)
-            lines_limit = stoul(args[1]);
+        if (cmd.argc > 0)
+            lines_limit = cmd.args[0];
 
         size_t visits_limit = OUTPUT_LIMIT;
-        if (args.size() > 2)
-            visits_limit = stoul(args[2]);
-
-        size_t count = 0;
-        for(size_t i=1; i <= _col.getSize(); ++i) {
-            if (!_col.isRemoved(i)) {
-                const Person & item = _col.getPerson(i);
-
-                if (count < lines_limit) {
-                    _out.Output("[" + std::to_string(i) + "] "
-                            + item.getAlias() + " "
-                            );
-
-                    size_t visits_count = 0;
-                    for(const Visit & v : item.getVisits()) {
-                        if (visits_count < visits_limit)
-                            _out.Output("\t" + std::to_string(v.getDay()) + "." + std::to_string(v.getMonth()) + "." + std::to_string(v.getYear()));
-                        visits_count ++;
-                    }
-
-                    if (visits_count >= visits_limit)
-                        _out.Output("\t... " + std::to_string(visits_count) + " визитов");
-                }
-                else if (count == lines_limit)
-                    _out.Output("Выведено первые " + std::to_string(lines_limit) + " строк");
-                count ++;
-            }
+        if (cmd.argc > 1)
+            visits_limit = cmd.args[1];
+
+        // Выводятся первые lines_limit посетителей снимка: части форматируются
+        // параллельно и выводятся по порядку
+        // Результат запоминается в снимке: повторный запрос до изменения коллекции
+        // только выводит его
+        std::shared_ptr<const CollectionSnapshot> snapshot = _col.snapshot();
+
+        std::string key = queryKey(cmd.opcode, {lines_limit, visits_limit});
+        if (std::shared_ptr<const QueryResult> cached = snapshot->cachedResult(key)) {
+            outputResult(_out, *cached);
+            return;
         }
 
-        _out.Output("Количество элементов в коллекции: " + std::to_string(count));
+        auto format = [&](size_t begin, size_t end) { return formatPersons(*snapshot, begin, end, visits_limit); };
+
+        std::string text = scan<std::string>(std::min(lines_limit, snapshot->size()), format, joinLines);
+        auto result = std::make_shared<const QueryResult>(viewResult(std::move(text), snapshot->size(), lines_limit));
+        snapshot->cacheResult(key, result);
+        outputResult(_out, *result);
         return;
     }
 
     // report [lines_limit]
-    if (args[0] == "rp" || args[0] == "report") {
-        if (args.size() > 2) {
-            _out.Output("Некорректное количество аргументов команды view");
+    if (cmd.opcode == Opcode::Report) {
+        size_t lines_limit = OUTPUT_LIMIT;
+        if (cmd.argc > 0)
+            lines_limit = cmd.args[0];
+
+        // Части снимка отбирают не больше lines_limit лучших посетителей,
+        // затем отобранные списки сливаются
+        std::shared_ptr<const CollectionSnapshot> snapshot = _col.snapshot();
+
+        std::string key = queryKey(cmd.opcode, {lines_limit});
+        if (std::shared_ptr<const QueryResult> cached = snapshot->cachedResult(key)) {
+            outputResult(_out, *cached);
             return;
         }
 
-        size_t lines_limit = OUTPUT_LIMIT;
-        if (args.size() == 2)
-            lines_limit = stoul(args[1]);
+        auto select = [&](size_t begin, size_t end) { return selectReport(*snapshot, begin, end, lines_limit); };
+        auto merge  = [&](ReportPart a, ReportPart b) { return mergeReport(std::move(a), std::move(b), lines_limit); };
+
+        ReportPart report = scan<ReportPart>(snapshot->size(), select, merge);
+        auto result = std::make_shared<const QueryResult>(reportResult(report, lines_limit, snapshot->collectionSize()));
+        snapshot->cacheResult(key, result);
+        outputResult(_out, *result);
+        return;
+    }
+}
 
-        std::vector<std::pair<size_t,std::string>> report_set;
+tp::Task<void> Application::workAsync()
+{
+    if (!prepare())
+        co_return;
 
-        for(size_t i=1; i <= _col.getSize(); ++i) {
-            if (!_col.isRemoved(i)) {
-                const Person & p = _col.getPerson(i);
+    // Время выполнения включает ожидание блокировок и очереди пула
+    tp::ScopedLatency latency(commandSeries(_command.opcode).series);
 
-                /// @todo Использование getVisits(), чтобы получить количество элементов не оптимально, 
-                /// т.к. визиты каждый раз копируются во временный массив, а делать по ссылке нельзя.
-                /// Нужно сделать метод в Person для получения количества визитов у посетителя
-                if (p.getVisits().size() > 0)
-                    report_set.push_back({p.getVisits().size(),p.getAlias()});
-            }
+    co_await executeAsync();
+}
+
+tp::Task<void> Application::executeAsync()
+{
+    const Command & cmd = _command;
+
+    // count
+    if (cmd.opcode == Opcode::Count) {
+        _out.Output(std::to_string(co_await _col.getSizeAsync()));
+        co_return;
+    }
+
+    // add alias
+    if (cmd.opcode == Opcode::Add) {
+        co_await _col.addItemAsync(Person(cmd.alias));
+        co_return;
+    }
+
+    // add_visit person_no year month day
+    if (cmd.opcode == Opcode::AddVisit) {
+        // Список инициализации в выражении co_await GCC 12 не компилирует
+        std::vector<Visit> visits(1, Visit(cmd.args[1],cmd.args[2],cmd.args[3]));
+        if (!co_await _col.addVisitsAsync(cmd.args[0], std::move(visits)))
+            _out.Output("Недопустимый индекс посетителя " + std::to_string(cmd.args[0]));
+        co_return;
+    }
+
+    // remove person_no
+    if (cmd.opcode == Opcode::Remove) {
+        co_await _col.removeItemAsync(cmd.args[0]);
+        co_return;
+    }
+
+    // update person_no alias
+    if (cmd.opcode == Opcode::Update) {
+        co_await _col.setAliasAsync(cmd.args[0], cmd.alias);
+        co_return;
+    }
+
+    // view [lines_limit] [visits_limit]
+    if (cmd.opcode == Opcode::View) {
+        size_t lines_limit  = cmd.argc > 0 ? cmd.args[0] : OUTPUT_LIMIT;
+        size_t visits_limit = cmd.argc > 1 ? cmd.args[1] : OUTPUT_LIMIT;
+
+        std::shared_ptr<const CollectionSnapshot> snapshot = co_await _col.snapshotAsync();
+
+        std::string key = queryKey(cmd.opcode, {lines_limit, visits_limit});
+        if (std::shared_ptr<const QueryResult> cached = snapshot->cachedResult(key)) {
+            outputResult(_out, *cached);
+            co_return;
         }
 
-        sort(report_set.begin(), report_set.end(),
-             [](std::pair<size_t,std::string> p1, std::pair<size_t,std::string> p2){
-                return p1.first > p2.first;
-            });
+        auto format = [&](size_t begin, size_t end) { return formatPersons(*snapshot, begin, end, visits_limit); };
 
-        size_t count = 0;
-        for(const auto & [quantity,alias] : report_set) {
-            if (count < lines_limit) 
-                _out.Output(alias + " " + std::to_string(quantity));
-            else if (count == lines_limit) {
-                _out.Output("Выведено первые " + std::to_string(lines_limit) + " строк");
-                break;
-            }
-            count ++;
+        std::string text = co_await scanAsync<std::string>(std::min(lines_limit, snapshot->size()), format, joinLines);
+        auto result = std::make_shared<const QueryResult>(viewResult(std::move(text), snapshot->size(), lines_limit));
+        snapshot->cacheResult(key, result);
+        outputResult(_out, *result);
+        co_return;
+    }
+
+    // report [lines_limit]
+    if (cmd.opcode == Opcode::Report) {
+        size_t lines_limit = cmd.argc > 0 ? cmd.args[0] : OUTPUT_LIMIT;
+
+        std::shared_ptr<const CollectionSnapshot> snapshot = co_await _col.snapshotAsync();
+
+        std::string key = queryKey(cmd.opcode, {lines_limit});
+        if (std::shared_ptr<const QueryResult> cached = snapshot->cachedResult(key)) {
+            outputResult(_out, *cached);
+            co_return;
         }
-        _out.Output("Итого количество посетителей " + std::to_string(report_set.size()) + 
-                    " из " + std::to_string(_col.getSize()) + " зарегистрировавшихся");
+
+        auto select = [&](size_t begin, size_t end) { return selectReport(*snapshot, begin, end, lines_limit); };
+        auto merge  = [&](ReportPart a, ReportPart b) { return mergeReport(std::move(a), std::move(b), lines_limit); };
+
+        ReportPart report = co_await scanAsync<ReportPart>(snapshot->size(), select, merge);
+        auto result = std::make_shared<const QueryResult>(reportResult(report, lines_limit, snapshot->collectionSize()));
+        snapshot->cacheResult(key, result);
+        outputResult(_out, *result);
+        co_return;
+    }
+
+    // Сохранение, импорт, уплотнение, visited, visits_between и last_visit
+    // выполняются как обычно, удерживая поток
+    execute();
+}
+
+VisitCoalescer::VisitCoalescer(ItemCollector & col, const IOutput & out, tp::ThreadPool * pool, Submit submit, size_t window)
+    : _col(col)
+    , _out(out)
+    , _pool(pool)
+    , _submit(submit)
+    , _window(std::max<size_t>(window, 1))
+{
+    _indices.reserve(_window);
+    _visits.reserve(_window);
+}
+
+void VisitCoalescer::add(const std::string & line)
+{
+    std::optional<std::pair<size_t,Visit>> visit = parseAddVisit(line);
+    if (!visit) {
+        flush();
+        _submit(new Application(_col, line, _out, _pool));
         return;
     }
 
-    _out.Output("Недопустимая команда '" + args[0] + "'");
-    return;
+    _indices.push_back(visit->first);
+    _visits.push_back(visit->second);
+    if (_indices.size() >= _window)
+        flush();
+}
+
+void VisitCoalescer::add(const WorkloadRecord & record)
+{
+    if (record.opcode != Opcode::AddVisit || record.argc != 4) {
+        flush();
+        _submit(new Application(_col, record, _out, _pool));
+        return;
+    }
+
+    _indices.push_back(static_cast<size_t>(record.args[0]));
+    _visits.push_back(Visit(static_cast<int>(record.args[1]), static_cast<int>(record.args[2]), static_cast<int>(record.args[3])));
+    if (_indices.size() >= _window)
+        flush();
+}
+
+void VisitCoalescer::flush()
+{
+    if (_indices.empty())
+        return;
+
+    // Устойчивая сортировка сохраняет порядок визитов каждого посетителя
+    std::vector<size_t> order(_indices.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return _indices[a] < _indices[b]; });
+
+    // Группы одного посетителя не делятся между задачами
+    for(size_t begin = 0, end; begin < order.size(); begin = end) {
+        end = std::min(begin + COALESCED_TASK_SIZE, order.size());
+        while(end < order.size() && _indices[order[end]] == _indices[order[end-1]])
+            ++end;
+
+        std::vector<size_t> indices;
+        std::vector<Visit>  visits;
+        indices.reserve(end - begin);
+        visits.reserve(end - begin);
+        for(size_t i=begin; i < end; ++i) {
+            indices.push_back(_indices[order[i]]);
+            visits.push_back(_visits[order[i]]);
+        }
+
+        _submit(new AddVisitsTask(_col, _out, std::move(indices), std::move(visits)));
+    }
+
+    _indices.clear();
+    _visits.clear();
 }
 
 std::vector<std::string> Application::split(const std::string & str)
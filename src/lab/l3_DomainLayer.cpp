@@ -1,91 +1,1343 @@
 #include "hw/l3_DomainLayer.h"
+#include "hw/l4_BinaryWorkload.h"
+#include "tp/ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+namespace
+{
+    /// Заголовок области версии коллекции в разделяемой памяти, см. SharedCollectionView
+    struct SharedCollectionHeader
+    {
+        uint64_t size;
+        uint64_t max_index;
+        uint64_t generation;
+        uint64_t count;
+    };
+
+    struct SharedPersonRecord
+    {
+        uint64_t index;
+        uint64_t alias_offset;
+        uint64_t alias_length;
+        uint64_t visits_offset;
+        uint64_t visit_count;
+    };
+
+    // Визиты записываются в сегмент и читаются из него как есть
+    static_assert(std::is_trivially_copyable_v<Visit> && std::is_standard_layout_v<Visit>);
+
+    size_t alignVisits(size_t offset)
+    {
+        return (offset + alignof(Visit) - 1) / alignof(Visit) * alignof(Visit);
+    }
+
+    // Номер дня от 1970-01-01 по пролептическому григорианскому календарю
+    // (алгоритм days_from_civil Говарда Хиннанта)
+    int64_t daysFromCivil(int64_t y, int64_t m, int64_t d)
+    {
+        y -= m <= 2;
+        int64_t era = (y >= 0 ? y : y - 399) / 400;
+        int64_t yoe = y - era * 400;
+        int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + doe - 719468;
+    }
+
+    Visit civilFromDays(int64_t z)
+    {
+        z += 719468;
+        int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+        int64_t doe = z - era * 146097;
+        int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        int64_t mp  = (5 * doy + 2) / 153;
+        int64_t d   = doy - (153 * mp + 2) / 5 + 1;
+        int64_t m   = mp + (mp < 10 ? 3 : -9);
+        return Visit(static_cast<int>(yoe + era * 400 + (m <= 2)), static_cast<int>(m), static_cast<int>(d));
+    }
+
+    // Визит, который можно однозначно записать номером дня
+    bool isCalendarDate(const Visit & v)
+    {
+        static const int days_in_month[] = {31,29,31,30,31,30,31,31,30,31,30,31};
+
+        if (v.getYear() < -1000000 || v.getYear() > 1000000 || v.getMonth() < 1 || v.getMonth() > 12 || v.getDay() < 1)
+            return false;
+        if (v.getDay() > days_in_month[v.getMonth() - 1])
+            return false;
+
+        bool leap = (v.getYear() % 4 == 0 && v.getYear() % 100 != 0) || v.getYear() % 400 == 0;
+        return v.getMonth() != 2 || v.getDay() < 29 || leap;
+    }
+
+    // Защита от выделения памяти по испорченному счётчику
+    const size_t MAX_RESERVE = 1 << 16;
+
+    /// Вид записи файла страниц, её первый байт (см. Person::writePage)
+    enum class PageRecord : uint8_t
+    {
+        Data      = 0,      ///< далее запись Person::writeRecord, порядок визитов в ней совпадает с порядком посетителя
+        Unordered = 1,      ///< далее псевдоним, количество визитов и визиты тройками varint(zigzag) в порядке посетителя
+    };
+
+    // Визиты - календарные даты по неубыванию, т.е. writeRecord их не переставит
+    bool inRecordOrder(std::span<const Visit> visits)
+    {
+        int64_t previous = std::numeric_limits<int64_t>::min();
+        for(const Visit & v : visits) {
+            if (!isCalendarDate(v))
+                return false;
+
+            int64_t day = daysFromCivil(v.getYear(), v.getMonth(), v.getDay());
+            if (day < previous)
+                return false;
+            previous = day;
+        }
+        return true;
+    }
+
+    // Неупорядоченных визитов в конце блока, после которых они сливаются с sorted
+    // упорядоченными. Слияние стоит O(sorted), просмотр конца блока - O(предела),
+    // поэтому предел растёт как корень из sorted, и визит, добавленный не по порядку
+    // дат, стоит O(sqrt(n)), а не O(n)
+    size_t unsortedLimit(size_t sorted)
+    {
+        size_t limit = Person::MIN_UNSORTED_VISITS;
+        while(limit * limit < sorted)
+            limit *= 2;
+        return limit;
+    }
+}
+
+namespace
+{
+    /// Наименьший размер части файла CSV при параллельном разборе
+    const size_t IMPORT_GRAIN = 1 << 20;
+
+    /**
+     * @brief Часть файла импорта: посетители из строк, начинающихся в части
+     *
+     */
+    struct ImportPart
+    {
+        std::vector<Person> persons;
+        size_t              lines      = 0;
+        size_t              error_line = 0;     ///< номер строки в части (с 1)
+    };
+
+    bool parseCsvLine(std::string_view line, std::vector<Person> & persons)
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty())
+            return true;
+
+        size_t           comma = line.find(',');
+        std::string_view alias = line.substr(0, comma);
+        if (alias.empty() || alias.size() > MAX_NAME_LENGTH)
+            return false;
+
+        std::vector<Visit> visits;
+        int                date[3];
+        size_t             fields = 0;
+
+        while(comma != std::string_view::npos) {
+            size_t           next  = line.find(',', comma + 1);
+            std::string_view token = line.substr(comma + 1, next == std::string_view::npos ? next : next - comma - 1);
+
+            auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), date[fields]);
+            if (ec != std::errc() || end != token.data() + token.size())
+                return false;
+
+            if (++fields == 3) {
+                visits.emplace_back(date[0], date[1], date[2]);
+                fields = 0;
+            }
+            comma = next;
+        }
+
+        if (fields != 0)
+            return false;
+
+        persons.emplace_back(std::string(alias), std::move(visits));
+        return true;
+    }
+
+    /// Разбор строк CSV, начинающихся в [begin, end)
+    ImportPart parseCsv(const char * data, size_t size, size_t begin, size_t end)
+    {
+        ImportPart part;
+
+        size_t pos = begin;
+        if (pos > 0 && data[pos-1] != '\n') {
+            const char * nl = static_cast<const char *>(std::memchr(data + pos, '\n', size - pos));
+            pos = nl == nullptr ? size : nl - data + 1;
+        }
+
+        while(pos < end) {
+            const char * nl       = static_cast<const char *>(std::memchr(data + pos, '\n', size - pos));
+            size_t       line_end = nl == nullptr ? size : nl - data;
+
+            part.lines ++;
+            if (!parseCsvLine({data + pos, line_end - pos}, part.persons)) {
+                part.error_line = part.lines;
+                break;
+            }
+            pos = line_end + 1;
+        }
+
+        return part;
+    }
+
+    ImportPart mergeImportParts(ImportPart a, ImportPart b)
+    {
+        if (a.error_line != 0)
+            return a;
+
+        if (b.error_line != 0)
+            a.error_line = a.lines + b.error_line;
+
+        a.lines += b.lines;
+        a.persons.reserve(a.persons.size() + b.persons.size());
+        for(Person & person : b.persons)
+            a.persons.push_back(std::move(person));
+        return a;
+    }
+}
+
+namespace
+{
+    std::atomic<std::pmr::memory_resource *> domain_resource {std::pmr::new_delete_resource()};
+
+    /// Блок визитов с счётчиком ссылок в одном выделении из источника блока
+    std::shared_ptr<VisitBlock> makeVisitBlock(VisitBlock visits)
+    {
+        std::pmr::polymorphic_allocator<VisitBlock> allocator(visits.get_allocator().resource());
+        return std::allocate_shared<VisitBlock>(allocator, std::move(visits));
+    }
+
+    std::shared_ptr<const std::string> makeAlias(const std::string & alias, std::pmr::memory_resource * resource)
+    {
+        return std::allocate_shared<std::string>(std::pmr::polymorphic_allocator<std::string>(resource), alias);
+    }
+}
+
+std::pmr::memory_resource * domainResource()
+{
+    return domain_resource.load(std::memory_order_relaxed);
+}
+
+void setDomainResource(std::pmr::memory_resource * resource)
+{
+    domain_resource.store(resource != nullptr ? resource : std::pmr::new_delete_resource(), std::memory_order_relaxed);
+}
+
+const tp::LockSite & Person::lockSite()
+{
+    static const tp::LockSite site("lock.person");
+    return site;
+}
 
 bool Person::invariant() const
 {
-    return !_alias.empty();
+    return !_alias->empty();
 }
 
-Person::Person(const std::string & alias)
-    : _alias(alias)
+Person::Person(const std::string & alias, std::pmr::memory_resource * resource)
+    : _alias(makeAlias(alias, resource))
+    , _visits(makeVisitBlock(VisitBlock(resource)))
 {
     assert(invariant());
 }
 
-Person::Person(const std::string &alias, std::vector<Visit> visits)
-    : _alias(alias)
-    , _visits(visits)
+Person::Person(const std::string &alias, std::span<const Visit> visits, std::pmr::memory_resource * resource)
+    : _alias(makeAlias(alias, resource))
+    , _visits(makeVisitBlock(VisitBlock(visits.begin(), visits.end(), resource)))
 {
     assert(invariant());
 }
 
-const std::string &Person::getAlias() const
+Person::Person(const std::string & alias, VisitBlock visits)
+    : _alias(makeAlias(alias, visits.get_allocator().resource()))
+    , _visits(makeVisitBlock(std::move(visits)))
+{
+    assert(invariant());
+}
+
+Person::Person(Person && p) noexcept
+    : _alias(std::move(p._alias))
+    , _visits(std::move(p._visits))
+    , _spill(std::exchange(p._spill, nullptr))
+    , _page(std::move(p._page))
+    , _referenced(p._referenced)
+    , _order(p._order)
+    , _sorted(p._sorted)
+{
+}
+
+Person::~Person()
+{
+    if (_spill != nullptr && _alias != nullptr)
+        _spill->release(residentBytesLocked());
+}
+
+size_t Person::residentBytesLocked() const
+{
+    // Псевдоним и блок визитов выделены вместе со счётчиками ссылок, см. makeAlias и makeVisitBlock
+    const size_t control_block = 2 * sizeof(void *);
+
+    return 2 * control_block + sizeof(std::string) + _alias->capacity()
+         + sizeof(VisitBlock) + _visits->capacity() * sizeof(Visit);
+}
+
+Person Person::readPage(const SpilledRecord & page)
+{
+    std::optional<Person> copy = page.withRecord([](std::string_view record) -> std::optional<Person> {
+        ByteReader in(record.data(), record.size());
+        if (static_cast<PageRecord>(in.getFixed<uint8_t>()) == PageRecord::Data)
+            return read(in, DATA_FORMAT_CURRENT);
+
+        std::string alias (in.getString(record.size()));
+        uint64_t    count = in.getVarint();
+
+        VisitBlock visits(domainResource());
+        visits.reserve(std::min<uint64_t>(count, MAX_RESERVE));
+        for(uint64_t i=0; i < count && !in.error(); ++i) {
+            int year  = static_cast<int>(zigzagDecode(in.getVarint()));
+            int month = static_cast<int>(zigzagDecode(in.getVarint()));
+            int day   = static_cast<int>(zigzagDecode(in.getVarint()));
+            visits.push_back(Visit(year, month, day));
+        }
+
+        if (in.error())
+            return std::nullopt;
+        return Person(alias, std::move(visits));
+    });
+
+    // Запись сделана этим же процессом (evict) и не может быть повреждена
+    assert(copy.has_value());
+    return std::move(*copy);
+}
+
+bool Person::loadLocked()
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("person.load");
+
+    _referenced = true;
+    if (_alias != nullptr)
+        return false;
+
+    tp::ScopedLatency latency(series);
+
+    Person copy = readPageLocked();
+    _alias  = std::move(copy._alias);
+    _visits = std::move(copy._visits);
+
+    // Запись хранит визиты в прежнем порядке, а граница упорядоченного начала
+    // блока (_sorted) при вытеснении не сохраняется
+    sortLocked();
+    _spill->charge(residentBytesLocked());
+    return true;
+}
+
+size_t Person::beginChangeLocked()
+{
+    loadLocked();
+
+    // Запись освобождается, когда её не используют и зафиксированные копии
+    _page.reset();
+    return _spill != nullptr ? residentBytesLocked() : 0;
+}
+
+void Person::endChangeLocked(size_t resident_before)
+{
+    if (_spill == nullptr)
+        return;
+
+    size_t resident_after = residentBytesLocked();
+    if (resident_after > resident_before)
+        _spill->charge(resident_after - resident_before);
+    else
+        _spill->release(resident_before - resident_after);
+}
+
+std::string Person::getAlias() const
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    return _alias != nullptr ? *_alias : *readPageLocked()._alias;
+}
+
+void Person::setAlias(const std::string & alias)
 {
-    return _alias;
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    size_t           resident = beginChangeLocked();
+
+    // Зафиксированные копии сохраняют прежний псевдоним
+    _alias = makeAlias(alias, _visits->get_allocator().resource());
+    endChangeLocked(resident);
 }
 
-void Person::setVisits(const std::vector<Visit> visits)
+void Person::setVisits(std::span<const Visit> visits)
 {
-    std::lock_guard locker(_visits_mutex);
-    _visits = visits;
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    size_t           resident = beginChangeLocked();
+
+    _visits = makeVisitBlock(VisitBlock(visits.begin(), visits.end(), _visits->get_allocator().resource()));
+    sortLocked();
+    endChangeLocked(resident);
 }
 
 void Person::addVisit(const Visit & visit)
 {
-    std::lock_guard locker(_visits_mutex);
-    _visits.push_back(visit);
+    addVisits({&visit, 1});
+}
+
+void Person::addVisits(std::span<const Visit> visits)
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    size_t           resident = beginChangeLocked();
+
+    reserveLocked(_visits->size() + visits.size());
+
+    if (_order == VisitOrder::Insertion)
+        _visits->insert(_visits->end(), visits.begin(), visits.end());
+    else
+        for(const Visit & v : visits)
+            insertSortedLocked(v);
+
+    endChangeLocked(resident);
+}
+
+void Person::reserveLocked(size_t needed)
+{
+    if (needed <= _visits->capacity())
+        return;
+
+    // Перераспределение памяти внутри блока переместило бы элементы,
+    // которые могут читаться из снимков, поэтому заполненный блок заменяется новым
+    size_t capacity = std::max<size_t>({4, 2 * _visits->capacity(), needed});
+    if (_order != VisitOrder::Insertion) {
+        mergeLocked(capacity);
+        return;
+    }
+
+    auto grown = makeVisitBlock(VisitBlock(_visits->get_allocator().resource()));
+    grown->reserve(capacity);
+    grown->assign(_visits->begin(), _visits->end());
+    _visits = grown;
+}
+
+void Person::insertSortedLocked(const Visit & visit)
+{
+    auto sorted_end = _visits->begin() + _sorted;
+
+    if (_order == VisitOrder::SortedUnique
+     && (std::binary_search(_visits->begin(), sorted_end, visit) || std::find(sorted_end, _visits->end(), visit) != _visits->end()))
+        return;
+
+    reserveLocked(_visits->size() + 1);
+
+    // Визит не раньше последнего упорядоченного (обычно визиты добавляются
+    // по порядку дат) продолжает упорядоченную часть
+    bool in_order = _sorted == _visits->size() && (_sorted == 0 || !(visit < _visits->back()));
+
+    _visits->push_back(visit);
+    if (in_order)
+        _sorted ++;
+    else if (_visits->size() - _sorted > unsortedLimit(_sorted))
+        mergeLocked(_visits->capacity());
+}
+
+void Person::mergeLocked(size_t capacity)
+{
+    // Блок читается из снимков без блокировки, поэтому слияние выполняется в новом блоке
+    std::vector<Visit> unsorted(_visits->begin() + _sorted, _visits->end());
+    std::sort(unsorted.begin(), unsorted.end());
+
+    auto merged = makeVisitBlock(VisitBlock(_visits->get_allocator().resource()));
+    merged->reserve(std::max(capacity, _visits->size()));
+
+    // Неупорядоченных визитов немного, упорядоченные между ними копируются отрезками
+    auto next       = _visits->cbegin();
+    auto sorted_end = _visits->cbegin() + _sorted;
+    for(const Visit & v : unsorted) {
+        auto bound = std::upper_bound(next, sorted_end, v);
+        merged->insert(merged->end(), next, bound);
+        merged->push_back(v);
+        next = bound;
+    }
+    merged->insert(merged->end(), next, sorted_end);
+
+    if (_order == VisitOrder::SortedUnique)
+        merged->erase(std::unique(merged->begin(), merged->end()), merged->end());
+
+    _visits = merged;
+    _sorted = merged->size();
+}
+
+void Person::sortLocked()
+{
+    if (_order == VisitOrder::Insertion) {
+        _sorted = 0;
+        return;
+    }
+
+    // Длина упорядоченного начала блока, при SortedUnique - без повторов
+    bool unique  = _order == VisitOrder::SortedUnique;
+    auto unorder = std::adjacent_find(_visits->begin(), _visits->end(), [&](const Visit & a, const Visit & b) {
+        return unique ? !(a < b) : b < a;
+    });
+
+    _sorted = unorder == _visits->end() ? _visits->size() : unorder - _visits->begin() + 1;
+    if (_sorted < _visits->size())
+        mergeLocked(_visits->capacity());
+}
+
+void Person::setVisitOrder(VisitOrder order)
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    size_t           resident = beginChangeLocked();
+
+    _order = order;
+    sortLocked();
+    endChangeLocked(resident);
+}
+
+std::vector<Visit> Person::visitsBetween(const Visit & from, const Visit & to) const
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    if (_alias != nullptr)
+        return selectBetween(*_visits, _sorted, from, to);
+
+    Person copy = readPageLocked();
+    return selectBetween(*copy._visits, 0, from, to);
+}
+
+std::optional<Visit> Person::lastVisit() const
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    if (_alias != nullptr)
+        return selectLast(*_visits, _sorted);
+
+    Person copy = readPageLocked();
+    return selectLast(*copy._visits, 0);
+}
+
+std::vector<Visit> Person::selectBetween(std::span<const Visit> visits, size_t sorted, const Visit & from, const Visit & to)
+{
+    std::vector<Visit> res;
+    if (to < from)
+        return res;
+
+    auto first = std::lower_bound(visits.begin(), visits.begin() + sorted, from);
+    auto last  = std::upper_bound(first, visits.begin() + sorted, to);
+    res.assign(first, last);
+
+    // Найденные среди неупорядоченных сливаются с найденными двоичным поиском
+    size_t middle = res.size();
+    std::copy_if(visits.begin() + sorted, visits.end(), std::back_inserter(res), [&](const Visit & v) {
+        return !(v < from) && !(to < v);
+    });
+    std::sort(res.begin() + middle, res.end());
+    std::inplace_merge(res.begin(), res.begin() + middle, res.end());
+    return res;
+}
+
+std::optional<Visit> Person::selectLast(std::span<const Visit> visits, size_t sorted)
+{
+    std::optional<Visit> last;
+    if (sorted > 0)
+        last = visits[sorted - 1];
+
+    for(const Visit & v : visits.subspan(sorted))
+        if (!last || *last < v)
+            last = v;
+    return last;
 }
 
 std::vector<Visit> Person::getVisits() const
 {
-    std::lock_guard locker(_visits_mutex);
-    return _visits;
+    return withVisits([](std::span<const Visit> visits) { return std::vector<Visit>(visits.begin(), visits.end()); });
+}
+
+size_t Person::visitCount() const
+{
+    return withVisits([](std::span<const Visit> visits) { return visits.size(); });
 }
 
-bool   Person::write(std::ostream& os)
+std::pair<std::shared_ptr<const VisitBlock>,size_t> Person::visitBlock() const
 {
-    writeString(os, _alias);
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    if (_alias != nullptr)
+        return {_visits, _visits->size()};
 
-    size_t number_of_visits = _visits.size();
-    writeNumber(os, number_of_visits);
+    // Вытесненный посетитель читается без возвращения в память
+    Person copy = readPageLocked();
+    size_t count = copy._visits->size();
+    return {std::move(copy._visits), count};
+}
 
-    for(const Visit & v : _visits)
-    {
-        writeNumber(os, v.getYear());
-        writeNumber(os, v.getMonth());
-        writeNumber(os, v.getDay());
+Person::Frozen Person::freeze() const
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    if (_alias != nullptr)
+        return {_alias, _visits, _visits->size(), nullptr};
+
+    // Запись вытесненного посетителя разбирается при обращении к данным копии
+    return {nullptr, nullptr, _page->visitCount(), _page};
+}
+
+void Person::attach(SpillStore * spill)
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    if (_spill != nullptr)
+        return;
+
+    _spill      = spill;
+    _referenced = true;
+    _spill->charge(residentBytesLocked());
+}
+
+void Person::detach()
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    _spill = nullptr;
+    _page.reset();
+}
+
+bool Person::resident() const
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    return _alias != nullptr;
+}
+
+bool Person::load()
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    return loadLocked();
+}
+
+bool Person::evict()
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    if (_spill == nullptr || _alias == nullptr)
+        return false;
+
+    // Запись посетителя, не изменявшегося после возвращения в память, ещё действительна
+    if (_page == nullptr) {
+        ByteWriter record;
+        writePage(record, *_alias, *_visits);
+        tp::PageFile::Ref ref = _spill->file().put(record.buffer());
+        if (ref == tp::PageFile::NO_REF)
+            return false;
+        _page = std::make_shared<const SpilledRecord>(_spill->shared_from_this(), ref, _alias->size(), _visits->size());
     }
 
-    return os.good();
+    _spill->release(residentBytesLocked());
+    _alias.reset();
+    _visits.reset();
+    _sorted = 0;
+    return true;
 }
 
+bool Person::clearReferenced()
+{
+    tp::MeasuredLock locker(_visits_mutex, lockSite());
+    return std::exchange(_referenced, false);
+}
 
-std::shared_ptr<ICollectable> ItemCollector::read(std::istream& is)
+bool   Person::write(ByteWriter & out, const Frozen & frozen)
 {
-    std::string alias       = readString(is, MAX_NAME_LENGTH);
-    size_t number_of_visits = readNumber<size_t>(is);
+    // Запись файла страниц, сделанная writeRecord, копируется без разбора
+    if (frozen.alias == nullptr) {
+        bool copied = frozen.page->withRecord([&](std::string_view record) {
+            if (static_cast<PageRecord>(record[0]) != PageRecord::Data)
+                return false;
+            out.putBytes(record.substr(1));
+            return true;
+        });
+        if (copied)
+            return true;
+    }
 
-    std::vector<Visit> v;
+    return frozen.withData([&](std::string_view alias, std::span<const Visit> visits) {
+        return writeRecord(out, alias, visits);
+    });
+}
 
-    v.reserve(number_of_visits);
-    for(size_t i=0; i < number_of_visits; ++i)
-    {
-        int year = readNumber<int>(is);
-        int month = readNumber<int>(is);
-        int day = readNumber<int>(is);
+void   Person::writePage(ByteWriter & out, std::string_view alias, std::span<const Visit> visits)
+{
+    // writeRecord упорядочивает визиты по дате, поэтому ею записываются только
+    // уже упорядоченные визиты, иначе возвращённый в память посетитель
+    // (VisitOrder::Insertion) получил бы визиты в другом порядке. Остальные
+    // записываются как есть, без разностного кодирования дат
+    if (inRecordOrder(visits)) {
+        out.putFixed(static_cast<uint8_t>(PageRecord::Data));
+        writeRecord(out, alias, visits);
+        return;
+    }
+
+    out.putFixed(static_cast<uint8_t>(PageRecord::Unordered));
+    out.putString(alias);
+    out.putVarint(visits.size());
+    for(const Visit & v : visits)
+        for(int value : {v.getYear(), v.getMonth(), v.getDay()})
+            out.putVarint(zigzagEncode(value));
+}
+
+bool   Person::writeRecord(ByteWriter & out, std::string_view alias, std::span<const Visit> visits)
+{
+    std::vector<int64_t> days;
+    std::vector<int32_t> others;
+
+    days.reserve(visits.size());
+    for(const Visit & v : visits)
+        if (isCalendarDate(v))
+            days.push_back(daysFromCivil(v.getYear(), v.getMonth(), v.getDay()));
+        else
+            others.insert(others.end(), {v.getYear(), v.getMonth(), v.getDay()});
+
+    // Визиты записываются по возрастанию даты: первый - номером дня, остальные -
+    // разностью с предыдущим, что для близких дат занимает один байт
+    std::sort(days.begin(), days.end());
+
+    out.putString(alias);
+
+    out.putVarint(days.size());
+    for(size_t i=0; i < days.size(); ++i)
+        out.putVarint(i == 0 ? zigzagEncode(days[0]) : static_cast<uint64_t>(days[i] - days[i-1]));
+
+    // Значения, не являющиеся календарными датами, сохраняются как есть
+    // массивом троек int32 (little-endian)
+    out.putVarint(others.size() / 3);
+    out.putArray<int32_t>(others);
+
+    return true;
+}
+
+
+std::optional<Person> Person::read(ByteReader & in, DataFormat format, std::pmr::memory_resource * resource)
+{
+    // Визиты читаются сразу в блок из источника посетителя
+    VisitBlock v(resource);
+
+    // Прежние форматы записаны в представлении x86-64: little-endian, int - 32 бита
+    if (format == DataFormat::Legacy || format == DataFormat::Indexed) {
+        uint16_t len = in.getFixed<uint16_t>();
+        if (len > MAX_NAME_LENGTH)
+            return std::nullopt;
+
+        std::string alias (in.getBytes(len));
+        uint64_t number_of_visits = in.getFixed<uint64_t>();
+
+        v.reserve(std::min<uint64_t>(number_of_visits, MAX_RESERVE));
+        for(uint64_t i=0; i < number_of_visits && !in.error(); ++i)
+        {
+            int year = in.getFixed<int32_t>();
+            int month = in.getFixed<int32_t>();
+            int day = in.getFixed<int32_t>();
+
+            v.push_back(Visit(year, month, day));
+        }
+
+        if (in.error())
+            return std::nullopt;
+
+        return Person(alias, std::move(v));
+    }
+
+    std::string alias (in.getString(MAX_NAME_LENGTH));
+
+    uint64_t number_of_days = in.getVarint();
+    v.reserve(std::min<uint64_t>(number_of_days, MAX_RESERVE));
+
+    int64_t day = 0;
+    for(uint64_t i=0; i < number_of_days && !in.error(); ++i) {
+        uint64_t value = in.getVarint();
+        day = i == 0 ? zigzagDecode(value) : day + static_cast<int64_t>(value);
+        v.push_back(civilFromDays(day));
+    }
+
+    uint64_t number_of_others = in.getVarint();
+
+    if (format == DataFormat::Portable) {
+        if (number_of_others > in.remaining() / (3 * sizeof(int32_t)))
+            return std::nullopt;
+
+        std::vector<int32_t> others(3 * number_of_others);
+        in.getArray(others.data(), others.size());
+        for(size_t i=0; i < others.size(); i += 3)
+            v.push_back(Visit(others[i], others[i+1], others[i+2]));
+    }
+    else
+        for(uint64_t i=0; i < number_of_others && !in.error(); ++i) {
+            int year  = static_cast<int>(zigzagDecode(in.getVarint()));
+            int month = static_cast<int>(zigzagDecode(in.getVarint()));
+            int d     = static_cast<int>(zigzagDecode(in.getVarint()));
+
+            v.push_back(Visit(year, month, d));
+        }
+
+    if (in.error())
+        return std::nullopt;
+
+    return Person(alias, std::move(v));
+}
+
+ItemCollector::~ItemCollector()
+{
+    // Посетители разрушаются коллекцией-родителем после хранилища
+    withLock([&] {
+        if (_spill != nullptr)
+            for(size_t index=1; index <= maxIndexLocked(); ++index)
+                if (Person * person = findLocked(index); person != nullptr)
+                    person->detach();
+    });
+}
+
+Person * ItemCollector::loadLocked(size_t index)
+{
+    // Место освобождается заранее, чтобы возвращённый посетитель не был вытеснен
+    // до изменения и не вернулся в память ещё раз мимо очереди вытеснения
+    evictLocked();
+
+    Person * person = findLocked(index);
+    if (person != nullptr && _spill != nullptr && person->load())
+        _clock.push_back(index);
+    return person;
+}
+
+void ItemCollector::setVisitOrder(VisitOrder order)
+{
+    withLock([&] {
+        _visit_order = order;
+
+        for(size_t index=1; index <= maxIndexLocked(); ++index)
+            if (Person * person = loadLocked(index); person != nullptr)
+                person->setVisitOrder(order);
+        touch();
+    });
+}
+
+bool ItemCollector::setMemoryBudget(const std::string & page_file_name, size_t budget)
+{
+    return withLock([&] {
+        if (_spill != nullptr)
+            return false;
+
+        auto spill = std::make_shared<SpillStore>(page_file_name, budget);
+        if (!spill->valid())
+            return false;
+        _spill = std::move(spill);
+
+        for(size_t index=1; index <= maxIndexLocked(); ++index)
+            if (Person * person = findLocked(index); person != nullptr)
+                itemStoredLocked(index, *person);
+        return true;
+    });
+}
+
+void ItemCollector::evictLocked()
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("collector.evict");
+
+    if (_spill == nullptr || _spill->resident() <= _spill->budget())
+        return;
+
+    tp::ScopedLatency latency(series);
+
+    size_t target  = _spill->budget() / 8 * 7;
+    size_t evicted = 0;
+
+    // Посетители в памяти попадают в очередь при размещении (itemStoredLocked) и при
+    // возвращении в память (loadLocked), поэтому опустевшая очередь означает,
+    // что остаток бюджета занят частями снимков
+    while(_spill->resident() > target && !_clock.empty()) {
+        size_t index = _clock.front();
+        _clock.pop_front();
+
+        Person * person = findLocked(index);
+        if (person == nullptr || !person->resident())
+            continue;
+
+        if (person->clearReferenced()) {
+            _clock.push_back(index);
+            continue;
+        }
+
+        if (!person->evict()) {
+            _clock.push_back(index);
+            break;
+        }
+        evicted ++;
+
+        // Части снимка удерживали бы в памяти вытесненные данные
+        if (size_t slab = index / SLAB_SIZE; slab < _chunks.size())
+            _chunks[slab].reset();
+    }
+
+    if (evicted > 0)
+        _snapshot.reset();
+}
+
+std::vector<Person> ItemCollector::readImport(const std::string & file_name, tp::ThreadPool * pool, ImportResult & result)
+{
+    std::vector<Person> persons;
+
+    MappedFile mapped (file_name);
+    if (!mapped.valid())
+        return persons;
+    result.opened = true;
+
+    if (mapped.size() >= 6 && std::memcmp(mapped.data(), DATA_FILE_MAGIC, 6) == 0) {
+        // Файл данных загружается во временную коллекцию, её посетители переносятся без копирования
+        ItemCollector source (false);
+        if (!source.loadCollection(file_name))
+            return persons;
+
+        source.withLock([&] {
+            source.forEachLocked([&](size_t, Person & person) {
+                persons.push_back(std::move(person));
+            });
+        });
+    }
+    else {
+        auto parse = [&](size_t begin, size_t end) {
+            return parseCsv(mapped.data(), mapped.size(), begin, end);
+        };
+
+        ImportPart all = pool == nullptr
+                       ? parse(0, mapped.size())
+                       : pool->parallel_reduce(mapped.size(), IMPORT_GRAIN, ImportPart(), parse, mergeImportParts);
+
+        if (all.error_line != 0) {
+            result.error_line = all.error_line;
+            return persons;
+        }
+        persons = std::move(all.persons);
+    }
+
+    result.valid = true;
+    result.count = persons.size();
+    return persons;
+}
+
+ImportResult ItemCollector::importFile(const std::string & file_name, tp::ThreadPool * pool)
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("collector.import");
+
+    tp::ScopedLatency   latency(series);
+    ImportResult        result;
+    std::vector<Person> persons = readImport(file_name, pool, result);
+
+    if (result.valid) {
+        result.first = reserveIndices(persons.size());
+        publishItems(result.first, std::move(persons));
+    }
+    return result;
+}
+
+ImportResult ItemCollector::importFile(const std::string & file_name, tp::ThreadPool * pool, const IndexShard & shard, size_t first)
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("collector.import");
+
+    tp::ScopedLatency   latency(series);
+    ImportResult        result;
+    std::vector<Person>  persons = readImport(file_name, pool, result);
+
+    if (!result.valid)
+        return result;
+    result.first = first;
+
+    // Посетители сегмента идут в файле через shard.count, их локальные индексы - подряд
+    size_t              offset = (shard.shard + shard.count - (first - 1) % shard.count) % shard.count;
+    std::vector<Person> selected;
+    selected.reserve(persons.size() / shard.count + 1);
+    for(size_t i=offset; i < persons.size(); i += shard.count)
+        selected.push_back(std::move(persons[i]));
+
+    if (!selected.empty())
+        publishItems(shard.toLocal(first + offset), std::move(selected));
+    return result;
+}
+
+bool ItemCollector::addVisit(size_t index, const Visit & visit)
+{
+    return addVisits(index, {&visit, 1});
+}
+
+bool ItemCollector::addVisits(size_t index, std::span<const Visit> visits)
+{
+    return withLock([&] { return addVisitsLocked(index, visits); });
+}
+
+tp::Task<bool> ItemCollector::addVisitsAsync(size_t index, std::vector<Visit> visits)
+{
+    return withLockAsync([this, index, visits = std::move(visits)] { return addVisitsLocked(index, visits); });
+}
+
+bool ItemCollector::addVisitsLocked(size_t index, std::span<const Visit> visits)
+{
+    Person * person = loadLocked(index);
+    if (person == nullptr)
+        return false;
+
+    person->addVisits(visits);
+    if (!removedLocked(index))
+        indexVisitsLocked(index, visits, true);
+    touch(index);
+    return true;
+}
+
+bool ItemCollector::setAlias(size_t index, const std::string & alias)
+{
+    return withLock([&] {
+        Person * person = loadLocked(index);
+        if (person == nullptr)
+            return false;
+
+        person->setAlias(alias);
+        touch(index);
+        return true;
+    });
+}
+
+tp::Task<bool> ItemCollector::setAliasAsync(size_t index, std::string alias)
+{
+    return withLockAsync([this, index, alias = std::move(alias)] {
+        Person * person = loadLocked(index);
+        if (person == nullptr)
+            return false;
+
+        person->setAlias(alias);
+        touch(index);
+        return true;
+    });
+}
+
+bool ItemCollector::setVisits(size_t index, std::vector<Visit> visits)
+{
+    return withLock([&] {
+        Person * person = loadLocked(index);
+        if (person == nullptr)
+            return false;
+
+        bool indexed = !removedLocked(index);
+
+        auto reindex = [&](bool add) {
+            if (indexed)
+                person->withVisits([&](std::span<const Visit> v) { indexVisitsLocked(index, v, add); });
+        };
+
+        reindex(false);
+        person->setVisits(visits);
+        reindex(true);
+        touch(index);
+        return true;
+    });
+}
 
-        v.push_back(Visit(year, month, day));
+std::vector<std::pair<size_t,std::string>> ItemCollector::visited(const Visit & from, const Visit & to) const
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("collector.visited");
+
+    return withLock([&] {
+        tp::ScopedLatency latency(series);
+
+        std::vector<std::pair<size_t,std::string>> persons;
+        if (to < from)
+            return persons;
+
+        auto first = _visit_index.lower_bound(from);
+        auto last  = _visit_index.upper_bound(to);
+
+        // Для одной даты объединение не нужно
+        tp::Bitmap         merged;
+        const tp::Bitmap * result = &merged;
+        if (first != last && std::next(first) == last)
+            result = &first->second;
+        else
+            for(auto it = first; it != last; ++it)
+                merged |= it->second;
+
+        persons.reserve(result->cardinality());
+        result->forEach([&](uint64_t index) {
+            persons.emplace_back(index, findLocked(index)->getAlias());
+        });
+        return persons;
+    });
+}
+
+std::optional<std::vector<Visit>> ItemCollector::visitsBetween(size_t index, const Visit & from, const Visit & to) const
+{
+    return withLock([&]() -> std::optional<std::vector<Visit>> {
+        const Person * person = findLocked(index);
+        if (person == nullptr || removedLocked(index))
+            return std::nullopt;
+        return person->visitsBetween(from, to);
+    });
+}
+
+bool ItemCollector::lastVisit(size_t index, std::optional<Visit> & last) const
+{
+    return withLock([&] {
+        const Person * person = findLocked(index);
+        if (person == nullptr || removedLocked(index))
+            return false;
+        last = person->lastVisit();
+        return true;
+    });
+}
+
+void ItemCollector::indexVisitsLocked(size_t index, std::span<const Visit> visits, bool add)
+{
+    if (!_index_visits)
+        return;
+
+    for(const Visit & v : visits) {
+        if (add) {
+            _visit_index[v].add(index);
+            continue;
+        }
+
+        auto it = _visit_index.find(v);
+        if (it != _visit_index.end() && it->second.remove(index) && it->second.empty())
+            _visit_index.erase(it);
     }
+}
+
+void ItemCollector::itemStoredLocked(size_t index, Person & person)
+{
+    if (_visit_order != VisitOrder::Insertion)
+        person.setVisitOrder(_visit_order);
 
-    std::shared_ptr<ICollectable> p = std::make_shared<Person>(alias, v);
+    if (_spill == nullptr)
+        return;
 
-    return p;
+    person.attach(_spill.get());
+    _clock.push_back(index);
+    evictLocked();
+}
+
+void ItemCollector::itemAddedLocked(size_t index, const Person & person)
+{
+    person.withVisits([&](std::span<const Visit> v) { indexVisitsLocked(index, v, true); });
+}
+
+void ItemCollector::itemRemovedLocked(size_t index, const Person & person)
+{
+    person.withVisits([&](std::span<const Visit> v) { indexVisitsLocked(index, v, false); });
 }
 
-Person & ItemCollector::getPerson(size_t index)
+std::shared_ptr<const CollectionSnapshot> ItemCollector::snapshot() const
 {
-    Person * p = static_cast<Person *>(getItem(index).get());
+    return withLock([&] { return snapshotLocked(); });
+}
+
+tp::Task<std::shared_ptr<const CollectionSnapshot>> ItemCollector::snapshotAsync() const
+{
+    return withLockAsync([this] { return snapshotLocked(); });
+}
+
+std::shared_ptr<const CollectionSnapshot> ItemCollector::snapshotLocked() const
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("collector.snapshot");
+
+    if (_snapshot != nullptr && _snapshot->generation() == generationLocked())
+        return _snapshot;
+
+    tp::ScopedLatency latency(series);
+
+    // Заново фиксируются только слябы, изменённые после прошлого снимка
+    size_t slabs = slabCountLocked();
+    _chunks.resize(slabs);
+    _chunk_generations.resize(slabs);
+
+    for(size_t s=0; s < slabs; ++s) {
+        if (_chunks[s] != nullptr && _chunk_generations[s] == slabGenerationLocked(s))
+            continue;
+
+        auto chunk = std::make_unique<SnapshotChunk>();
+        forEachInSlabLocked(s, [&](size_t index, const Person & person) {
+            chunk->emplace_back(index, person.freeze());
+        });
+
+        _chunks[s]            = shareChunkLocked(std::move(chunk));
+        _chunk_generations[s] = slabGenerationLocked(s);
+    }
+
+    _snapshot = std::make_shared<const CollectionSnapshot>(generationLocked(), sizeLocked(), maxIndexLocked(), _chunks);
+    return _snapshot;
+}
+
+std::shared_ptr<const SnapshotChunk> ItemCollector::shareChunkLocked(std::unique_ptr<SnapshotChunk> chunk) const
+{
+    if (_spill == nullptr)
+        return chunk;
+
+    // Часть снимка живёт, пока на неё ссылаются снимки, и всё это время учитывается хранилищем
+    size_t bytes = sizeof(SnapshotChunk) + chunk->capacity() * sizeof(PersonView);
+    _spill->charge(bytes);
+    return std::shared_ptr<const SnapshotChunk>(chunk.release(), [spill = _spill, bytes](const SnapshotChunk * c) {
+        delete c;
+        spill->release(bytes);
+    });
+}
+
+CollectionSnapshot::CollectionSnapshot(uint64_t generation, size_t collection_size, size_t max_index,
+                                       const std::vector<std::shared_ptr<const SnapshotChunk>> & chunks)
+    : _generation(generation)
+    , _collection_size(collection_size)
+    , _max_index(max_index)
+{
+    for(const std::shared_ptr<const SnapshotChunk> & chunk : chunks)
+        if (chunk != nullptr && !chunk->empty()) {
+            _offsets.push_back(_size);
+            _chunks.push_back(chunk);
+            _size += chunk->size();
+        }
+}
+
+const PersonView & CollectionSnapshot::operator [] (size_t i) const
+{
+    size_t chunk = std::upper_bound(_offsets.begin(), _offsets.end(), i) - _offsets.begin() - 1;
+    return (*_chunks[chunk])[i - _offsets[chunk]];
+}
+
+const PersonView * CollectionSnapshot::find(size_t index) const
+{
+    // Части и посетители в них упорядочены по индексам
+    auto chunk = std::upper_bound(_chunks.begin(), _chunks.end(), index,
+        [](size_t index, const std::shared_ptr<const SnapshotChunk> & chunk) { return index < chunk->front().index(); });
+    if (chunk == _chunks.begin())
+        return nullptr;
+
+    const SnapshotChunk & persons = **std::prev(chunk);
+    auto it = std::lower_bound(persons.begin(), persons.end(), index,
+        [](const PersonView & person, size_t index) { return person.index() < index; });
+    return it != persons.end() && it->index() == index ? &*it : nullptr;
+}
+
+std::shared_ptr<const QueryResult> CollectionSnapshot::cachedResult(const std::string & key) const
+{
+    std::lock_guard locker(_results_mutex);
+
+    auto it = _results.find(key);
+    return it == _results.end() ? nullptr : it->second;
+}
+
+void CollectionSnapshot::cacheResult(const std::string & key, std::shared_ptr<const QueryResult> result) const
+{
+    size_t bytes = key.size();
+    for(const std::string & line : *result)
+        bytes += line.size();
+
+    std::lock_guard locker(_results_mutex);
+
+    if (_results.size() >= MAX_CACHED_RESULTS || _results_bytes + bytes > MAX_CACHED_BYTES)
+        return;
+
+    // Одинаковые запросы могли выполниться одновременно, сохраняется первый результат
+    if (_results.emplace(key, std::move(result)).second)
+        _results_bytes += bytes;
+}
+
+bool ItemCollector::publish(SharedSegment & segment) const
+{
+    static const size_t series = tp::Statistics::instance().registerSeries("collector.publish");
+
+    // Все поля заголовка берутся из одного снимка, иначе параллельные add/remove
+    // между блокировками дали бы заголовок, не согласованный с записями
+    std::shared_ptr<const CollectionSnapshot> snap = snapshot();
+    SharedCollectionHeader                    header {snap->collectionSize(), snap->maxIndex(), snap->generation(), snap->size()};
+
+    tp::ScopedLatency latency(series);
+
+    size_t size = sizeof(SharedCollectionHeader) + snap->size() * sizeof(SharedPersonRecord);
+    for(const PersonView & p : *snap)
+        size = alignVisits(size) + p.visitCount() * sizeof(Visit) + p.aliasLength();
+
+    return segment.publish(size, [&](char * area) {
+        std::memcpy(area, &header, sizeof(header));
+
+        size_t pos = sizeof(SharedCollectionHeader) + snap->size() * sizeof(SharedPersonRecord);
+        for(size_t i=0; i < snap->size(); ++i) {
+            const PersonView & p = (*snap)[i];
+            SharedPersonRecord record;
+
+            // Вытесненный посетитель разбирается здесь, без блокировки коллекции
+            p.withData([&](std::string_view alias, std::span<const Visit> visits) {
+                pos = alignVisits(pos);
+                record.index         = p.index();
+                record.visits_offset = pos;
+                record.visit_count   = visits.size();
+                std::memcpy(area + pos, visits.data(), visits.size_bytes());
+                pos += visits.size_bytes();
+
+                record.alias_offset = pos;
+                record.alias_length = alias.size();
+                std::memcpy(area + pos, alias.data(), alias.size());
+                pos += alias.size();
+            });
+
+            std::memcpy(area + sizeof(SharedCollectionHeader) + i * sizeof(SharedPersonRecord), &record, sizeof(record));
+        }
+    });
+}
+
+bool ItemCollector::saveCollection()
+{
+    bool saved = Collector::saveCollection();
+    return (_shared == nullptr || publish(*_shared)) && saved;
+}
+
+SharedCollectionView::SharedCollectionView(std::string_view area)
+    : _area(area)
+{
+    SharedCollectionHeader header;
+    if (area.size() < sizeof(header))
+        return;
+
+    std::memcpy(&header, area.data(), sizeof(header));
+    if (header.count > (area.size() - sizeof(header)) / sizeof(SharedPersonRecord))
+        return;
+
+    _size       = header.size;
+    _max_index  = header.max_index;
+    _generation = header.generation;
+    _count      = header.count;
+    _valid      = true;
+}
+
+std::optional<SharedPerson> SharedCollectionView::person(size_t i) const
+{
+    if (!_valid || i >= _count)
+        return {};
+
+    SharedPersonRecord record;
+    std::memcpy(&record, _area.data() + sizeof(SharedCollectionHeader) + i * sizeof(SharedPersonRecord), sizeof(record));
+
+    auto inside = [&](uint64_t offset, uint64_t length) {
+        return offset <= _area.size() && length <= _area.size() - offset;
+    };
 
-    assert(p != nullptr);
+    if (!inside(record.alias_offset, record.alias_length)
+     || record.visits_offset % alignof(Visit) != 0
+     || record.visit_count > _area.size() / sizeof(Visit)
+     || !inside(record.visits_offset, record.visit_count * sizeof(Visit)))
+        return {};
 
-    return *p;
+    return SharedPerson {
+        record.index,
+        _area.substr(record.alias_offset, record.alias_length),
+        {reinterpret_cast<const Visit *>(_area.data() + record.visits_offset), record.visit_count}
+    };
 }
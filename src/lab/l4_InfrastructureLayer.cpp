@@ -1,57 +1,345 @@
 #include "hw/l4_InfrastructureLayer.h"
 
-std::string readString(std::istream& is, size_t max_string_length)
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    uint32_t crc32cSoftware(const uint8_t * p, size_t size, uint32_t crc)
+    {
+        static const auto table = [] {
+            std::array<uint32_t,256> t {};
+            for(uint32_t i=0; i < 256; ++i) {
+                uint32_t c = i;
+                for(int k=0; k < 8; ++k)
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        for(size_t i=0; i < size; ++i)
+            crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    uint32_t crc32cSse42(const uint8_t * p, size_t size, uint32_t crc)
+    {
+        uint64_t crc64 = crc;
+        for(; size >= 8; p += 8, size -= 8) {
+            uint64_t value;
+            std::memcpy(&value, p, sizeof(value));
+            crc64 = _mm_crc32_u64(crc64, value);
+        }
+
+        crc = static_cast<uint32_t>(crc64);
+        for(; size > 0; ++p, --size)
+            crc = _mm_crc32_u8(crc, *p);
+        return crc;
+    }
+#endif
+
+    void storeU32(char * p, uint32_t value)
+    {
+        for(size_t i=0; i < sizeof(value); ++i)
+            p[i] = static_cast<char>(value >> (8 * i));
+    }
+
+    uint32_t loadU32(const char * p)
+    {
+        uint32_t value = 0;
+        for(size_t i=0; i < sizeof(value); ++i)
+            value |= uint32_t(static_cast<uint8_t>(p[i])) << (8 * i);
+        return value;
+    }
+
+    const size_t BLOCK_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+    /**
+     * @brief Проверка контрольных сумм и сборка данных блоков
+     *
+     * @return false Нарушена структура блоков или не совпала контрольная сумма.
+     *
+     */
+    bool readBlocks(const char * data, size_t size, std::string & payload)
+    {
+        const char * pos = data;
+        const char * end = data + size;
+
+        payload.reserve(size);
+
+        for(bool first = true; pos < end; first = false) {
+            size_t header_size = (first ? sizeof(DATA_FILE_MAGIC) : 0) + BLOCK_HEADER_SIZE;
+            if (static_cast<size_t>(end - pos) < header_size)
+                return false;
+
+            const char * header = pos + header_size - BLOCK_HEADER_SIZE;
+            uint32_t     length = loadU32(header);
+            uint32_t     crc    = loadU32(header + sizeof(uint32_t));
+            const char * block  = pos + header_size;
+
+            if (length > DATA_BLOCK_SIZE - header_size || length > static_cast<size_t>(end - block)
+             || crc32c(block, length) != crc)
+                return false;
+
+            payload.append(block, length);
+            pos = block + length;
+        }
+
+        return true;
+    }
+}
+
+/**
+ * @brief Запись данных блоками DATA_BLOCK_SIZE с контрольными суммами
+ *
+ * @details Блок собирается в выровненном буфере и передаётся в файл одним
+ * вызовом write.
+ *
+ */
+class BlockWriter
+{
+    int    _fd;
+    char * _buffer;
+    bool   _first = true;     // объявлен до _used: от него зависит размер заголовка
+    bool   _error = false;
+    size_t _used;
+
+    size_t headerSize() const { return (_first ? sizeof(DATA_FILE_MAGIC) : 0) + BLOCK_HEADER_SIZE; }
+
+    bool flushBlock()
+    {
+        char * header = _buffer;
+        if (_first) {
+            std::memcpy(header, DATA_FILE_MAGIC, sizeof(DATA_FILE_MAGIC));
+            header += sizeof(DATA_FILE_MAGIC);
+        }
+
+        size_t length = _used - headerSize();
+        storeU32(header, static_cast<uint32_t>(length));
+        storeU32(header + sizeof(uint32_t), crc32c(_buffer + headerSize(), length));
+
+        const char * pos  = _buffer;
+        size_t       size = _used;
+        while(size > 0 && !_error) {
+            ssize_t n = ::write(_fd, pos, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                _error = true;
+            else {
+                pos  += n;
+                size -= n;
+            }
+        }
+
+        _first = false;
+        _used  = headerSize();
+        return !_error;
+    }
+
+public:
+    explicit BlockWriter(int fd)
+        : _fd(fd)
+        , _buffer(static_cast<char *>(std::aligned_alloc(4096, DATA_BLOCK_SIZE)))
+        , _used(headerSize())
+    {
+        _error = _buffer == nullptr;
+    }
+
+    ~BlockWriter() { std::free(_buffer); }
+
+    BlockWriter(const BlockWriter &) = delete;
+    BlockWriter & operator=(const BlockWriter &) = delete;
+
+    bool write(std::string_view data)
+    {
+        while(!data.empty() && !_error) {
+            size_t part = std::min(data.size(), DATA_BLOCK_SIZE - _used);
+            std::memcpy(_buffer + _used, data.data(), part);
+            _used += part;
+            data.remove_prefix(part);
+
+            if (_used == DATA_BLOCK_SIZE)
+                flushBlock();
+        }
+        return !_error;
+    }
+
+    /// Запись последнего (неполного) блока
+    bool finish()
+    {
+        if (_error)
+            return false;
+        return (_used == headerSize() && !_first) || flushBlock();
+    }
+};
+
+uint32_t crc32c(const void * data, size_t size, uint32_t crc)
 {
-    uint16_t len = readNumber<uint16_t>(is);
+    const uint8_t * p = static_cast<const uint8_t *>(data);
+
+#if defined(__x86_64__)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return ~crc32cSse42(p, size, ~crc);
+#endif
 
-    assert(len <= max_string_length);
+    return ~crc32cSoftware(p, size, ~crc);
+}
 
-    std::string str(len,' ');
-    if (len > 0)
-        is.read(str.data(), len);
+MappedFile::MappedFile(const std::string & file_name)
+{
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
 
-    return str;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        _size = st.st_size;
+        if (_size == 0)
+            _valid = true;
+        else {
+            void * p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, _size, MADV_SEQUENTIAL);
+                _data  = static_cast<const char *>(p);
+                _valid = true;
+            }
+        }
+    }
+
+    close(fd);
 }
 
-void writeString(std::ostream& os, const std::string& s)
+MappedFile::~MappedFile()
 {
-    uint16_t len = s.length();
-    writeNumber(os, len);
-    os.write(s.data(), len);
+    if (_data != nullptr)
+        munmap(const_cast<char *>(_data), _size);
 }
 
 
-bool ACollector::loadCollection(const std::string file_name)
+DataFileReader::DataFileReader(const std::string & file_name)
+    : _mapped(file_name)
 {
-    _file_name = file_name;
-    std::ifstream ifs (file_name, std::ios_base::binary);
-    if (!ifs)
-        return false;
+    if (!_mapped.valid() || _mapped.size() == 0) {
+        _valid = _mapped.valid();
+        return;
+    }
+
+    const char * data = _mapped.data();
+    size_t       size = _mapped.size();
+    bool         signed_file = size >= sizeof(DATA_FILE_MAGIC)
+                            && std::memcmp(data, DATA_FILE_MAGIC, 6) == 0 && data[7] == DATA_FILE_MAGIC[7];
 
-    size_t count = readNumber<size_t>(ifs);
-    for(size_t i=0; i < count; ++i) {
-        uint8_t removed = readNumber<uint8_t>(ifs);
-        addItem(read(ifs), removed == 1);
+    // Файл прежнего формата: вместо сигнатуры записано количество элементов
+    if (!signed_file) {
+        _items = data;
+        _size  = size;
+        _valid = true;
+        return;
     }
 
-    return ifs.good();
+    _format = static_cast<DataFormat>(data[6]);
+
+    if (_format == DataFormat::Indexed || _format == DataFormat::Compact) {
+        _items = data + sizeof(DATA_FILE_MAGIC);
+        _size  = size - sizeof(DATA_FILE_MAGIC);
+        _valid = true;
+    }
+    else if (_format == DataFormat::Checksummed || _format == DataFormat::Portable) {
+        _valid = readBlocks(data, size, _payload);
+        _items = _payload.data();
+        _size  = _payload.size();
+    }
 }
 
-bool ACollector::saveCollection() const
+DataFileWriter::DataFileWriter(const std::string & file_name, size_t max_index, size_t count)
+    : _file_name(file_name)
+    , _temp_name(file_name + ".tmp")
+    , _fd(open(_temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
 {
-    std::ofstream ofs (_file_name, std::ios_base::binary);
+    if (_fd >= 0)
+        _blocks = std::make_unique<BlockWriter>(_fd);
 
-    if (!ofs)
-        return false;
+    _out.buffer().reserve(2 * DATA_BLOCK_SIZE);
+    _out.putFixed<uint64_t>(max_index);
+    _out.putFixed<uint64_t>(count);
+}
 
-    size_t items_quantity = _items.size();
-    writeNumber<size_t>(ofs,items_quantity);
+DataFileWriter::~DataFileWriter()
+{
+    if (_done)
+        return;
 
-    for(auto & [index, data] : _items) {
-        writeNumber<uint8_t>(ofs, data.removed() ? 1 : 0);
-        data.item()->write(ofs);
+    _blocks.reset();
+    if (_fd >= 0) {
+        close(_fd);
+        unlink(_temp_name.c_str());
     }
+}
 
-    return ofs.good();
+ByteWriter & DataFileWriter::beginItem(size_t index, bool removed)
+{
+    // Индекс записывается разностью с предыдущим вместе с признаком удаления
+    _out.putVarint((uint64_t(index - _previous) << 1) | (removed ? 1 : 0));
+    _previous = index;
+    return _out;
+}
+
+void DataFileWriter::endItem()
+{
+    if (_out.buffer().size() < DATA_BLOCK_SIZE)
+        return;
+
+    if (_blocks != nullptr)
+        _blocks->write(_out.buffer());
+    _out.buffer().clear();
 }
 
+bool DataFileWriter::commit()
+{
+    if (_fd < 0)
+        return false;
+
+    bool ok = _blocks->write(_out.buffer()) && _blocks->finish();
+    _blocks.reset();
+
+    _done = true;
+
+    ok = fsync(_fd) == 0 && ok;
+    ok = close(_fd) == 0 && ok;
+
+    if (ok)
+        ok = rename(_temp_name.c_str(), _file_name.c_str()) == 0;
+
+    if (!ok) {
+        unlink(_temp_name.c_str());
+        return false;
+    }
+
+    // Переименование становится устойчивым к сбою после синхронизации каталога
+    std::string directory = std::filesystem::path(_file_name).parent_path().string();
+    int dir_fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return true;
+}
@@ -0,0 +1,188 @@
+#include "hw/l4_SharedSegment.h"
+
+#include <atomic>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char   SHARED_SEGMENT_MAGIC[8] = {'\x89','L','A','B','S','H','\x01','\n'};
+    const size_t SHARED_ALIGNMENT        = 4096;
+
+    size_t alignUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+}
+
+/**
+ * @brief Заголовок сегмента
+ *
+ * @details Поля, которые писатель меняет при публикации, атомарны: читатель
+ * читает их одновременно с записью.
+ *
+ */
+struct SharedSegment::Header
+{
+    char                  magic[8];
+    std::atomic<uint64_t> sequence;             ///< 2n-1 - версия n записывается, 2n - опубликована
+    std::atomic<uint64_t> area_offset[2];       ///< смещение области от начала сегмента
+    std::atomic<uint64_t> area_capacity[2];
+    std::atomic<uint64_t> area_size[2];         ///< размер данных версии в области
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Атомарные поля сегмента должны работать без блокировок");
+
+SharedSegment::SharedSegment(const std::string & name, Mode mode)
+    : _name(name.empty() || name[0] != '/' ? "/" + name : name)
+    , _writable(mode == Mode::Write)
+{
+    _fd = shm_open(_name.c_str(), _writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (_fd < 0)
+        return;
+
+    // Писатель у сегмента один, блокировка снимается при закрытии дескриптора
+    if (_writable && flock(_fd, LOCK_EX | LOCK_NB) != 0)
+        return;
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+        return;
+
+    size_t size        = st.st_size;
+    bool   initialized = size >= sizeof(Header);
+
+    if (!initialized) {
+        if (!_writable)
+            return;
+        size = alignUp(sizeof(Header), SHARED_ALIGNMENT);
+        if (ftruncate(_fd, size) != 0)
+            return;
+    }
+
+    if (!map(size))
+        return;
+
+    if (initialized && std::memcmp(header()->magic, SHARED_SEGMENT_MAGIC, sizeof(SHARED_SEGMENT_MAGIC)) != 0) {
+        if (!_writable)
+            return;
+        initialized = false;
+    }
+
+    // Сигнатура записывается последней: читатель не отображает сегмент без неё
+    if (!initialized) {
+        Header * h = header();
+        h->sequence.store(0);
+        for(int i=0; i < 2; ++i) {
+            h->area_offset[i].store(0);
+            h->area_capacity[i].store(0);
+            h->area_size[i].store(0);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(h->magic, SHARED_SEGMENT_MAGIC, sizeof(SHARED_SEGMENT_MAGIC));
+    }
+
+    _valid = true;
+}
+
+SharedSegment::~SharedSegment()
+{
+    if (_data != nullptr)
+        munmap(_data, _size);
+    if (_fd >= 0)
+        close(_fd);
+}
+
+bool SharedSegment::map(size_t size)
+{
+    void * p = mmap(nullptr, size, _writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+
+    if (_data != nullptr)
+        munmap(_data, _size);
+
+    _data = static_cast<char *>(p);
+    _size = size;
+    return true;
+}
+
+uint64_t SharedSegment::version() const
+{
+    return _valid ? header()->sequence.load(std::memory_order_acquire) / 2 : 0;
+}
+
+bool SharedSegment::publish(size_t size, const std::function<void(char *)> & fill)
+{
+    if (!_valid || !_writable)
+        return false;
+
+    std::lock_guard locker(_publish_mutex);
+
+    Header * h       = header();
+    uint64_t version = h->sequence.load(std::memory_order_relaxed) / 2 + 1;
+    size_t   area    = version % 2;
+
+    // Читатели версии version-2 из этой области обнаружат запись по счётчику
+    h->sequence.store(2 * version - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (h->area_capacity[area].load(std::memory_order_relaxed) < size) {
+        // Место прежней области не используется повторно, поэтому ёмкость
+        // выделяется с запасом, чтобы области переносились реже
+        size_t offset   = _size;
+        size_t capacity = alignUp(size + size / 2, SHARED_ALIGNMENT);
+        if (ftruncate(_fd, offset + capacity) != 0 || !map(offset + capacity)) {
+            h = header();
+            h->sequence.store(2 * (version - 1), std::memory_order_release);
+            return false;
+        }
+
+        h = header();
+        h->area_offset[area].store(offset, std::memory_order_relaxed);
+        h->area_capacity[area].store(capacity, std::memory_order_relaxed);
+    }
+
+    fill(_data + h->area_offset[area].load(std::memory_order_relaxed));
+    h->area_size[area].store(size, std::memory_order_relaxed);
+
+    h->sequence.store(2 * version, std::memory_order_release);
+    return true;
+}
+
+bool SharedSegment::beginRead(uint64_t & version, std::string_view & area)
+{
+    if (!_valid)
+        return false;
+
+    version = header()->sequence.load(std::memory_order_acquire) / 2;
+    if (version == 0)
+        return false;
+
+    size_t index  = version % 2;
+    size_t offset = header()->area_offset[index].load(std::memory_order_relaxed);
+    size_t size   = header()->area_size[index].load(std::memory_order_relaxed);
+
+    // Сегмент вырос после отображения. Если область всё равно за концом сегмента,
+    // смещение и размер прочитаны во время записи, и просмотр пустой области повторится
+    auto inside = [&] { return offset <= _size && size <= _size - offset; };
+    if (!inside()) {
+        struct stat st;
+        if (fstat(_fd, &st) == 0 && size_t(st.st_size) > _size)
+            map(st.st_size);
+    }
+
+    area = inside() ? std::string_view(_data + offset, size) : std::string_view();
+    return true;
+}
+
+bool SharedSegment::validateRead(uint64_t version) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return header()->sequence.load(std::memory_order_relaxed) < 2 * version + 3;
+}
@@ -0,0 +1,442 @@
+/**
+ * @file replay.cpp
+ * @brief Воспроизведение пакета команд с замером задержек и пропускной способности
+ *
+ * Программа выполняет пакет команд (вывод bin/stressgen, текстовый или двоичный)
+ * тем же прикладным слоем, что и bin/lab, но внутри своего процесса и с пустой
+ * коллекцией, без загрузки и сохранения файла данных. Для каждого размера пула
+ * потоков пакет выполняется заново над новой коллекцией, и выводятся задержки
+ * команд (p50, p99, p99.9) и установившаяся пропускная способность.
+ *
+ * Команды подаются в одном из режимов:
+ *
+ * * замкнутый цикл (по умолчанию) - одновременно в обработке не больше K команд
+ *   (параметр --outstanding=K, по умолчанию 64), следующая команда подаётся
+ *   после завершения одной из предыдущих. Задержка отсчитывается от подачи команды;
+ * * разомкнутый цикл (параметр --rate=R) - команды подаются с заданной частотой
+ *   R команд в секунду независимо от завершения предыдущих. Задержка отсчитывается
+ *   от запланированного времени подачи, поэтому отставание подачи при перегрузке
+ *   тоже учитывается.
+ *
+ * Параметры:
+ *
+ * * --threads=1,2,4       - размеры пула потоков;
+ * * --save-baseline=<файл> - сохранить результаты как базовые;
+ * * --baseline=<файл>      - сравнить результаты с базовыми;
+ * * --threshold=<проценты> - допустимое ухудшение задержек и пропускной
+ *   способности относительно базовых (по умолчанию 10).
+ *
+ * Если указано несколько файлов пакетов, все, кроме последнего, только готовят
+ * коллекцию (как шаблоны test/stress, выполняемые по порядку) и в замер не входят.
+ * Без файлов пакет читается из стандартного потока.
+ *
+ * Сравниваются результаты с одинаковым размером пула, полученные в том же режиме
+ * на пакете того же размера. Код возврата 2 означает, что результаты хуже
+ * базовых больше, чем на порог.
+ *
+ */
+
+#include "hw/l2_ApplicationLayer.h"
+#include "hw/l4_InfrastructureLayer.h"
+#include "tp/Statistics.h"
+#include "tp/ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <semaphore>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+class NullOutput : public IOutput
+{
+public:
+    virtual void Output(std::string ) const override {}
+};
+
+/**
+ * @brief Пакет команд: текстовые строки или записи двоичного пакета
+ *
+ * @details Записи двоичного пакета ссылаются на буфер data.
+ *
+ */
+struct Workload
+{
+    std::string                 data;
+    std::vector<std::string>    lines;
+    std::vector<WorkloadRecord> records;
+
+    size_t size() const { return lines.size() + records.size(); }
+
+    Application * command(size_t i, ItemCollector & col, const IOutput & out, tp::ThreadPool * pool) const
+    {
+        if (!lines.empty())
+            return new Application(col, lines[i], out, pool);
+        return new Application(col, records[i], out, pool);
+    }
+};
+
+bool loadWorkload(std::istream & is, Workload & workload)
+{
+    workload.data.assign(std::istreambuf_iterator<char>(is), {});
+
+    if (isBinaryWorkload(workload.data.data(), workload.data.size())) {
+        BinaryWorkloadReader reader(workload.data.data(), workload.data.size());
+        for(WorkloadRecord record; reader.next(record); )
+            workload.records.push_back(record);
+        return !reader.error();
+    }
+
+    std::istringstream text(workload.data);
+    for(std::string line; std::getline(text, line); ) {
+        if (line.empty())
+            break;                  // bin/lab тоже останавливается на пустой строке
+        workload.lines.push_back(line);
+    }
+    workload.data.clear();
+    return true;
+}
+
+struct Options
+{
+    std::vector<int> thread_counts { 1, 2, 4 };
+    size_t           outstanding = 64;
+    double           rate        = 0;       ///< команд в секунду, 0 - замкнутый цикл
+    double           threshold   = 10;      ///< проценты
+    std::string      baseline_file;
+    std::string      save_baseline_file;
+};
+
+struct Result
+{
+    int      threads    = 0;
+    uint64_t p50        = 0;                ///< нс
+    uint64_t p99        = 0;
+    uint64_t p999       = 0;
+    double   throughput = 0;                ///< команд в секунду
+};
+
+/**
+ * @brief Команда пакета, замеряющая свою задержку
+ *
+ * @details Время завершения записывается в собственный элемент массива задержек,
+ * поэтому синхронизация не нужна: массив читается после разрушения пула.
+ *
+ */
+class ReplayTask : public tp::Task_interface
+{
+    std::unique_ptr<Application> _command;
+    clock_type::time_point       _start;
+    uint64_t &                   _latency;
+    std::counting_semaphore<> *  _slots;
+
+public:
+    ReplayTask(Application * command, clock_type::time_point start, uint64_t & latency, std::counting_semaphore<> * slots)
+        : _command(command)
+        , _start(start)
+        , _latency(latency)
+        , _slots(slots)
+    {}
+
+    virtual void work() override
+    {
+        _command->work();
+        _latency = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - _start).count();
+
+        if (_slots != nullptr)
+            _slots->release();
+    }
+};
+
+void prepare(ItemCollector & col, const Workload & workload, int number_of_threads)
+{
+    static const NullOutput out;
+
+    tp::ThreadPool pool(number_of_threads);
+    pool.start();
+
+    for(size_t i=0; i < workload.size(); ++i)
+        pool.submit(workload.command(i, col, out, &pool));
+}
+
+Result replay(const std::vector<Workload> & workloads, int number_of_threads, const Options & options)
+{
+    static const NullOutput out;
+
+    ItemCollector col;
+    for(size_t i=0; i+1 < workloads.size(); ++i)
+        prepare(col, workloads[i], number_of_threads);
+
+    const Workload &          workload = workloads.back();
+    std::vector<uint64_t>     latencies(workload.size());
+    std::counting_semaphore<> slots(std::max<size_t>(options.outstanding, 1));
+    clock_type::time_point    start;
+    clock_type::time_point    finish;
+
+    {
+        tp::ThreadPool pool(number_of_threads);
+        pool.start();
+
+        start = clock_type::now();
+
+        for(size_t i=0; i < workload.size(); ++i) {
+            Application * command = workload.command(i, col, out, &pool);
+
+            if (options.rate > 0) {
+                auto planned = start + std::chrono::duration_cast<clock_type::duration>(
+                                            std::chrono::duration<double>(double(i) / options.rate));
+                std::this_thread::sleep_until(planned);
+                pool.submit(new ReplayTask(command, planned, latencies[i], nullptr));
+            }
+            else {
+                slots.acquire();
+                pool.submit(new ReplayTask(command, clock_type::now(), latencies[i], &slots));
+            }
+        }
+
+        // Пул завершает работу после выполнения всех команд очереди
+    }
+    finish = clock_type::now();
+
+    tp::LatencyHistogram histogram;
+    for(uint64_t latency : latencies)
+        histogram.record(latency);
+
+    double seconds = std::chrono::duration<double>(finish - start).count();
+
+    return { number_of_threads,
+             histogram.percentile(0.5),
+             histogram.percentile(0.99),
+             histogram.percentile(0.999),
+             seconds > 0 ? double(workload.size()) / seconds : 0 };
+}
+
+std::string describeMode(const Options & options, size_t commands)
+{
+    std::ostringstream os;
+    if (options.rate > 0)
+        os << "mode=open rate=" << options.rate;
+    else
+        os << "mode=closed outstanding=" << options.outstanding;
+    os << " commands=" << commands;
+    return os.str();
+}
+
+bool saveBaseline(const std::string & file_name, const std::string & mode, const std::vector<Result> & results)
+{
+    std::ofstream ofs(file_name);
+
+    ofs << "# " << mode << "\n";
+    for(const Result & r : results)
+        ofs << "threads=" << r.threads << " p50=" << r.p50 << " p99=" << r.p99 << " p999=" << r.p999
+            << " throughput=" << std::fixed << std::setprecision(1) << r.throughput << "\n";
+
+    return ofs.good();
+}
+
+bool loadBaseline(const std::string & file_name, std::string & mode, std::map<int,Result> & results)
+{
+    std::ifstream ifs(file_name);
+    if (!ifs)
+        return false;
+
+    for(std::string line; std::getline(ifs, line); ) {
+        if (line.rfind("# ", 0) == 0) {
+            mode = line.substr(2);
+            continue;
+        }
+
+        Result             r;
+        std::istringstream is(line);
+        for(std::string field; is >> field; ) {
+            size_t eq = field.find('=');
+            if (eq == std::string::npos)
+                return false;
+
+            std::string name  = field.substr(0, eq);
+            std::string value = field.substr(eq + 1);
+
+            if (name == "threads")         r.threads    = std::stoi(value);
+            else if (name == "p50")        r.p50        = std::stoull(value);
+            else if (name == "p99")        r.p99        = std::stoull(value);
+            else if (name == "p999")       r.p999       = std::stoull(value);
+            else if (name == "throughput") r.throughput = std::stod(value);
+        }
+        if (r.threads > 0)
+            results[r.threads] = r;
+    }
+    return true;
+}
+
+/// Сравнение с базовыми результатами; false - есть ухудшение больше порога
+bool compareWithBaseline(const Result & current, const Result & base, double threshold)
+{
+    double limit = 1 + threshold / 100;
+    bool   ok    = true;
+
+    auto check_latency = [&](const char * name, uint64_t value, uint64_t base_value) {
+        if (base_value > 0 && double(value) > double(base_value) * limit) {
+            std::cout << "Регрессия: потоков " << current.threads << ", " << name << " " << value / 1000
+                      << " мкс при базовом " << base_value / 1000 << " мкс" << std::endl;
+            ok = false;
+        }
+    };
+
+    check_latency("p50",   current.p50,  base.p50);
+    check_latency("p99",   current.p99,  base.p99);
+    check_latency("p99.9", current.p999, base.p999);
+
+    if (current.throughput < base.throughput / limit) {
+        std::cout << "Регрессия: потоков " << current.threads << ", пропускная способность "
+                  << std::fixed << std::setprecision(0) << current.throughput
+                  << " команд/с при базовой " << base.throughput << " команд/с" << std::endl;
+        ok = false;
+    }
+
+    return ok;
+}
+
+std::vector<std::string> splitList(const std::string & str)
+{
+    std::vector<std::string> res;
+    std::istringstream       is(str);
+    for(std::string item; std::getline(is, item, ','); )
+        if (!item.empty())
+            res.push_back(item);
+    return res;
+}
+
+int convertToInteger(const std::string & str)
+try
+{
+    return std::stoi(str);
+}
+catch(...)
+{
+    return 0;
+}
+
+}
+
+int main(int argc, char * argv[])
+try
+{
+    Options                  options;
+    std::vector<std::string> workload_files;
+
+    int hardware = std::thread::hardware_concurrency();
+    if (hardware > 4)
+        options.thread_counts.push_back(hardware);
+
+    for(int i=1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--threads=", 0) == 0) {
+            options.thread_counts.clear();
+            for(const std::string & s : splitList(arg.substr(10)))
+                options.thread_counts.push_back(convertToInteger(s));
+        }
+        else if (arg.rfind("--outstanding=", 0) == 0)
+            options.outstanding = std::max(convertToInteger(arg.substr(14)), 1);
+        else if (arg.rfind("--rate=", 0) == 0)
+            options.rate = std::stod(arg.substr(7));
+        else if (arg.rfind("--threshold=", 0) == 0)
+            options.threshold = std::stod(arg.substr(12));
+        else if (arg.rfind("--baseline=", 0) == 0)
+            options.baseline_file = arg.substr(11);
+        else if (arg.rfind("--save-baseline=", 0) == 0)
+            options.save_baseline_file = arg.substr(16);
+        else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Недопустимый параметр '" << arg << "'" << std::endl;
+            return 1;
+        }
+        else
+            workload_files.push_back(arg);
+    }
+
+    if (options.thread_counts.empty()
+     || std::any_of(options.thread_counts.begin(), options.thread_counts.end(), [](int n){ return n < 1; })) {
+        std::cerr << "Недопустимые размеры пула потоков" << std::endl;
+        return 1;
+    }
+
+    std::vector<Workload> workloads(std::max<size_t>(workload_files.size(), 1));
+    if (workload_files.empty())
+        loadWorkload(std::cin, workloads[0]);
+    else
+        for(size_t i=0; i < workload_files.size(); ++i) {
+            std::ifstream ifs(workload_files[i], std::ios::binary);
+            if (!ifs || !loadWorkload(ifs, workloads[i])) {
+                std::cerr << "Ошибка при чтении пакета команд '" << workload_files[i] << "'" << std::endl;
+                return 1;
+            }
+        }
+
+    if (workloads.back().size() == 0) {
+        std::cerr << "Пакет команд пуст" << std::endl;
+        return 1;
+    }
+
+    std::string mode = describeMode(options, workloads.back().size());
+    std::cout << "Воспроизведение пакета: " << mode << std::endl;
+    // Ширина полей задаётся в байтах, поэтому заголовок с кириллицей выровнен вручную
+    std::cout << " Потоков    p50, мкс    p99, мкс    p99.9, мкс      Команд/с" << std::endl;
+
+    std::vector<Result> results;
+    for(int threads : options.thread_counts) {
+        Result r = replay(workloads, threads, options);
+        results.push_back(r);
+
+        std::cout << std::setw(8) << r.threads
+                  << std::setw(12) << r.p50 / 1000 << std::setw(12) << r.p99 / 1000 << std::setw(14) << r.p999 / 1000
+                  << std::setw(14) << std::fixed << std::setprecision(0) << r.throughput << std::endl;
+    }
+
+    if (!options.save_baseline_file.empty() && !saveBaseline(options.save_baseline_file, mode, results)) {
+        std::cerr << "Ошибка при сохранении базовых результатов '" << options.save_baseline_file << "'" << std::endl;
+        return 1;
+    }
+
+    if (options.baseline_file.empty())
+        return 0;
+
+    std::string          base_mode;
+    std::map<int,Result> base;
+    if (!loadBaseline(options.baseline_file, base_mode, base)) {
+        std::cerr << "Ошибка при чтении базовых результатов '" << options.baseline_file << "'" << std::endl;
+        return 1;
+    }
+
+    // Задержки разомкнутого и замкнутого циклов (и разных пакетов) несопоставимы
+    if (base_mode != mode) {
+        std::cerr << "Базовые результаты получены в другом режиме: " << base_mode << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    for(const Result & r : results) {
+        auto it = base.find(r.threads);
+        if (it != base.end() && !compareWithBaseline(r, it->second, options.threshold))
+            ok = false;
+    }
+
+    if (ok)
+        std::cout << "Ухудшений относительно базовых результатов больше " << options.threshold << "% нет" << std::endl;
+
+    return ok ? 0 : 2;
+}
+catch(const std::exception & e)
+{
+    std::cerr << "Ошибка: " << e.what() << std::endl;
+    return 1;
+}
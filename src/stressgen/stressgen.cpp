@@ -1,182 +1,602 @@
 /**
  * @file stressgen.cpp
  * @author Fetisov Michael (fetisov.michael@bmstu.com)
- * @brief Программа командной строки для генерации набора команд для стресс-теста 
+ * @brief Программа командной строки для генерации набора команд для стресс-теста
  * лабораторных работ к курсу СТРПО.
- * @version 0.1
+ * @version 0.2
  * @date 2022-11-30
- * 
+ *
  * @copyright Copyright (c) 2022
- * 
- * На вход (стандартный поток std::cin) программа принимает шаблон, 
+ *
+ * На вход (стандартный поток std::cin) программа принимает шаблон,
  * состоящий из строк, которые просто копируются в результирующий поток (стандартный поток std::cout),
- * и групп генерации. 
- * 
- * Группы генерации начинаются со строки "#n" и заканчиваются строкой "#", 
+ * и групп генерации.
+ *
+ * Группы генерации начинаются со строки "#n" и заканчиваются строкой "#",
  * где n определяет количество повторений группы.
- * 
+ *
  * Возможны вложенные группы.
- * 
+ *
  * Управляющий символ '#' может быть заменён на другой посредством параметра --control-character.
- * 
+ *
  * В строках команд можно использовать следующие макрозамены:
- * 
+ *
  * * #i - заменяется на номер повторения строки внутри группы
  * * #N - заменяется на случайное целое число из диапазона от 1 до 1000 включительно
- * * #W - заменяется на случайный набор латинских букв (строчных и прописных) 
+ * * #W - заменяется на случайный набор латинских букв (строчных и прописных)
  * в количестве от 1 до 10 (включительно).
- * 
+ *
  * Макрозамены можно использовать в управляющей строки групп генерации.
- * 
+ *
+ * Шаблон разбирается один раз: каждая строка компилируется в последовательность
+ * литералов и макрозамен, результат не накапливается в памяти, а выводится
+ * крупными блоками по мере генерации.
+ *
+ * Раскрытие группы верхнего уровня делится на порции примерно по CHUNK_LINES строк,
+ * которые распределяются между потоками (параметр --threads, по умолчанию - количество
+ * логических процессоров). Повторения, дающие больше строк, дробятся по вложенным
+ * группам, поэтому объём памяти не зависит от глубины и размера групп.
+ *
+ * Каждое повторение любой группы использует собственный генератор xoshiro256**,
+ * инициализированный от зерна (параметр --seed) и положения повторения в шаблоне,
+ * поэтому результат не зависит ни от количества потоков, ни от деления на порции.
+ *
+ * Параметр --format binary включает вывод в двоичном формате пакета команд
+ * (см. hw/l4_BinaryWorkload.h), который bin/lab выполняет без текстового разбора.
+ *
  */
 
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <vector>
 #include <memory>
-#include <cstdlib>
-#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <charconv>
+#include <thread>
+#include <algorithm>
 
-class Generator_interface
-{
-public:
-    virtual ~Generator_interface() = default;
+#include "hw/l4_BinaryWorkload.h"
 
-    virtual std::string generate() const = 0;
+struct Options
+{
+    long long default_repetitions = 100;
+    bool      binary              = false;
 };
 
-class LineNoGenerator : public Generator_interface
+/**
+ * @brief Завершение строки, сгенерированной в out начиная с позиции start
+ *
+ */
+void finishLine(std::string & out, size_t start, const Options & options)
+{
+    if (!options.binary) {
+        out += '\n';
+        return;
+    }
+
+    std::string line = out.substr(start);
+    out.resize(start);
+    encodeWorkloadLine(line, out);
+}
+
+/**
+ * @brief Генератор псевдослучайных чисел xoshiro256**
+ *
+ */
+class Random
 {
-    std::string _line_no;
+    uint64_t _s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
 
 public:
-    LineNoGenerator(int line_no) : _line_no(std::to_string(line_no)) {} 
+    static uint64_t splitmix64(uint64_t & x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
 
-    virtual std::string generate() const override { return _line_no; }
+    Random(uint64_t seed, uint64_t stream)
+    {
+        uint64_t x = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+        for(uint64_t & s : _s)
+            s = splitmix64(x);
+    }
+
+    uint64_t next()
+    {
+        uint64_t result = rotl(_s[1] * 5, 7) * 9;
+        uint64_t t      = _s[1] << 17;
+
+        _s[2] ^= _s[0];
+        _s[3] ^= _s[1];
+        _s[1] ^= _s[2];
+        _s[0] ^= _s[3];
+        _s[2] ^= t;
+        _s[3]  = rotl(_s[3], 45);
+
+        return result;
+    }
+
+    /// Равномерное число из диапазона [0, n)
+    uint32_t below(uint32_t n)
+    {
+        return static_cast<uint32_t>(((next() >> 32) * n) >> 32);
+    }
 };
 
-class NumberGenerator : public Generator_interface
+/**
+ * @brief Ключ потока случайных чисел n-го дочернего элемента (повторения или строки тела)
+ *
+ */
+uint64_t childKey(uint64_t key, uint64_t n)
 {
+    uint64_t x = key ^ ((n + 1) * 0xd1b54a32d192ed03ULL);
+    return Random::splitmix64(x);
+}
+
+void appendNumber(std::string & out, long long value)
+{
+    char buf[24];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, end);
+}
+
+/**
+ * @brief Строка шаблона, разобранная на литералы и макрозамены
+ *
+ */
+class CompiledLine
+{
+    enum class Kind { Literal, LineNo, Number, Word };
+
+    struct Segment
+    {
+        Kind        kind;
+        std::string text;
+    };
+
+    std::vector<Segment> _segments;
+
 public:
-    virtual std::string generate() const override 
-    { 
-        return std::to_string(std::rand()%1000 + 1); 
+    CompiledLine() = default;
+
+    CompiledLine(const std::string & line, char control_character)
+    {
+        std::string literal;
+
+        for(size_t i=0; i < line.size(); ++i) {
+            if (line[i] == control_character && i+1 < line.size()) {
+                Kind kind = Kind::Literal;
+                switch(line[i+1]) {
+                case 'i': kind = Kind::LineNo; break;
+                case 'N': kind = Kind::Number; break;
+                case 'W': kind = Kind::Word;   break;
+                default:  break;
+                }
+
+                if (kind != Kind::Literal) {
+                    if (!literal.empty())
+                        _segments.push_back({Kind::Literal, std::move(literal)});
+                    literal.clear();
+                    _segments.push_back({kind, {}});
+                    ++i;
+                    continue;
+                }
+            }
+            literal += line[i];
+        }
+
+        if (!literal.empty())
+            _segments.push_back({Kind::Literal, std::move(literal)});
+    }
+
+    /// Строка содержит макрозамены со случайными значениями
+    bool random() const
+    {
+        return std::any_of(_segments.begin(), _segments.end(),
+                           [](const Segment & s){ return s.kind == Kind::Number || s.kind == Kind::Word; });
+    }
+
+    void generate(std::string & out, long long line_no, Random & random) const
+    {
+        static const char letters[] = "QWERTYUIOPASDFGHJKLZXCVBNMqwertyuiopasdfghjklzxcvbnm";
+
+        for(const Segment & s : _segments)
+            switch(s.kind) {
+            case Kind::Literal:
+                out += s.text;
+                break;
+            case Kind::LineNo:
+                appendNumber(out, line_no);
+                break;
+            case Kind::Number:
+                appendNumber(out, random.below(1000) + 1);
+                break;
+            case Kind::Word:
+                for(uint32_t n = random.below(10) + 1; n > 0; --n)
+                    out += letters[random.below(sizeof(letters) - 1)];
+                break;
+            }
     }
 };
 
-class WordGenerator : public Generator_interface
+/**
+ * @brief Группа генерации: управляющая строка и тело из строк и вложенных групп
+ *
+ * Экземпляр группы в шаблоне задаётся ключом: от него берётся генератор управляющей
+ * строки, а от ключа повторения - генераторы строк и ключи вложенных групп.
+ * Генератор строк заново инициализируется после каждой вложенной группы, поэтому
+ * тело повторения можно раскрывать по частям, разделённым вложенными группами.
+ *
+ */
+struct Group
 {
-public:
-    virtual std::string generate() const override 
-    { 
-        const std::string letters = "QWERTYUIOPASDFGHJKLZXCVBNMqwertyuiopasdfghjklzxcvbnm";
-        std::string       str;
-        int               word_length = std::rand() % 10 + 1;
+    struct Node
+    {
+        CompiledLine           line;
+        std::unique_ptr<Group> group;
+    };
+
+    bool              has_header = false;
+    CompiledLine      header;
+    std::vector<Node> body;
+
+    bool              fixed      = true;    ///< количество строк не зависит от случайных значений
+    long long         line_count = 0;       ///< количество строк в теле без учёта вложенных групп
+    mutable long long fixed_lines = -1;     ///< количество строк группы, если fixed
+
+    long long repetitions(uint64_t key, uint64_t seed, const Options & options) const
+    {
+        if (!has_header)
+            return options.default_repetitions;
+
+        Random      random(seed, key);
+        std::string line;
+        header.generate(line, 0, random);
+        return std::stoll(line.substr(1));
+    }
+
+    /// Количество строк, которое даст раскрытие экземпляра группы с ключом key
+    long long lines(uint64_t key, uint64_t seed, const Options & options) const
+    {
+        if (fixed && fixed_lines >= 0)
+            return fixed_lines;
+
+        long long count  = repetitions(key, seed, options);
+        long long result = 0;
+        for(long long i=0; i < count; ++i) {
+            result += repetitionLines(key, i, seed, options);
+            if (fixed) {
+                result *= count;
+                break;
+            }
+        }
+
+        if (fixed)
+            fixed_lines = result;
+        return result;
+    }
+
+    /// Количество строк, которое даст повторение с номером rep
+    long long repetitionLines(uint64_t key, long long rep, uint64_t seed, const Options & options) const
+    {
+        uint64_t  rep_key = childKey(key, rep);
+        long long result  = line_count;
+        for(size_t j=0; j < body.size(); ++j)
+            if (body[j].group)
+                result += body[j].group->lines(childKey(rep_key, j), seed, options);
+        return result;
+    }
+
+    /// Раскрытие элементов тела [first, last) повторения с номером rep
+    void generate(std::string & out, uint64_t key, long long rep, size_t first, size_t last,
+                  uint64_t seed, const Options & options) const
+    {
+        uint64_t rep_key = childKey(key, rep);
+        Random   random(seed, childKey(rep_key, first));
+
+        for(size_t j=first; j < last; ++j)
+            if (body[j].group) {
+                body[j].group->expand(out, childKey(rep_key, j), seed, options);
+                random = Random(seed, childKey(rep_key, j+1));
+            }
+            else {
+                size_t start = out.size();
+                body[j].line.generate(out, rep, random);
+                finishLine(out, start, options);
+            }
+    }
 
-        for(int i=0; i < word_length; ++i) 
-            str += letters.substr(std::rand() % letters.size(),1);
-        
-        return str; 
+    void expand(std::string & out, uint64_t key, uint64_t seed, const Options & options) const
+    {
+        long long count = repetitions(key, seed, options);
+        for(long long i=0; i < count; ++i)
+            generate(out, key, i, 0, body.size(), seed, options);
     }
 };
 
-void replaceAll(std::string& str, const std::string& from, const Generator_interface & generator)
+std::unique_ptr<Group> parseGroup(const std::string & header_line, char control_character)
 {
-    if(from.empty())
-        return;
+    auto group = std::make_unique<Group>();
+
+    group->has_header = header_line.size() > 1;
+    if (group->has_header)
+        group->header = CompiledLine(header_line, control_character);
+
+    for(std::string line; std::getline(std::cin,line); ) {
+        if (!line.empty() && line[0] == control_character) {
+            if (line.size() == 1)
+                break;
 
-    size_t start_pos = 0;
-    while((start_pos = str.find(from, start_pos)) != std::string::npos) {
-        std::string to = generator.generate();
-        str.replace(start_pos, from.length(), to);
-        start_pos += to.length(); 
+            group->body.push_back({{}, parseGroup(line, control_character)});
+            group->fixed = group->fixed && group->body.back().group->fixed;
+            continue;
+        }
+        group->body.push_back({CompiledLine(line, control_character), {}});
+        group->line_count ++;
     }
+
+    group->fixed = group->fixed && !(group->has_header && group->header.random());
+    return group;
 }
 
-std::string generateLine(std::string str, int line_no, const std::string & control_character)
+class BufferedOutput
 {
-    std::vector<std::pair<std::string,std::shared_ptr<Generator_interface>>> replaces
+    static constexpr size_t FLUSH_SIZE = 1 << 20;
+
+    std::string _buffer;
+
+public:
+    BufferedOutput() { _buffer.reserve(2 * FLUSH_SIZE); }
+    ~BufferedOutput() { flush(); }
+
+    std::string & buffer() { return _buffer; }
+
+    void flush()
     {
-        {control_character+"i", std::make_shared<LineNoGenerator>(line_no)},
-        {control_character+"N", std::make_shared<NumberGenerator>()},
-        {control_character+"W", std::make_shared<WordGenerator>()},
-    };
+        if (!_buffer.empty())
+            std::fwrite(_buffer.data(), 1, _buffer.size(), stdout);
+        _buffer.clear();
+    }
 
-    for(auto & [from,gen] : replaces)
-        replaceAll(str, from, *gen);
+    bool tooBig() const { return _buffer.size() >= FLUSH_SIZE; }
+};
 
-    return str;
-}
+/**
+ * @brief Порция раскрытия: элементы тела [node_first, node_last) повторений [first, last) группы
+ *
+ */
+struct Task
+{
+    const Group * group;
+    uint64_t      key;
+    long long     first;
+    long long     last;
+    size_t        node_first;
+    size_t        node_last;
+};
 
-std::vector<std::string> processGroup(std::string command_line, const std::string & control_character, long long default_repetitions)
+/**
+ * @brief Выполнение порций раскрытия: порции генерируются параллельно и выводятся по порядку
+ *
+ */
+class TaskRunner
 {
-    long long repetitions = default_repetitions;
-    if (command_line.size() > control_character.size())
-        repetitions = std::stoll(generateLine(command_line,0,control_character).substr(1));
+    uint64_t                 _seed;
+    const Options &          _options;
+    unsigned                 _number_of_threads;
+    BufferedOutput &         _out;
+    std::vector<Task>        _tasks;
+    std::vector<std::string> _buffers;
+
+    void generate(const Task & task, std::string & buf) const
+    {
+        for(long long i=task.first; i < task.last; ++i)
+            task.group->generate(buf, task.key, i, task.node_first, task.node_last, _seed, _options);
+    }
 
-    std::vector<std::string> group;
+public:
+    TaskRunner(uint64_t seed, const Options & options, unsigned number_of_threads, BufferedOutput & out)
+        : _seed(seed), _options(options), _number_of_threads(number_of_threads), _out(out)
+        , _buffers(number_of_threads)
+    {}
 
-    for(std::string line; std::getline(std::cin,line); ) {
-        if (line.substr(0,control_character.size()) == control_character) {
-            if (line.size() == control_character.size())
-                break;
+    void add(const Task & task)
+    {
+        if (_number_of_threads <= 1) {
+            generate(task, _out.buffer());
+            if (_out.tooBig())
+                _out.flush();
+            return;
+        }
+
+        _tasks.push_back(task);
+        if (_tasks.size() == _number_of_threads)
+            run();
+    }
+
+    void run()
+    {
+        if (_tasks.empty())
+            return;
+
+        std::vector<std::thread> threads;
+        for(size_t t=0; t < _tasks.size(); ++t) {
+            _buffers[t].clear();
+            threads.emplace_back([this, t]{ generate(_tasks[t], _buffers[t]); });
+        }
+
+        for(std::thread & t : threads)
+            t.join();
 
-            std::vector<std::string> processed_group = processGroup(line, control_character, default_repetitions);
-            
-            for(std::string s : processed_group)
-                 group.push_back(s);
+        _out.flush();
+        for(size_t t=0; t < _tasks.size(); ++t)
+            if (!_buffers[t].empty())
+                std::fwrite(_buffers[t].data(), 1, _buffers[t].size(), stdout);
 
+        _tasks.clear();
+    }
+};
+
+/// Примерное количество строк в порции раскрытия
+constexpr long long CHUNK_LINES = 16384;
+
+void planGroup(const Group & group, uint64_t key, uint64_t seed, const Options & options, TaskRunner & runner);
+
+/**
+ * @brief Деление повторения, которое даёт больше CHUNK_LINES строк, на порции по вложенным группам
+ *
+ */
+void planRepetition(const Group & group, uint64_t key, long long rep, uint64_t seed, const Options & options,
+                    TaskRunner & runner)
+{
+    uint64_t  rep_key = childKey(key, rep);
+    size_t    first   = 0;
+    long long pending = 0;
+
+    for(size_t j=0; j < group.body.size(); ++j) {
+        if (!group.body[j].group) {
+            pending ++;
+            continue;
+        }
+
+        long long lines = group.body[j].group->lines(childKey(rep_key, j), seed, options);
+
+        if (lines > CHUNK_LINES) {
+            if (first < j)
+                runner.add({&group, key, rep, rep+1, first, j});
+            planGroup(*group.body[j].group, childKey(rep_key, j), seed, options, runner);
+            first   = j + 1;
+            pending = 0;
             continue;
         }
-        group.push_back(line);
+
+        if (pending + lines > CHUNK_LINES && first < j) {
+            runner.add({&group, key, rep, rep+1, first, j});
+            first   = j;
+            pending = 0;
+        }
+        pending += lines;
     }
 
-    std::vector<std::string> processed_group;
+    if (first < group.body.size())
+        runner.add({&group, key, rep, rep+1, first, group.body.size()});
+}
 
-    for(long long i=0; i < repetitions; ++i)
-        for(std::string s : group)
-            processed_group.push_back(generateLine(s,i,control_character));
+/**
+ * @brief Деление раскрытия экземпляра группы на порции примерно по CHUNK_LINES строк
+ *
+ */
+void planGroup(const Group & group, uint64_t key, uint64_t seed, const Options & options, TaskRunner & runner)
+{
+    long long repetitions = group.repetitions(key, seed, options);
+    size_t    body_size   = group.body.size();
+
+    // Повторения группы без случайных количеств имеют одинаковый размер
+    if (group.fixed) {
+        long long lines = std::max(1LL, group.repetitionLines(key, 0, seed, options));
+        if (lines > CHUNK_LINES)
+            for(long long i=0; i < repetitions; ++i)
+                planRepetition(group, key, i, seed, options, runner);
+        else
+            for(long long i=0, chunk = CHUNK_LINES / lines; i < repetitions; i += chunk)
+                runner.add({&group, key, i, std::min(repetitions, i + chunk), 0, body_size});
+        return;
+    }
+
+    long long first   = 0;
+    long long pending = 0;
+
+    for(long long i=0; i < repetitions; ++i) {
+        long long lines = group.repetitionLines(key, i, seed, options);
+
+        if (pending > 0 && pending + lines > CHUNK_LINES) {
+            runner.add({&group, key, first, i, 0, body_size});
+            first   = i;
+            pending = 0;
+        }
 
-    return processed_group;
+        if (lines > CHUNK_LINES) {
+            planRepetition(group, key, i, seed, options, runner);
+            first = i + 1;
+            continue;
+        }
+        pending += lines;
+    }
+
+    if (first < repetitions)
+        runner.add({&group, key, first, repetitions, 0, body_size});
 }
 
 int main(int argc, char * argv[])
 {
-    std::string control_character   = "#";
-    long long   default_repetitions = 100;
+    char        control_character   = '#';
+    Options     options;
+    uint64_t    seed                = 1;
+    unsigned    number_of_threads   = std::max(1u, std::thread::hardware_concurrency());
     bool        parameters_error    = false;
 
     std::vector<std::string> arguments(argv + 1, argv + argc);
 
-    if (arguments.empty())
-        ;
-    else if (arguments.size() != 2)
-        parameters_error = true;
-    else if (arguments[0] != "--control-character")
+    if (arguments.size() % 2 != 0)
         parameters_error = true;
     else
-        control_character = arguments[1][0];
+        for(size_t i=0; i < arguments.size() && !parameters_error; i += 2) {
+            const std::string & name  = arguments[i];
+            const std::string & value = arguments[i+1];
+
+            if (name == "--control-character" && !value.empty())
+                control_character = value[0];
+            else if (name == "--format" && (value == "text" || value == "binary"))
+                options.binary = value == "binary";
+            else if (name == "--seed" && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos)
+                seed = std::stoull(value);
+            else if (name == "--threads" && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos)
+                number_of_threads = std::max(1, std::stoi(value));
+            else
+                parameters_error = true;
+        }
 
     if (parameters_error) {
         std::cerr << "Error in the program launch line" << std::endl;
         return 1;
     }
 
-    for(std::string line; std::getline(std::cin,line); ) {
-        if (line.substr(0,control_character.size()) == control_character) {
-            std::vector<std::string> processed_group = processGroup(line, control_character, default_repetitions);
-
-            for(std::string s : processed_group)
-                std::cout << s << std::endl;
-
-            continue;
+    try {
+        BufferedOutput out;
+        uint64_t       group_no = 0;
+
+        if (options.binary)
+            out.buffer().append(BINARY_WORKLOAD_MAGIC, sizeof(BINARY_WORKLOAD_MAGIC));
+
+        for(std::string line; std::getline(std::cin,line); ) {
+            if (!line.empty() && line[0] == control_character) {
+                std::unique_ptr<Group> group = parseGroup(line, control_character);
+                TaskRunner             runner(seed, options, number_of_threads, out);
+                planGroup(*group, childKey(0, group_no++), seed, options, runner);
+                runner.run();
+                continue;
+            }
+
+            size_t start = out.buffer().size();
+            out.buffer() += line;
+            finishLine(out.buffer(), start, options);
+            if (out.tooBig())
+                out.flush();
         }
 
-        std::cout << line << std::endl;
+        size_t start = out.buffer().size();
+        finishLine(out.buffer(), start, options);
+        out.flush();
+    }
+    catch(const std::exception & e) {
+        std::cerr << "Error in the template: " << e.what() << std::endl;
+        return 1;
     }
-
-    std::cout << std::endl;
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,119 @@
+#include "tp/Arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+#include <sys/mman.h>
+
+using namespace tp;
+
+namespace
+{
+    size_t roundUp(size_t value, size_t granularity)
+    {
+        return (value + granularity - 1) / granularity * granularity;
+    }
+
+    char * mapAnonymous(size_t size, int flags)
+    {
+        void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        return p == MAP_FAILED ? nullptr : static_cast<char *>(p);
+    }
+}
+
+Arena::Arena(HugePages huge_pages, size_t region_size)
+    : _huge_pages(huge_pages)
+    , _region_size(roundUp(std::max<size_t>(region_size, 1), HUGE_PAGE_SIZE))
+{
+}
+
+Arena::~Arena()
+{
+    for(const Region & region : _regions)
+        munmap(region.base, region.size);
+}
+
+char * Arena::mapRegion(size_t & size)
+{
+    size = roundUp(size, HUGE_PAGE_SIZE);
+
+    if (_huge_pages == HugePages::Explicit) {
+        char * base = mapAnonymous(size, MAP_HUGETLB);
+        if (base != nullptr) {
+            _stats.huge_regions ++;
+            return base;
+        }
+        // Заранее выделенных больших страниц не хватает, дальше - без MAP_HUGETLB
+        _huge_pages = HugePages::Transparent;
+    }
+
+    if (_huge_pages == HugePages::None)
+        return mapAnonymous(size, 0);
+
+    // Большая страница подставляется только в выровненный по её размеру диапазон,
+    // поэтому отображается запас, а лишнее по краям освобождается
+    char * raw = mapAnonymous(size + HUGE_PAGE_SIZE, 0);
+    if (raw == nullptr)
+        return nullptr;
+
+    uintptr_t address = reinterpret_cast<uintptr_t>(raw);
+    char *    base    = raw + (roundUp(address, HUGE_PAGE_SIZE) - address);
+
+    if (base > raw)
+        munmap(raw, base - raw);
+    if (base + size < raw + size + HUGE_PAGE_SIZE)
+        munmap(base + size, raw + size + HUGE_PAGE_SIZE - (base + size));
+
+    // Ядро без прозрачных больших страниц отвечает ошибкой, область остаётся обычной
+    madvise(base, size, MADV_HUGEPAGE);
+    return base;
+}
+
+void * Arena::do_allocate(size_t bytes, size_t alignment)
+{
+    std::lock_guard locker(_mutex);
+
+    char * p = reinterpret_cast<char *>(roundUp(reinterpret_cast<uintptr_t>(_current), alignment));
+
+    if (_current == nullptr || p + bytes > _end) {
+        size_t size = std::max(_region_size, bytes + alignment);
+        char * base = mapRegion(size);
+        if (base == nullptr)
+            throw std::bad_alloc();
+
+        _regions.push_back({base, size});
+        _stats.regions ++;
+        _stats.reserved += size;
+
+        // Блок больше обычной области получает собственную, текущая остаётся прежней
+        if (size > _region_size && _current != nullptr) {
+            _stats.allocated += bytes;
+            return reinterpret_cast<char *>(roundUp(reinterpret_cast<uintptr_t>(base), alignment));
+        }
+
+        _region_size = std::min(_region_size * 2, MAX_REGION_SIZE);
+        _current     = base;
+        _end         = base + size;
+        p            = reinterpret_cast<char *>(roundUp(reinterpret_cast<uintptr_t>(_current), alignment));
+    }
+
+    _current = p + bytes;
+    _stats.allocated += bytes;
+    return p;
+}
+
+void Arena::do_deallocate(void * , size_t , size_t )
+{
+}
+
+bool Arena::do_is_equal(const std::pmr::memory_resource & other) const noexcept
+{
+    return this == &other;
+}
+
+Arena::Stats Arena::stats() const
+{
+    std::lock_guard locker(_mutex);
+    return _stats;
+}
@@ -0,0 +1,88 @@
+#include "tp/AsyncMutex.h"
+#include "tp/Coroutine.h"
+
+using namespace tp;
+
+class AsyncMutex::AcquireTask : public Task_interface
+{
+    AsyncMutex & _mutex;
+    Waiter &     _waiter;
+
+public:
+    AcquireTask(AsyncMutex & mutex, Waiter & waiter) : _mutex(mutex), _waiter(waiter) {}
+
+    virtual void work() override { _mutex.acquireFor(_waiter); }
+};
+
+bool AsyncMutex::enqueue(Waiter & waiter)
+{
+    std::lock_guard locker(_queue_mutex);
+
+    // Счётчик увеличивается до изменения состояния: освобождающий, обнуливший
+    // состояние после него, обязательно увидит сопрограмму в очереди
+    _queued ++;
+
+    // Состояние 2 заставляет освобождающего разбудить ожидающих
+    if (_state.exchange(2) == 0) {
+        _queued --;
+        return false;
+    }
+
+    waiter.next = nullptr;
+    if (_tail == nullptr)
+        _head = &waiter;
+    else
+        _tail->next = &waiter;
+    _tail = &waiter;
+    return true;
+}
+
+void AsyncMutex::lockSlow()
+{
+    // Захват с состоянием 2: в ожидании могли остаться другие, их разбудит освобождение
+    while(_state.exchange(2, std::memory_order_acquire) != 0)
+        _state.wait(2, std::memory_order_relaxed);
+}
+
+void AsyncMutex::unlockSlow()
+{
+    _state.store(0);
+
+    Waiter * waiter = nullptr;
+    if (_queued.load() != 0) {
+        std::lock_guard locker(_queue_mutex);
+
+        waiter = _head;
+        if (waiter != nullptr) {
+            _head = waiter->next;
+            if (_head == nullptr)
+                _tail = nullptr;
+            _queued --;
+        }
+    }
+
+    _state.notify_one();
+
+    // Сопрограмма продолжится только после захвата, поэтому её поля ещё действительны
+    if (waiter == nullptr)
+        return;
+    if (waiter->pool != nullptr)
+        waiter->pool->submit(new AcquireTask(*this, *waiter));
+    else
+        acquireFor(*waiter);
+}
+
+void AsyncMutex::acquireFor(Waiter & waiter)
+{
+    int expected = 0;
+    if (_state.compare_exchange_strong(expected, 2, std::memory_order_acquire, std::memory_order_relaxed)
+     || !enqueue(waiter))
+        waiter.handle.resume();
+}
+
+bool AsyncMutex::LockAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    _waiter.handle = handle;
+    _waiter.pool   = ThreadPool::current();
+    return _mutex.enqueue(_waiter);
+}
@@ -0,0 +1,232 @@
+#include "tp/Bitmap.h"
+
+#include <algorithm>
+#include <iterator>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    /// dst |= src, возвращает количество единичных бит результата
+    size_t orWordsSoftware(uint64_t * dst, const uint64_t * src, size_t count)
+    {
+        size_t cardinality = 0;
+        for(size_t i=0; i < count; ++i) {
+            dst[i] |= src[i];
+            cardinality += std::popcount(dst[i]);
+        }
+        return cardinality;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("avx2,popcnt")))
+    size_t orWordsAvx2(uint64_t * dst, const uint64_t * src, size_t count)
+    {
+        size_t cardinality = 0;
+        size_t i = 0;
+        for(; i + 4 <= count; i += 4) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(a, b));
+
+            cardinality += _mm_popcnt_u64(dst[i]) + _mm_popcnt_u64(dst[i+1])
+                         + _mm_popcnt_u64(dst[i+2]) + _mm_popcnt_u64(dst[i+3]);
+        }
+        return cardinality + orWordsSoftware(dst + i, src + i, count - i);
+    }
+#endif
+
+    size_t orWords(uint64_t * dst, const uint64_t * src, size_t count)
+    {
+#if defined(__x86_64__)
+        static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        if (avx2)
+            return orWordsAvx2(dst, src, count);
+#endif
+        return orWordsSoftware(dst, src, count);
+    }
+}
+
+namespace tp
+{
+
+void Bitmap::Container::toBitmap()
+{
+    bits.assign(BITMAP_WORDS, 0);
+    for(uint16_t low : array)
+        bits[low / 64] |= uint64_t(1) << (low % 64);
+
+    array.clear();
+    array.shrink_to_fit();
+}
+
+void Bitmap::Container::toArray()
+{
+    array.clear();
+    array.reserve(cardinality);
+    for(size_t w=0; w < BITMAP_WORDS; ++w)
+        for(uint64_t word = bits[w]; word != 0; word &= word - 1)
+            array.push_back(static_cast<uint16_t>(w * 64 + std::countr_zero(word)));
+
+    bits.clear();
+    bits.shrink_to_fit();
+}
+
+std::vector<Bitmap::Container>::iterator Bitmap::find(uint64_t key)
+{
+    return std::lower_bound(_containers.begin(), _containers.end(), key,
+                            [](const Container & c, uint64_t k) { return c.key < k; });
+}
+
+bool Bitmap::add(uint64_t value)
+{
+    uint64_t key = value >> 16;
+    uint16_t low = static_cast<uint16_t>(value);
+
+    auto it = find(key);
+    if (it == _containers.end() || it->key != key) {
+        it = _containers.insert(it, Container {key, 1, {low}, {}});
+        return true;
+    }
+
+    Container & c = *it;
+
+    if (c.isBitmap()) {
+        uint64_t & word = c.bits[low / 64];
+        uint64_t   mask = uint64_t(1) << (low % 64);
+        if (word & mask)
+            return false;
+        word |= mask;
+        c.cardinality ++;
+        return true;
+    }
+
+    auto pos = std::lower_bound(c.array.begin(), c.array.end(), low);
+    if (pos != c.array.end() && *pos == low)
+        return false;
+
+    c.array.insert(pos, low);
+    c.cardinality ++;
+    if (c.cardinality > ARRAY_MAX_SIZE)
+        c.toBitmap();
+    return true;
+}
+
+bool Bitmap::remove(uint64_t value)
+{
+    uint64_t key = value >> 16;
+    uint16_t low = static_cast<uint16_t>(value);
+
+    auto it = find(key);
+    if (it == _containers.end() || it->key != key)
+        return false;
+
+    Container & c = *it;
+
+    if (c.isBitmap()) {
+        uint64_t & word = c.bits[low / 64];
+        uint64_t   mask = uint64_t(1) << (low % 64);
+        if ((word & mask) == 0)
+            return false;
+        word &= ~mask;
+        c.cardinality --;
+        if (c.cardinality <= ARRAY_MAX_SIZE)
+            c.toArray();
+        return true;
+    }
+
+    auto pos = std::lower_bound(c.array.begin(), c.array.end(), low);
+    if (pos == c.array.end() || *pos != low)
+        return false;
+
+    c.array.erase(pos);
+    c.cardinality --;
+    if (c.cardinality == 0)
+        _containers.erase(it);
+    return true;
+}
+
+bool Bitmap::contains(uint64_t value) const
+{
+    uint64_t key = value >> 16;
+    uint16_t low = static_cast<uint16_t>(value);
+
+    auto it = std::lower_bound(_containers.begin(), _containers.end(), key,
+                               [](const Container & c, uint64_t k) { return c.key < k; });
+    if (it == _containers.end() || it->key != key)
+        return false;
+
+    if (it->isBitmap())
+        return (it->bits[low / 64] >> (low % 64)) & 1;
+
+    return std::binary_search(it->array.begin(), it->array.end(), low);
+}
+
+size_t Bitmap::cardinality() const
+{
+    size_t count = 0;
+    for(const Container & c : _containers)
+        count += c.cardinality;
+    return count;
+}
+
+Bitmap & Bitmap::operator |= (const Bitmap & other)
+{
+    if (this == &other)
+        return *this;
+
+    std::vector<Container> result;
+    result.reserve(_containers.size() + other._containers.size());
+
+    auto a = _containers.begin();
+    auto b = other._containers.begin();
+
+    while(a != _containers.end() || b != other._containers.end()) {
+        if (b == other._containers.end() || (a != _containers.end() && a->key < b->key)) {
+            result.push_back(std::move(*a++));
+            continue;
+        }
+        if (a == _containers.end() || b->key < a->key) {
+            result.push_back(*b++);
+            continue;
+        }
+
+        Container & c = *a;
+
+        if (!c.isBitmap() && !b->isBitmap()) {
+            std::vector<uint16_t> merged;
+            merged.reserve(c.array.size() + b->array.size());
+            std::set_union(c.array.begin(), c.array.end(), b->array.begin(), b->array.end(), std::back_inserter(merged));
+
+            c.array       = std::move(merged);
+            c.cardinality = c.array.size();
+            if (c.cardinality > ARRAY_MAX_SIZE)
+                c.toBitmap();
+        }
+        else {
+            if (!c.isBitmap())
+                c.toBitmap();
+
+            if (b->isBitmap())
+                c.cardinality = orWords(c.bits.data(), b->bits.data(), BITMAP_WORDS);
+            else
+                for(uint16_t low : b->array) {
+                    uint64_t & word = c.bits[low / 64];
+                    uint64_t   mask = uint64_t(1) << (low % 64);
+                    c.cardinality += (word & mask) == 0;
+                    word |= mask;
+                }
+        }
+
+        result.push_back(std::move(c));
+        ++a;
+        ++b;
+    }
+
+    _containers = std::move(result);
+    return *this;
+}
+
+}
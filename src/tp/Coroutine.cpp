@@ -0,0 +1,46 @@
+#include "tp/Coroutine.h"
+
+using namespace tp;
+
+TaskGroup::Detached TaskGroup::run(TaskGroup & group, ThreadPool & pool, Task<void> task)
+{
+    co_await schedule(pool);
+
+    std::exception_ptr error;
+    try {
+        co_await task;
+    }
+    catch(...) {
+        error = std::current_exception();
+    }
+
+    group.finish(error);
+}
+
+void TaskGroup::finish(std::exception_ptr error)
+{
+    // Уведомление под мьютексом: после него wait может вернуть управление и разрушить группу
+    std::lock_guard locker(_mutex);
+    if (error && !_error)
+        _error = error;
+    if (--_active == 0)
+        _done.notify_all();
+}
+
+void TaskGroup::spawn(ThreadPool & pool, Task<void> task)
+{
+    {
+        std::lock_guard locker(_mutex);
+        _active ++;
+    }
+    run(*this, pool, std::move(task));
+}
+
+void TaskGroup::wait()
+{
+    std::unique_lock locker(_mutex);
+    _done.wait(locker, [this] { return _active == 0; });
+
+    if (_error)
+        std::rethrow_exception(std::exchange(_error, nullptr));
+}
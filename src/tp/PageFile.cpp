@@ -0,0 +1,216 @@
+#include "tp/PageFile.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace tp;
+
+namespace
+{
+    /// Наименьшее увеличение файла, страниц
+    const size_t MIN_GROWTH = 256;
+
+    /// Страницы, где свободно меньше, не рассматриваются для новых записей
+    const uint16_t MIN_FREE_BYTES = 32;
+}
+
+PageFile::PageFile(const std::string & file_name, size_t max_size)
+    : _file_name(file_name)
+{
+    _fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (_fd < 0)
+        return;
+
+    // Содержимое файла нужно только этому процессу
+    unlink(file_name.c_str());
+
+    // Пространство адресов может быть ограничено (ulimit -v), тогда резервируется меньше
+    for(size_t pages = max_size / PAGE_SIZE; pages > 0; pages /= 2) {
+        void * p = mmap(nullptr, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, _fd, 0);
+        if (p != MAP_FAILED) {
+            _base     = static_cast<char *>(p);
+            _capacity = pages;
+            break;
+        }
+    }
+}
+
+PageFile::~PageFile()
+{
+    if (_base != nullptr)
+        munmap(_base, _capacity * PAGE_SIZE);
+    if (_fd >= 0)
+        close(_fd);
+}
+
+size_t PageFile::appendPages(size_t count)
+{
+    if (_pages + count > _capacity)
+        return SIZE_MAX;
+
+    if (_pages + count > _file_pages) {
+        size_t grown = std::min(_capacity, std::max({_pages + count, 2 * _file_pages, MIN_GROWTH}));
+        if (posix_fallocate(_fd, _file_pages * PAGE_SIZE, (grown - _file_pages) * PAGE_SIZE) != 0)
+            return SIZE_MAX;
+        _file_pages = grown;
+    }
+
+    size_t first = _pages;
+    _pages += count;
+    _stats.pages = _pages;
+    return first;
+}
+
+void PageFile::resetPage(size_t page)
+{
+    header(page) = {0, 0, 0, uint16_t(PAGE_SIZE), uint16_t(PAGE_SIZE - sizeof(PageHeader)), 0};
+}
+
+void PageFile::compactPage(size_t page)
+{
+    PageHeader & h    = header(page);
+    char *       data = _base + page * PAGE_SIZE;
+
+    // Записи переписываются из копии страницы подряд к её концу, слоты не меняются
+    char copy[PAGE_SIZE];
+    std::memcpy(copy, data, PAGE_SIZE);
+
+    size_t end = PAGE_SIZE;
+    for(size_t i=0; i < h.slots; ++i) {
+        Slot & slot = slots(page)[i];
+        if (slot.offset == 0)
+            continue;
+
+        end -= slot.length;
+        std::memcpy(data + end, copy + slot.offset, slot.length);
+        slot.offset = uint16_t(end);
+    }
+    h.data_begin = uint16_t(end);
+}
+
+void PageFile::updateFreePages(size_t page, uint16_t old_free)
+{
+    _free_pages.erase({old_free, uint32_t(page)});
+
+    if (header(page).free_bytes >= MIN_FREE_BYTES)
+        _free_pages.insert({header(page).free_bytes, uint32_t(page)});
+}
+
+PageFile::Ref PageFile::put(std::string_view record)
+{
+    std::lock_guard locker(_mutex);
+
+    if (!valid())
+        return NO_REF;
+
+    if (record.size() > MAX_SMALL) {
+        size_t count = (sizeof(PageHeader) + record.size() + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t page  = appendPages(count);
+        if (page == SIZE_MAX || record.size() > UINT32_MAX)
+            return NO_REF;
+
+        header(page) = {uint32_t(count), uint32_t(record.size()), 0, 0, 0, 0};
+        std::memcpy(_base + page * PAGE_SIZE + sizeof(PageHeader), record.data(), record.size());
+
+        _stats.records ++;
+        _stats.bytes += record.size();
+        _stats.writes ++;
+        return Ref(page) << 16 | LARGE_SLOT;
+    }
+
+    // Страница с наименьшим подходящим свободным местом, иначе - новая
+    size_t page;
+    auto   it = _free_pages.lower_bound({uint16_t(record.size() + sizeof(Slot)), 0});
+    if (it != _free_pages.end())
+        page = it->second;
+    else {
+        page = appendPages(1);
+        if (page == SIZE_MAX)
+            return NO_REF;
+        resetPage(page);
+    }
+
+    PageHeader & h        = header(page);
+    uint16_t     old_free = h.free_bytes;
+
+    size_t slot = 0;
+    while(slot < h.slots && slots(page)[slot].offset != 0)
+        ++slot;
+
+    size_t directory = slot == h.slots ? sizeof(Slot) : 0;
+    if (h.data_begin - sizeof(PageHeader) - h.slots * sizeof(Slot) < record.size() + directory)
+        compactPage(page);
+
+    if (slot == h.slots)
+        h.slots ++;
+
+    h.data_begin -= uint16_t(record.size());
+    std::memcpy(_base + page * PAGE_SIZE + h.data_begin, record.data(), record.size());
+    slots(page)[slot] = {h.data_begin, uint16_t(record.size())};
+    h.free_bytes -= uint16_t(record.size() + directory);
+    updateFreePages(page, old_free);
+
+    _stats.records ++;
+    _stats.bytes += record.size();
+    _stats.writes ++;
+    return Ref(page) << 16 | slot;
+}
+
+std::string_view PageFile::recordLocked(Ref ref) const
+{
+    size_t       page = ref >> 16;
+    size_t       slot = ref & 0xFFFF;
+    const char * data = _base + page * PAGE_SIZE;
+
+    if (slot == LARGE_SLOT)
+        return {data + sizeof(PageHeader), header(page).length};
+
+    const Slot & s = slots(page)[slot];
+    return {data + s.offset, s.length};
+}
+
+void PageFile::free(Ref ref)
+{
+    std::lock_guard locker(_mutex);
+
+    size_t page = ref >> 16;
+    size_t slot = ref & 0xFFFF;
+
+    _stats.records --;
+    _stats.bytes -= recordLocked(ref).size();
+
+    // Страницы большой записи становятся пустыми страницами со слотами
+    if (slot == LARGE_SLOT) {
+        size_t count = header(page).run;
+        for(size_t i=0; i < count; ++i) {
+            resetPage(page + i);
+            updateFreePages(page + i, 0);
+        }
+        return;
+    }
+
+    PageHeader & h        = header(page);
+    uint16_t     old_free = h.free_bytes;
+
+    h.free_bytes += slots(page)[slot].length;
+    slots(page)[slot] = {0, 0};
+
+    while(h.slots > 0 && slots(page)[h.slots - 1].offset == 0) {
+        h.slots --;
+        h.free_bytes += sizeof(Slot);
+    }
+    if (h.slots == 0)
+        resetPage(page);
+
+    updateFreePages(page, old_free);
+}
+
+PageFile::Stats PageFile::stats() const
+{
+    std::lock_guard locker(_mutex);
+    return _stats;
+}
@@ -0,0 +1,116 @@
+#include "tp/Poller.h"
+
+#include <cerrno>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace tp;
+
+Poller::Poller(ThreadPool & pool)
+    : _pool(pool)
+{
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!valid())
+        return;
+
+    // Событие с пустым указателем - сигнал завершения потока
+    epoll_event ev {};
+    ev.events   = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &ev);
+
+    _thread = std::thread(&Poller::loop, this);
+}
+
+Poller::~Poller()
+{
+    if (_thread.joinable()) {
+        _stop = true;
+        uint64_t one = 1;
+        if (write(_wake_fd, &one, sizeof(one)) == sizeof(one))
+            _thread.join();
+        else
+            _thread.detach();
+    }
+
+    for(int fd : {_epoll_fd, _wake_fd})
+        if (fd >= 0)
+            close(fd);
+}
+
+void Poller::loop()
+{
+    epoll_event events[64];
+
+    while(!_stop) {
+        int n = epoll_wait(_epoll_fd, events, 64, -1);
+        if (n < 0 && errno != EINTR)
+            return;
+
+        for(int i=0; i < n; ++i)
+            if (events[i].data.ptr != nullptr)
+                _pool.submit(new ResumeTask(std::coroutine_handle<>::from_address(events[i].data.ptr)));
+    }
+}
+
+bool Poller::arm(int fd, uint32_t events, std::coroutine_handle<> handle)
+{
+    // EPOLLONESHOT: после события дескриптор не наблюдается до следующего ожидания
+    epoll_event ev {};
+    ev.events   = events | EPOLLONESHOT;
+    ev.data.ptr = handle.address();
+
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0)
+        return true;
+    if (errno == ENOENT && epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+        return true;
+
+    // Обычный файл (EPERM) готов всегда, при прочих ошибках её покажет сама операция
+    return false;
+}
+
+Poller::Awaiter Poller::readable(int fd)
+{
+    return Awaiter(*this, fd, EPOLLIN | EPOLLRDHUP);
+}
+
+Poller::Awaiter Poller::writable(int fd)
+{
+    return Awaiter(*this, fd, EPOLLOUT);
+}
+
+Task<ssize_t> tp::asyncRead(Poller & poller, int fd, char * buffer, size_t size)
+{
+    for(;;) {
+        ssize_t n = ::read(fd, buffer, size);
+        if (n >= 0)
+            co_return n;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            co_return -1;
+
+        co_await poller.readable(fd);
+    }
+}
+
+Task<bool> tp::asyncWrite(Poller & poller, int fd, std::string_view data)
+{
+    while(!data.empty()) {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n >= 0) {
+            data.remove_prefix(n);
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            co_return false;
+
+        co_await poller.writable(fd);
+    }
+    co_return true;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file Statistics.cpp
+ * @brief Встроенная статистика: счётчики и гистограммы задержек
+ *
+ */
+
+#include "tp/Statistics.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+using namespace tp;
+
+size_t LatencyHistogram::bucketIndex(uint64_t value)
+{
+    if (value < 2 * SUB_BUCKET_COUNT)
+        return value;
+
+    unsigned msb = 63 - std::countl_zero(value);
+    if (msb >= MAX_VALUE_BITS)
+        return BUCKET_COUNT - 1;
+
+    unsigned shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKET_COUNT + (value >> shift) - SUB_BUCKET_COUNT;
+}
+
+uint64_t LatencyHistogram::bucketValue(size_t index)
+{
+    if (index < 2 * SUB_BUCKET_COUNT)
+        return index;
+
+    unsigned shift    = index / SUB_BUCKET_COUNT - 1;
+    uint64_t mantissa = index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT;
+
+    // Середина корзины
+    return (mantissa << shift) + (uint64_t(1) << shift) / 2;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram & other)
+{
+    for(size_t i=0; i < BUCKET_COUNT; ++i)
+        _buckets[i] += other._buckets[i];
+
+    _count += other._count;
+    _sum   += other._sum;
+    _min    = std::min(_min, other._min);
+    _max    = std::max(_max, other._max);
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    if (_count == 0)
+        return 0;
+
+    uint64_t rank = uint64_t(fraction * double(_count));
+    if (rank >= _count)
+        rank = _count - 1;
+
+    uint64_t seen = 0;
+    for(size_t i=0; i < BUCKET_COUNT; ++i) {
+        seen += _buckets[i];
+        if (seen > rank)
+            return std::clamp(bucketValue(i), min(), _max);
+    }
+
+    return _max;
+}
+
+
+Statistics & Statistics::instance()
+{
+    static Statistics statistics;
+    return statistics;
+}
+
+void Statistics::enable()
+{
+    std::lock_guard locker(_mutex);
+    _enabled_at = clock::now();
+    _enabled = true;
+}
+
+size_t Statistics::registerSeries(const std::string & name)
+{
+    std::lock_guard locker(_mutex);
+
+    auto it = std::find(_series_names.begin(), _series_names.end(), name);
+    if (it != _series_names.end())
+        return it - _series_names.begin();
+
+    _series_names.push_back(name);
+    return _series_names.size() - 1;
+}
+
+Statistics::ThreadData & Statistics::threadData()
+{
+    thread_local ThreadData * data = nullptr;
+
+    if (data == nullptr) {
+        std::lock_guard locker(_mutex);
+        _threads.push_back(std::make_unique<ThreadData>());
+        data = _threads.back().get();
+    }
+
+    return *data;
+}
+
+void Statistics::recordEnabled(size_t series, uint64_t value)
+{
+    ThreadData & data = threadData();
+
+    if (series >= data.series.size())
+        data.series.resize(series + 1);
+
+    if (!data.series[series])
+        data.series[series] = std::make_unique<LatencyHistogram>();
+
+    data.series[series]->record(value);
+}
+
+std::string Statistics::report(Format format) const
+{
+    std::lock_guard locker(_mutex);
+
+    std::vector<LatencyHistogram> merged(_series_names.size());
+    for(const auto & thread : _threads)
+        for(size_t i=0; i < thread->series.size() && i < merged.size(); ++i)
+            if (thread->series[i])
+                merged[i].merge(*thread->series[i]);
+
+    double elapsed = _enabled ? double(nanosecondsSince(_enabled_at)) / 1e9 : 0.0;
+
+    std::string result;
+    char        line[512];
+
+    if (format == Format::Json) {
+        std::snprintf(line, sizeof(line), "{\"elapsed_sec\":%.6f,\"threads\":%zu,\"series\":[", elapsed, _threads.size());
+        result += line;
+    }
+    else {
+        std::snprintf(line, sizeof(line), "Статистика за %.3f с, потоков: %zu\n%-24s %10s %12s %10s %10s %10s %10s %10s %12s\n",
+                      elapsed, _threads.size(),
+                      "series", "count", "per_sec", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "p99.9_ns", "max_ns");
+        result += line;
+    }
+
+    bool first = true;
+    for(size_t i=0; i < merged.size(); ++i) {
+        const LatencyHistogram & h = merged[i];
+        if (h.count() == 0)
+            continue;
+
+        double rate = elapsed > 0 ? double(h.count()) / elapsed : 0.0;
+
+        if (format == Format::Json)
+            std::snprintf(line, sizeof(line),
+                          "%s{\"name\":\"%s\",\"count\":%llu,\"per_sec\":%.1f,\"mean_ns\":%.1f,\"min_ns\":%llu,"
+                          "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+                          first ? "" : ",", _series_names[i].c_str(),
+                          static_cast<unsigned long long>(h.count()), rate, h.mean(),
+                          static_cast<unsigned long long>(h.min()),
+                          static_cast<unsigned long long>(h.percentile(0.5)),
+                          static_cast<unsigned long long>(h.percentile(0.9)),
+                          static_cast<unsigned long long>(h.percentile(0.99)),
+                          static_cast<unsigned long long>(h.percentile(0.999)),
+                          static_cast<unsigned long long>(h.max()));
+        else
+            std::snprintf(line, sizeof(line), "%-24s %10llu %12.1f %10.1f %10llu %10llu %10llu %10llu %12llu\n",
+                          _series_names[i].c_str(),
+                          static_cast<unsigned long long>(h.count()), rate, h.mean(),
+                          static_cast<unsigned long long>(h.percentile(0.5)),
+                          static_cast<unsigned long long>(h.percentile(0.9)),
+                          static_cast<unsigned long long>(h.percentile(0.99)),
+                          static_cast<unsigned long long>(h.percentile(0.999)),
+                          static_cast<unsigned long long>(h.max()));
+
+        result += line;
+        first = false;
+    }
+
+    if (format == Format::Json)
+        result += "]}\n";
+
+    return result;
+}
@@ -16,11 +16,73 @@
  */
 
 #include "tp/ThreadPool.h"
+#include "tp/Trace.h"
 
+#include <algorithm>
 #include <cassert>
+#include <exception>
+#include <memory>
 
 using namespace tp;
 
+namespace
+{
+    thread_local ThreadPool * current_pool = nullptr;
+
+    /**
+     * @brief Общее состояние частей одного вызова runChunks
+     *
+     * @details Живёт, пока на него ссылается хотя бы одна вспомогательная задача:
+     * задача может начать выполнение уже после возврата из runChunks,
+     * тогда она не получит ни одной части и к chunk не обращается.
+     *
+     */
+    struct ForkJoin
+    {
+        const std::function<void(size_t)> * chunk;
+        size_t                              count;
+        std::atomic<size_t>                 next {0};
+        std::atomic<size_t>                 done {0};
+        std::mutex                          error_mutex;
+        std::exception_ptr                  error;
+
+        ForkJoin(const std::function<void(size_t)> * c, size_t n) : chunk(c), count(n) {}
+
+        void run()
+        {
+            for(size_t i; (i = next++) < count; ) {
+                try {
+                    (*chunk)(i);
+                }
+                catch(...) {
+                    std::lock_guard locker(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+
+                if (++done == count)
+                    done.notify_all();
+            }
+        }
+
+        void join()
+        {
+            for(size_t d; (d = done.load()) != count; )
+                done.wait(d);
+        }
+    };
+
+    class ForkJoinTask : public Task_interface
+    {
+        std::shared_ptr<ForkJoin> _state;
+
+    public:
+        explicit ForkJoinTask(std::shared_ptr<ForkJoin> state) : _state(state) {}
+
+        virtual void work() override { _state->run(); }
+    };
+}
+
 ThreadPool::ThreadPool(int number_of_threads)
     : _number_of_threads(number_of_threads)
     , _necessary_to_stop(false)
@@ -41,11 +103,21 @@ ThreadPool::~ThreadPool()
 void ThreadPool::submit(Task_interface * task)
 {
     if (_number_of_threads == 0) {
+        TP_TRACE_SCOPE("pool", "task");
         task->work();
         delete task;
     }
     else {
-        _task_queue.push(task);    
+        QueuedTask queued {task, {}};
+        if (Statistics::instance().enabled())
+            queued.submitted = Statistics::clock::now();
+
+        _task_queue.push(queued);
+        TP_TRACE_INSTANT("queue", "push");
+
+        // Поток проверяет условие и засыпает под _waiting_mutex: без его захвата
+        // уведомление может прийти между проверкой и засыпанием и потеряться
+        { std::lock_guard<std::mutex> locker(_waiting_mutex); }
         _waiting_condition.notify_one();
     }
 }
@@ -71,19 +143,71 @@ catch(...) {
 
 void ThreadPool::worker()
 {
+    static const size_t queue_wait_series = Statistics::instance().registerSeries("pool.queue_wait");
+
+    current_pool = this;
+
     while(!_necessary_to_stop || !_task_queue.empty()) {
         if (_task_queue.empty()) {
             std::unique_lock<std::mutex> locker(_waiting_mutex);
             _waiting_condition.wait(locker, [this]{ return !_task_queue.empty() || _necessary_to_stop; });
         }
 
-        Task_interface * task = nullptr;
+        QueuedTask queued;
+
+        if(_task_queue.try_pop(queued)) {
+            assert(queued.task);
+            TP_TRACE_INSTANT("queue", "pop");
+            if (queued.submitted != Statistics::clock::time_point())
+                Statistics::instance().record(queue_wait_series, Statistics::nanosecondsSince(queued.submitted));
 
-        if(_task_queue.try_pop(task)) {
-            assert(task);
-            task->work();
-            delete task;
+            {
+                TP_TRACE_SCOPE("pool", "task");
+                queued.task->work();
+            }
+            delete queued.task;
         }
     }
 }
 
+
+ThreadPool * ThreadPool::current()
+{
+    return current_pool;
+}
+
+size_t ThreadPool::chunk_count(size_t size, size_t grain) const
+{
+    size_t count = (size + std::max<size_t>(grain, 1) - 1) / std::max<size_t>(grain, 1);
+    return std::clamp<size_t>(count, 1, 4 * std::max(_number_of_threads, 1));
+}
+
+void ThreadPool::runChunks(size_t count, const std::function<void(size_t)> & chunk)
+{
+    static const size_t fork_join_series = Statistics::instance().registerSeries("pool.fork_join");
+
+    ScopedLatency latency(fork_join_series);
+    TP_TRACE_SCOPE("pool", "fork_join");
+
+    auto state = std::make_shared<ForkJoin>(&chunk, count);
+
+    // Одну из частей выполняет вызывающий поток
+    size_t helpers = std::min<size_t>(_number_of_threads, count - 1);
+    for(size_t i=0; i < helpers; ++i)
+        submit(new ForkJoinTask(state));
+
+    state->run();
+    state->join();
+
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
+
+void ThreadPool::parallel_for(size_t size, size_t grain, const std::function<void(size_t,size_t)> & body)
+{
+    size_t count = chunk_count(size, grain);
+
+    runChunks(count, [&](size_t i) {
+        body(size * i / count, size * (i + 1) / count);
+    });
+}
@@ -0,0 +1,93 @@
+/**
+ * @file Trace.cpp
+ * @brief Трассировка событий пула потоков в формате Chrome trace_event
+ *
+ */
+
+#include "tp/Trace.h"
+
+#include <cstdio>
+#include <fstream>
+
+using namespace tp;
+
+Trace & Trace::instance()
+{
+    static Trace trace;
+    return trace;
+}
+
+void Trace::enable()
+{
+    std::lock_guard locker(_mutex);
+    _start = clock::now();
+    _enabled = true;
+}
+
+Trace::ThreadRing & Trace::threadRing()
+{
+    thread_local ThreadRing * ring = nullptr;
+
+    if (ring == nullptr) {
+        auto new_ring = std::make_unique<ThreadRing>();
+        new_ring->events.resize(RING_CAPACITY);
+
+        std::lock_guard locker(_mutex);
+        new_ring->thread_id = _rings.size() + 1;
+        _rings.push_back(std::move(new_ring));
+        ring = _rings.back().get();
+    }
+
+    return *ring;
+}
+
+void Trace::append(const Event & event)
+{
+    ThreadRing & ring = threadRing();
+
+    ring.events[ring.written % RING_CAPACITY] = event;
+    ring.written ++;
+}
+
+bool Trace::write(const std::string & file_name)
+{
+    std::ofstream ofs(file_name);
+    if (!ofs)
+        return false;
+
+    std::lock_guard locker(_mutex);
+
+    ofs << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+
+    bool first = true;
+    char line[256];
+
+    for(const auto & ring : _rings) {
+        std::snprintf(line, sizeof(line),
+                      "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}}",
+                      first ? "" : ",\n", ring->thread_id, ring->thread_id);
+        ofs << line;
+        first = false;
+
+        uint64_t begin = ring->written > RING_CAPACITY ? ring->written - RING_CAPACITY : 0;
+
+        for(uint64_t i=begin; i < ring->written; ++i) {
+            const Event & e = ring->events[i % RING_CAPACITY];
+
+            // Chrome ожидает время в микросекундах
+            if (e.phase == 'X')
+                std::snprintf(line, sizeof(line),
+                              ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}",
+                              e.name, e.category, ring->thread_id, double(e.timestamp) / 1000.0, double(e.duration) / 1000.0);
+            else
+                std::snprintf(line, sizeof(line),
+                              ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f}",
+                              e.name, e.category, ring->thread_id, double(e.timestamp) / 1000.0);
+            ofs << line;
+        }
+    }
+
+    ofs << "\n]}\n";
+
+    return ofs.good();
+}